@@ -212,6 +212,11 @@ void Instance::set_edge_types(EdgeType left_edge_type,
   right_edge_type_ = right_edge_type;
 }
 
+void Instance::set_global_placed_position(
+    const Point& global_placed_position) {
+  global_placed_position_ = global_placed_position;
+}
+
 void Instance::set_position(const Point& position) {
   last_position_ = position_;
   position_ = position;
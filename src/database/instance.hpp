@@ -50,6 +50,8 @@ class Instance {
   // Setters
 
   void set_edge_types(EdgeType left_edge_type, EdgeType right_edge_type);
+  // For ECO moves before Legalizer::Relegalize.
+  void set_global_placed_position(const Point& global_placed_position);
   void set_position(const Point& position);
   //DDA constraint add
   void set_detail_initial_position(const Point& position);
@@ -14,7 +14,7 @@ Interval::Interval()
       capacity_(end_ - begin_),
       fence_region_id_(UNDEFINED_ID),
       x_and_sub_instance_id_sorted_by_x_(),
-      cluster_x_and_overlap_by_right_x_() {
+      cluster_x_and_overlap_sorted_by_right_x_() {
 }
 
 Interval::Interval(RowId row_id, double begin, double end,
@@ -25,7 +25,7 @@ Interval::Interval(RowId row_id, double begin, double end,
       capacity_(end_ - begin_),
       fence_region_id_(fence_region_id),
       x_and_sub_instance_id_sorted_by_x_(),
-      cluster_x_and_overlap_by_right_x_() {
+      cluster_x_and_overlap_sorted_by_right_x_() {
 }
 
 void Interval::Print(ostream& os, int indent_level) const {
@@ -95,16 +95,16 @@ double Interval::ComputeAccumulatedOverlap(double sub_instance_x,
                                            double sub_instance_width) const {
   const double sub_instance_right_x = sub_instance_x + sub_instance_width;
 
-  auto it = cluster_x_and_overlap_by_right_x_.upper_bound(sub_instance_x);
+  const int cluster_idx = FindClusterIdx(sub_instance_x);
 
-  if (it == cluster_x_and_overlap_by_right_x_.end()) {
+  if (cluster_idx == cluster_x_and_overlap_sorted_by_right_x_.size()) {
     return 0.0;
   }
 
-  const double cluster_right_x = it->first;
-  const auto& cluster_left_x_and_overlap = it->second;
-  const double cluster_left_x = cluster_left_x_and_overlap.first;
-  const double cluster_overlap = cluster_left_x_and_overlap.second;
+  const auto& cluster = cluster_x_and_overlap_sorted_by_right_x_[cluster_idx];
+  const double cluster_right_x = cluster.first;
+  const double cluster_left_x = cluster.second.first;
+  const double cluster_overlap = cluster.second.second;
 
   assert(cluster_left_x < sub_instance_right_x);
 
@@ -138,32 +138,53 @@ void Interval::add_sub_instance_id(SubInstanceId id, double x, double width) {
 
   const double right_x = x + width;
 
-  auto it = cluster_x_and_overlap_by_right_x_.upper_bound(x);
+  auto& clusters = cluster_x_and_overlap_sorted_by_right_x_;
+  const int cluster_idx = FindClusterIdx(x);
 
-  if (it == cluster_x_and_overlap_by_right_x_.end()) {
-    cluster_x_and_overlap_by_right_x_.insert(
-        it, make_pair(right_x, make_pair(x, 0.0)));
-  } else {
-    const double cluster_right_x = it->first;
-    const auto& cluster_left_x_and_overlap = it->second;
-    const double cluster_left_x = cluster_left_x_and_overlap.first;
-    const double cluster_overlap = cluster_left_x_and_overlap.second;
+  if (cluster_idx == clusters.size()) {
+    clusters.push_back(make_pair(right_x, make_pair(x, 0.0)));
 
-    assert(cluster_left_x < right_x);
+    return;
+  }
+
+  const double cluster_right_x = clusters[cluster_idx].first;
+  const double cluster_left_x = clusters[cluster_idx].second.first;
+  const double cluster_overlap = clusters[cluster_idx].second.second;
+
+  assert(cluster_left_x < right_x);
+
+  const double overlap = cluster_overlap + (min(cluster_right_x, right_x) -
+                                            max(cluster_left_x, x));
+
+  // The previous cluster ends at or before x, so the cluster stays in place
+  // unless it now ends at or after the next one. Then it moves, and is
+  // dropped if its right x is taken, as when re-keying a map entry.
+
+  if (cluster_idx + 1 == clusters.size() ||
+      right_x < clusters[cluster_idx + 1].first) {
+    clusters[cluster_idx] =
+        make_pair(right_x, make_pair(cluster_left_x, overlap));
+
+    return;
+  }
+
+  clusters.erase(clusters.begin() + cluster_idx);
 
-    const double overlap = cluster_overlap + (min(cluster_right_x, right_x) -
-                                              max(cluster_left_x, x));
+  auto it = lower_bound(
+      clusters.begin() + cluster_idx, clusters.end(), right_x,
+      [](const pair<double, pair<double, double>>& cluster, double right_x) {
+        return cluster.first < right_x;
+      });
 
-    it = cluster_x_and_overlap_by_right_x_.erase(it);
-    cluster_x_and_overlap_by_right_x_.insert(
-        it, make_pair(right_x, make_pair(cluster_left_x, overlap)));
+  if (it == clusters.end() || it->first != right_x) {
+    clusters.insert(it, make_pair(right_x, make_pair(cluster_left_x, overlap)));
   }
 }
 
 void Interval::remove_sub_instance_ids() {
   capacity_ = end_ - begin_;
   x_and_sub_instance_id_sorted_by_x_.clear();
-  cluster_x_and_overlap_by_right_x_.clear();
+  cluster_x_and_overlap_sorted_by_right_x_.clear();
 }
 
 void Interval::SortSubInstancesByX() {
@@ -174,3 +195,25 @@ void Interval::SortSubInstancesByX() {
          return pair_a.first < pair_b.first;
        });
 }
+
+// Private members
+
+int Interval::FindClusterIdx(double x) const {
+  const auto& clusters = cluster_x_and_overlap_sorted_by_right_x_;
+  const int num_clusters = clusters.size();
+
+  // Check the last cluster first for sub-instances added in x order.
+
+  if (num_clusters == 0 || clusters.back().first <= x) {
+    return num_clusters;
+  }
+
+  if (num_clusters == 1 || clusters[num_clusters - 2].first <= x) {
+    return num_clusters - 1;
+  }
+
+  return upper_bound(clusters.begin(), clusters.end(), x,
+                     [](double x, const pair<double, pair<double, double>>&
+                                      cluster) { return x < cluster.first; }) -
+         clusters.begin();
+}
@@ -3,7 +3,6 @@
 
 #include "../util/type.hpp"
 
-#include <map>
 #include <vector>
 
 class Interval {
@@ -45,6 +44,10 @@ class Interval {
   void SortSubInstancesByX();
 
  private:
+  // Index of the first cluster ending after x, the number of clusters if
+  // there is none.
+  int FindClusterIdx(double x) const;
+
   RowId row_id_;
   double begin_;
   double end_;
@@ -52,8 +55,13 @@ class Interval {
   FenceRegionId fence_region_id_;
   std::vector<std::pair<double, SubInstanceId>>
       x_and_sub_instance_id_sorted_by_x_;
-  // TODO: Explain what cluster_x_and_overlap_by_right_x_ is.
-  std::map<double, std::pair<double, double>> cluster_x_and_overlap_by_right_x_;
+  // Clusters of overlapping sub-instances as (right x, (left x, accumulated
+  // overlap)), sorted by right x. A sub-instance joins the first cluster
+  // ending after its x, which then ends where the sub-instance does. Kept in
+  // a flat vector since sub-instances mostly arrive in x order and only
+  // touch the last cluster.
+  std::vector<std::pair<double, std::pair<double, double>>>
+      cluster_x_and_overlap_sorted_by_right_x_;
 };
 
 #endif
@@ -32,25 +32,42 @@ void Window::add_site(SiteId id){
 	num_site_ = site_.size();
 }
 
-int Window::num_site(){
+void Window::clear_subinstances(){
+	subinstance_.clear();
+	num_subinstance_ = 0;
+}
+
+int Window::num_site() const{
 	return num_site_;
 }
 
-int Window::num_subinstance(){
+int Window::num_subinstance() const{
 	return num_subinstance_;
 }
 
-double Window::density(){
+double Window::density() const{
 	double area_ = width_*height_;
 	double capacity_ = Site::width()*Site::height()*num_site_;
     double density_ = capacity_/area_;
 	return density_;
 }
 
-double Window::width(){
+double Window::width() const{
 	return width_;
 }
 
-double Window::height(){
+double Window::height() const{
 	return height_;
 }
+
+const Point& Window::position_top() const{
+	return position_top_;
+}
+
+const Point& Window::position_down() const{
+	return position_down_;
+}
+
+SubInstanceId Window::subinstance(int idx) const{
+	return subinstance_.at(idx);
+}
@@ -13,15 +13,19 @@ class Window {
 		Window();
 		Window(const Point& position_top,const Point& position_down,std::vector<SiteId> windowspace,std::vector<SubInstanceId> subinstance);
 		//Getter
-		int num_site();
-		int num_subinstance();
-		double density();
-		double width();
-		double height();
+		int num_site() const;
+		int num_subinstance() const;
+		double density() const;
+		double width() const;
+		double height() const;
+		const Point& position_top() const;
+		const Point& position_down() const;
+		SubInstanceId subinstance(int idx) const;
 		
 		//Setter
 		void add_subinstance(SubInstanceId id);
 		void add_site(SiteId id);
+		void clear_subinstances();
 	private:
 		int num_site_;
 		int num_subinstance_;
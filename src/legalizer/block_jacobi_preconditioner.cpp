@@ -0,0 +1,65 @@
+#include "block_jacobi_preconditioner.hpp"
+
+#include <cassert>
+#include <vector>
+
+using namespace std;
+
+using Index = Eigen::Index;
+
+BlockJacobiPreconditioner::BlockJacobiPreconditioner()
+    : num_upper_rows_(0), block_diagonal_solver_() {
+}
+
+// Setters
+
+void BlockJacobiPreconditioner::set_num_upper_rows(Index num_upper_rows) {
+  num_upper_rows_ = num_upper_rows;
+}
+
+Vector BlockJacobiPreconditioner::solve(const Vector& rhs) const {
+  Vector x(rhs.rows());
+  block_diagonal_solver_.Solve(rhs, x);
+
+  return x;
+}
+
+Eigen::ComputationInfo BlockJacobiPreconditioner::info() const {
+  return Eigen::Success;
+}
+
+// Private members
+
+void BlockJacobiPreconditioner::Compute(const SparseMatrix& matrix) {
+  assert(matrix.rows() == matrix.cols() && num_upper_rows_ <= matrix.rows());
+
+  const Index num_lower_rows = matrix.rows() - num_upper_rows_;
+
+  vector<Triplet> upper_non_zero_elements;
+  vector<Triplet> lower_non_zero_elements;
+
+  for (Index i = 0; i < matrix.outerSize(); ++i) {
+    for (SparseMatrix::InnerIterator it(matrix, i); it; ++it) {
+      if (it.row() < num_upper_rows_ && it.col() < num_upper_rows_) {
+        upper_non_zero_elements.push_back(
+            Triplet(it.row(), it.col(), it.value()));
+      } else if (it.row() == it.col()) {
+        lower_non_zero_elements.push_back(
+            Triplet(it.row() - num_upper_rows_, it.col() - num_upper_rows_,
+                    it.value()));
+      }
+    }
+  }
+
+  SparseMatrix upper_left_matrix(num_upper_rows_, num_upper_rows_);
+  upper_left_matrix.setFromTriplets(upper_non_zero_elements.begin(),
+                                    upper_non_zero_elements.end());
+
+  SparseMatrix lower_right_matrix(num_lower_rows, num_lower_rows);
+  lower_right_matrix.setFromTriplets(lower_non_zero_elements.begin(),
+                                     lower_non_zero_elements.end());
+
+  block_diagonal_solver_.Compute(upper_left_matrix,
+                                 SparseMatrix(num_lower_rows, num_upper_rows_),
+                                 lower_right_matrix);
+}
@@ -0,0 +1,45 @@
+#ifndef BLOCK_JACOBI_PRECONDITIONER_HPP
+#define BLOCK_JACOBI_PRECONDITIONER_HPP
+
+#include "block_triangular_solver.hpp"
+#include "sparse_matrix.hpp"
+#include "vector.hpp"
+
+// Block-Jacobi preconditioner for the MMSIM matrix M + I. The upper left
+// num_upper_rows x num_upper_rows part is approximated by its diagonal blocks
+// and the rest by its diagonal. Follows the preconditioner interface of the
+// Eigen iterative solvers.
+
+class BlockJacobiPreconditioner {
+ public:
+  BlockJacobiPreconditioner();
+
+  // Setters
+
+  void set_num_upper_rows(Eigen::Index num_upper_rows);
+
+  template <typename MatrixType>
+  BlockJacobiPreconditioner& analyzePattern(const MatrixType&) {
+    return *this;
+  }
+  template <typename MatrixType>
+  BlockJacobiPreconditioner& factorize(const MatrixType& matrix) {
+    return compute(matrix);
+  }
+  template <typename MatrixType>
+  BlockJacobiPreconditioner& compute(const MatrixType& matrix) {
+    Compute(SparseMatrix(matrix));
+
+    return *this;
+  }
+  Vector solve(const Vector& rhs) const;
+  Eigen::ComputationInfo info() const;
+
+ private:
+  void Compute(const SparseMatrix& matrix);
+
+  Eigen::Index num_upper_rows_;
+  BlockTriangularSolver<double> block_diagonal_solver_;
+};
+
+#endif
@@ -0,0 +1,345 @@
+#include "block_triangular_solver.hpp"
+
+#include <Eigen/Dense>
+
+#include <cassert>
+
+using namespace std;
+
+using Index = Eigen::Index;
+
+template <typename Scalar>
+BlockTriangularSolver<Scalar>::BlockTriangularSolver()
+    : block_offsets_(),
+      variable_indices_(),
+      block_inverse_offsets_(),
+      block_inverses_(),
+      lower_left_matrix_(),
+      sub_diagonal_(),
+      diagonal_(),
+      super_diagonal_(),
+      modified_super_diagonal_(),
+      inverse_modified_diagonal_(),
+      active_modified_super_diagonal_() {
+}
+
+template <typename Scalar>
+void BlockTriangularSolver<Scalar>::Compute(
+    const SparseMatrix& upper_left_matrix,
+    const SparseMatrix& lower_left_matrix,
+    const SparseMatrix& lower_right_matrix) {
+  assert(upper_left_matrix.rows() == upper_left_matrix.cols());
+  assert(lower_right_matrix.rows() == lower_right_matrix.cols());
+  assert(lower_left_matrix.rows() == lower_right_matrix.rows());
+  assert(lower_left_matrix.cols() == upper_left_matrix.cols());
+
+  ComputeBlockDiagonal(upper_left_matrix);
+  ComputeTridiagonal(lower_right_matrix);
+
+  lower_left_matrix_ = lower_left_matrix.cast<Scalar>();
+}
+
+template <typename Scalar>
+void BlockTriangularSolver<Scalar>::Solve(const ScalarVector& rhs,
+                                          ScalarVector& x) const {
+  const Index num_upper_rows = lower_left_matrix_.cols();
+  const Index num_lower_rows = lower_left_matrix_.rows();
+
+  assert(rhs.rows() == num_upper_rows + num_lower_rows);
+  assert(x.rows() == rhs.rows() && x.data() != rhs.data());
+
+  // Solve the diagonal blocks of the upper left matrix.
+
+  const int num_blocks = block_offsets_.size() - 1;
+  for (int i = 0; i < num_blocks; ++i) {
+    SolveBlock(i, rhs, x);
+  }
+
+  // Solve the tridiagonal lower right matrix in place.
+
+  for (Index i = 0; i < num_lower_rows; ++i) {
+    Scalar value = ComputeLowerRhs(i, rhs, x);
+    if (i > 0) {
+      value -= sub_diagonal_[i] * x(num_upper_rows + i - 1);
+    }
+
+    x(num_upper_rows + i) = value * inverse_modified_diagonal_[i];
+  }
+  for (Index i = num_lower_rows - 2; i >= 0; --i) {
+    x(num_upper_rows + i) -=
+        modified_super_diagonal_[i] * x(num_upper_rows + i + 1);
+  }
+}
+
+template <typename Scalar>
+void BlockTriangularSolver<Scalar>::SolveActive(
+    const ScalarVector& rhs, const vector<int>& block_indices,
+    const vector<int>& lower_row_indices, ScalarVector& x) {
+  const Index num_upper_rows = lower_left_matrix_.cols();
+  const Index num_lower_rows = lower_left_matrix_.rows();
+  const int num_active_lower_rows = lower_row_indices.size();
+
+  assert(rhs.rows() == num_upper_rows + num_lower_rows);
+  assert(x.rows() == rhs.rows() && x.data() != rhs.data());
+
+  for (int block_idx : block_indices) {
+    SolveBlock(block_idx, rhs, x);
+  }
+
+  // Consecutive active rows form tridiagonal runs. Known neighbours of a run
+  // move to the right-hand side.
+
+  active_modified_super_diagonal_.resize(num_active_lower_rows);
+
+  for (int j = 0; j < num_active_lower_rows; ++j) {
+    const int i = lower_row_indices[j];
+    const bool is_run_continued = j > 0 && lower_row_indices[j - 1] == i - 1;
+    const bool is_run_ended = j + 1 == num_active_lower_rows ||
+                              lower_row_indices[j + 1] != i + 1;
+
+    Scalar value = ComputeLowerRhs(i, rhs, x);
+    Scalar modified_diagonal = diagonal_[i];
+
+    if (i > 0) {
+      value -= sub_diagonal_[i] * x(num_upper_rows + i - 1);
+    }
+    if (is_run_continued) {
+      modified_diagonal -=
+          sub_diagonal_[i] * active_modified_super_diagonal_[j - 1];
+    }
+    if (is_run_ended && i + 1 < num_lower_rows) {
+      value -= super_diagonal_[i] * x(num_upper_rows + i + 1);
+    }
+
+    assert(modified_diagonal != 0.0);
+
+    active_modified_super_diagonal_[j] =
+        is_run_ended ? 0.0 : super_diagonal_[i] / modified_diagonal;
+    x(num_upper_rows + i) = value / modified_diagonal;
+  }
+  for (int j = num_active_lower_rows - 2; j >= 0; --j) {
+    const int i = lower_row_indices[j];
+
+    x(num_upper_rows + i) -=
+        active_modified_super_diagonal_[j] * x(num_upper_rows + i + 1);
+  }
+}
+
+// Getters
+
+template <typename Scalar>
+int BlockTriangularSolver<Scalar>::num_blocks() const {
+  return block_offsets_.size() - 1;
+}
+
+template <typename Scalar>
+int BlockTriangularSolver<Scalar>::block_size(int block_idx) const {
+  return block_offsets_[block_idx + 1] - block_offsets_[block_idx];
+}
+
+template <typename Scalar>
+int BlockTriangularSolver<Scalar>::block_variable_idx(int block_idx,
+                                                      int idx) const {
+  return variable_indices_[block_offsets_[block_idx] + idx];
+}
+
+// Private members
+
+template <typename Scalar>
+void BlockTriangularSolver<Scalar>::ComputeBlockDiagonal(
+    const SparseMatrix& matrix) {
+  const int num_rows = matrix.rows();
+
+  // Find the diagonal blocks as connected components of the nonzero pattern.
+
+  vector<int> parent_idx(num_rows);
+  for (int i = 0; i < num_rows; ++i) {
+    parent_idx[i] = i;
+  }
+
+  auto find_root_idx = [&](int idx) {
+    while (parent_idx[idx] != idx) {
+      parent_idx[idx] = parent_idx[parent_idx[idx]];
+      idx = parent_idx[idx];
+    }
+    return idx;
+  };
+
+  for (Index i = 0; i < matrix.outerSize(); ++i) {
+    for (SparseMatrix::InnerIterator it(matrix, i); it; ++it) {
+      const int root_row_idx = find_root_idx(it.row());
+      const int root_col_idx = find_root_idx(it.col());
+
+      if (root_row_idx != root_col_idx) {
+        parent_idx[max(root_row_idx, root_col_idx)] =
+            min(root_row_idx, root_col_idx);
+      }
+    }
+  }
+
+  // Group variables by block, in ascending order inside each block.
+
+  vector<int> block_idx_by_root_idx(num_rows, -1);
+  vector<int> block_idx_by_variable_idx(num_rows);
+  vector<int> block_sizes;
+
+  for (int i = 0; i < num_rows; ++i) {
+    const int root_idx = find_root_idx(i);
+
+    if (block_idx_by_root_idx[root_idx] == -1) {
+      block_idx_by_root_idx[root_idx] = block_sizes.size();
+      block_sizes.push_back(0);
+    }
+
+    block_idx_by_variable_idx[i] = block_idx_by_root_idx[root_idx];
+    ++block_sizes[block_idx_by_variable_idx[i]];
+  }
+
+  const int num_blocks = block_sizes.size();
+
+  block_offsets_.assign(num_blocks + 1, 0);
+  block_inverse_offsets_.assign(num_blocks + 1, 0);
+  for (int i = 0; i < num_blocks; ++i) {
+    block_offsets_[i + 1] = block_offsets_[i] + block_sizes[i];
+    block_inverse_offsets_[i + 1] =
+        block_inverse_offsets_[i] + block_sizes[i] * block_sizes[i];
+  }
+
+  variable_indices_.assign(num_rows, -1);
+  vector<int> local_idx_by_variable_idx(num_rows);
+  vector<int> next_positions(block_offsets_.begin(), block_offsets_.end() - 1);
+
+  for (int i = 0; i < num_rows; ++i) {
+    const int block_idx = block_idx_by_variable_idx[i];
+
+    local_idx_by_variable_idx[i] =
+        next_positions[block_idx] - block_offsets_[block_idx];
+    variable_indices_[next_positions[block_idx]++] = i;
+  }
+
+  // Scatter the matrix into dense blocks and invert them in place.
+
+  vector<double> block_inverses(block_inverse_offsets_[num_blocks], 0.0);
+
+  for (Index i = 0; i < matrix.outerSize(); ++i) {
+    for (SparseMatrix::InnerIterator it(matrix, i); it; ++it) {
+      const int block_idx = block_idx_by_variable_idx[it.row()];
+      const int block_size = block_sizes[block_idx];
+
+      block_inverses[block_inverse_offsets_[block_idx] +
+                     local_idx_by_variable_idx[it.col()] * block_size +
+                     local_idx_by_variable_idx[it.row()]] += it.value();
+    }
+  }
+
+  for (int i = 0; i < num_blocks; ++i) {
+    const int block_size = block_sizes[i];
+    double* block = &block_inverses[block_inverse_offsets_[i]];
+
+    if (block_size == 1) {
+      assert(block[0] != 0.0);
+
+      block[0] = 1 / block[0];
+
+      continue;
+    }
+
+    Eigen::Map<Eigen::MatrixXd> dense_block(block, block_size, block_size);
+    const Eigen::PartialPivLU<Eigen::MatrixXd> lu(dense_block);
+
+    dense_block = lu.inverse();
+  }
+
+  block_inverses_.assign(block_inverses.begin(), block_inverses.end());
+}
+
+template <typename Scalar>
+void BlockTriangularSolver<Scalar>::ComputeTridiagonal(
+    const SparseMatrix& matrix) {
+  const int num_rows = matrix.rows();
+
+  vector<double> sub_diagonal(num_rows, 0.0);
+  vector<double> diagonal(num_rows, 0.0);
+  vector<double> super_diagonal(num_rows, 0.0);
+
+  for (Index i = 0; i < matrix.outerSize(); ++i) {
+    for (SparseMatrix::InnerIterator it(matrix, i); it; ++it) {
+      if (it.row() == it.col()) {
+        diagonal[it.row()] += it.value();
+      } else if (it.row() == it.col() + 1) {
+        sub_diagonal[it.row()] += it.value();
+      } else {
+        assert(it.row() + 1 == it.col());
+
+        super_diagonal[it.row()] += it.value();
+      }
+    }
+  }
+
+  vector<double> modified_super_diagonal(num_rows, 0.0);
+  vector<double> inverse_modified_diagonal(num_rows, 0.0);
+
+  for (int i = 0; i < num_rows; ++i) {
+    double modified_diagonal = diagonal[i];
+    if (i > 0) {
+      modified_diagonal -= sub_diagonal[i] * modified_super_diagonal[i - 1];
+    }
+
+    assert(modified_diagonal != 0.0);
+
+    inverse_modified_diagonal[i] = 1 / modified_diagonal;
+    modified_super_diagonal[i] = super_diagonal[i] / modified_diagonal;
+  }
+
+  sub_diagonal_.assign(sub_diagonal.begin(), sub_diagonal.end());
+  diagonal_.assign(diagonal.begin(), diagonal.end());
+  super_diagonal_.assign(super_diagonal.begin(), super_diagonal.end());
+  modified_super_diagonal_.assign(modified_super_diagonal.begin(),
+                                  modified_super_diagonal.end());
+  inverse_modified_diagonal_.assign(inverse_modified_diagonal.begin(),
+                                    inverse_modified_diagonal.end());
+}
+
+template <typename Scalar>
+void BlockTriangularSolver<Scalar>::SolveBlock(int block_idx,
+                                               const ScalarVector& rhs,
+                                               ScalarVector& x) const {
+  const int block_begin = block_offsets_[block_idx];
+  const int block_size = block_offsets_[block_idx + 1] - block_begin;
+  const Scalar* block_inverse =
+      &block_inverses_[block_inverse_offsets_[block_idx]];
+
+  if (block_size == 1) {
+    x(variable_indices_[block_begin]) =
+        block_inverse[0] * rhs(variable_indices_[block_begin]);
+
+    return;
+  }
+
+  for (int j = 0; j < block_size; ++j) {
+    Scalar value = 0.0;
+    for (int k = 0; k < block_size; ++k) {
+      value += block_inverse[k * block_size + j] *
+               rhs(variable_indices_[block_begin + k]);
+    }
+
+    x(variable_indices_[block_begin + j]) = value;
+  }
+}
+
+// Right-hand side of a lower row after substituting the upper solution.
+template <typename Scalar>
+Scalar BlockTriangularSolver<Scalar>::ComputeLowerRhs(
+    Index lower_row_idx, const ScalarVector& rhs, const ScalarVector& x) const {
+  Scalar value = rhs(lower_left_matrix_.cols() + lower_row_idx);
+  for (typename Eigen::SparseMatrix<Scalar, Eigen::RowMajor>::InnerIterator it(
+           lower_left_matrix_, lower_row_idx);
+       it; ++it) {
+    value -= it.value() * x(it.col());
+  }
+
+  return value;
+}
+
+template class BlockTriangularSolver<float>;
+template class BlockTriangularSolver<double>;
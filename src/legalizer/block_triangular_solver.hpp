@@ -0,0 +1,104 @@
+#ifndef BLOCK_TRIANGULAR_SOLVER_HPP
+#define BLOCK_TRIANGULAR_SOLVER_HPP
+
+#include "sparse_matrix.hpp"
+#include "vector.hpp"
+
+#include <vector>
+
+// Direct solver for the lower block-triangular matrix
+//
+//   [U, 0]
+//   [L, T]
+//
+// where U is block diagonal up to a symmetric permutation (e.g. one small
+// block per multi-row-height instance) and T is tridiagonal. Each block of U
+// is inverted densely, and T is factorized by the Thomas algorithm, so there
+// is no fill-in and no pivoting.
+//
+// Factors are computed in double and stored as Scalar. Instantiated for float
+// and double.
+
+template <typename Scalar>
+class BlockTriangularSolver {
+ public:
+  using ScalarVector = Eigen::Matrix<Scalar, Eigen::Dynamic, 1>;
+
+  BlockTriangularSolver();
+
+  void Compute(const SparseMatrix& upper_left_matrix,
+               const SparseMatrix& lower_left_matrix,
+               const SparseMatrix& lower_right_matrix);
+  // Copy the factors of another solver, rounded to Scalar.
+  template <typename OtherScalar>
+  void Compute(const BlockTriangularSolver<OtherScalar>& solver);
+  // Solve into x, which must be of the right size and must not alias rhs.
+  // Nothing is allocated.
+  void Solve(const ScalarVector& rhs, ScalarVector& x) const;
+  // Solve only the given diagonal blocks of the upper left matrix and the
+  // given rows of the lower right matrix, both in ascending order. All other
+  // entries of x are kept and taken as known.
+  void SolveActive(const ScalarVector& rhs,
+                   const std::vector<int>& block_indices,
+                   const std::vector<int>& lower_row_indices, ScalarVector& x);
+
+  // Getters
+
+  int num_blocks() const;
+  int block_size(int block_idx) const;
+  int block_variable_idx(int block_idx, int idx) const;
+
+ private:
+  template <typename OtherScalar>
+  friend class BlockTriangularSolver;
+
+  void ComputeBlockDiagonal(const SparseMatrix& matrix);
+  void ComputeTridiagonal(const SparseMatrix& matrix);
+  void SolveBlock(int block_idx, const ScalarVector& rhs,
+                  ScalarVector& x) const;
+  Scalar ComputeLowerRhs(Eigen::Index lower_row_idx, const ScalarVector& rhs,
+                         const ScalarVector& x) const;
+
+  // Variables of block i are variable_indices_[block_offsets_[i]] to
+  // variable_indices_[block_offsets_[i + 1] - 1]. Its inverse is stored
+  // column-major from block_inverses_[block_inverse_offsets_[i]].
+  std::vector<int> block_offsets_;
+  std::vector<int> variable_indices_;
+  std::vector<int> block_inverse_offsets_;
+  std::vector<Scalar> block_inverses_;
+
+  Eigen::SparseMatrix<Scalar, Eigen::RowMajor> lower_left_matrix_;
+
+  // Thomas algorithm factors. The sub-diagonal is kept as is, the
+  // super-diagonal is divided by the modified diagonal. SolveActive refactors
+  // each run of active rows on the fly from the original diagonals.
+  std::vector<Scalar> sub_diagonal_;
+  std::vector<Scalar> diagonal_;
+  std::vector<Scalar> super_diagonal_;
+  std::vector<Scalar> modified_super_diagonal_;
+  std::vector<Scalar> inverse_modified_diagonal_;
+  std::vector<Scalar> active_modified_super_diagonal_;
+};
+
+template <typename Scalar>
+template <typename OtherScalar>
+void BlockTriangularSolver<Scalar>::Compute(
+    const BlockTriangularSolver<OtherScalar>& solver) {
+  auto cast_values = [](const std::vector<OtherScalar>& values) {
+    return std::vector<Scalar>(values.begin(), values.end());
+  };
+
+  block_offsets_ = solver.block_offsets_;
+  variable_indices_ = solver.variable_indices_;
+  block_inverse_offsets_ = solver.block_inverse_offsets_;
+  block_inverses_ = cast_values(solver.block_inverses_);
+  lower_left_matrix_ = solver.lower_left_matrix_.template cast<Scalar>();
+  sub_diagonal_ = cast_values(solver.sub_diagonal_);
+  diagonal_ = cast_values(solver.diagonal_);
+  super_diagonal_ = cast_values(solver.super_diagonal_);
+  modified_super_diagonal_ = cast_values(solver.modified_super_diagonal_);
+  inverse_modified_diagonal_ = cast_values(solver.inverse_modified_diagonal_);
+  active_modified_super_diagonal_.clear();
+}
+
+#endif
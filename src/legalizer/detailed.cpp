@@ -2,12 +2,15 @@
 #include "detailed.hpp"
 
 #include "../util/const.hpp"
+#include "dimacs_writer.hpp"
+#include "sat_result_reader.hpp"
 #include "sparse_matrix.hpp"
 #include "vector.hpp"
 
 #include <Eigen/SparseLU>
 #include <stdio.h>
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cmath>
 #include <fstream>
@@ -19,10 +22,26 @@
 
 using namespace std;
 
-Detailed::Detailed(Database& database): database_(database){
+Detailed::Detailed(Database& database): is_sat_partitioned_(false), is_adjacent_swap_allowed_(false), database_(database){
 	subinstancematrix_.clear();
 }
 
+void Detailed::set_sat_input_file_name(const string& file_name){
+	sat_input_file_name_ = file_name;
+}
+
+void Detailed::set_sat_output_file_name(const string& file_name){
+	sat_output_file_name_ = file_name;
+}
+
+void Detailed::set_is_sat_partitioned(bool is_sat_partitioned){
+	is_sat_partitioned_ = is_sat_partitioned;
+}
+
+void Detailed::set_is_adjacent_swap_allowed(bool is_adjacent_swap_allowed){
+	is_adjacent_swap_allowed_ = is_adjacent_swap_allowed;
+}
+
 void Detailed::PreDetailedPlacement(){
 	cout<<"============================================================"<<endl;
 	cout<<"Initial DDA Constraint..."<<endl;
@@ -35,15 +54,22 @@ void Detailed::PreDetailedPlacement(){
 }
 void Detailed::PreSATMethod(){
 	SatProblem();
-	//SatProblemPartition()
 	SatInput();
-	//SatInputPartition()
-	cout<<"Output SAT input format..."<<endl;
+	if(is_sat_partitioned_){
+		SatProblemPartition();
+		SatInputPartition();
+	}
+	cout<<"Build SAT clauses..."<<endl;
 }
 void Detailed::PostSATMethod(){
-	cout<<"Input SAT result format..."<<endl;
-	SatOutput();
-	//SatOutputPartition();
+	cout<<"Solve SAT problem..."<<endl;
+	if(!sat_output_file_name_.empty()){
+		SatOutputFile();
+	} else if(is_sat_partitioned_){
+		SatOutputPartition();
+	} else {
+		SatOutput();
+	}
 	FindForbiddenPair();
 }
 
@@ -142,78 +168,28 @@ void Detailed::InitialPlacementConstraint(){
 }
 
 void Detailed::DynamicProgramming(){
+	//every row is solved exactly with its multi-row instances kept as they
+	//are, then the multi-row instances are flipped where it pays off over all
+	//their rows and those rows are solved again, until nothing is flipped
+	vector<int> row_idxs(subinstancematrix_.size());
+	for(int i = 0; i < row_idxs.size(); i++){
+		row_idxs[i] = i;
+	}
+	int num_flips = 0;
+	int num_swaps = 0;
+	int num_multirow_flips = 0;
+	int num_rounds = 0;
 	double total_displacement = 0;
-	for(int i = 0; i < subinstancematrix_.size(); i++){	
-		vector<SubInstanceId>& subinstance_row = subinstancematrix_[i];
-		//cout<<i<<" = "<<subinstance_row.size()<<endl;
-		for(int j = 1; j < (subinstance_row.size()-2) ; j++ ){
-			SubInstanceId A_id = subinstance_row[j-1];
-			SubInstanceId B_id = subinstance_row[j];
-			SubInstanceId C_id = subinstance_row[j+1];
-			SubInstanceId D_id = subinstance_row[j+2];
-			SubInstance& A = database_.sub_instance(A_id);
-			SubInstance& B = database_.sub_instance(B_id);
-			SubInstance& C = database_.sub_instance(C_id);
-			SubInstance& D = database_.sub_instance(D_id);
-			if(B.dda_forbidden){
-				switch(test_dda_forbidden(A,B,C,D)){
-					case 1 :
-						B.flipped();
-						//flipped_cell(B);
-						break;
-					case 2 :
-						C.flipped();
-						//flipped_cell(C);
-						break;
-					case 3 :
-						B.flipped();
-						C.flipped();
-						//flipped_cell(B);
-						//flipped_cell(C);
-						break;
-					case 4 :
-						swap_cell(B,C,total_displacement);
-						subinstance_row[j] = C_id;
-						subinstance_row[j+1] = B_id ;
-						break;
-					case 5 :
-						swap_cell(B,C,total_displacement);
-						subinstance_row[j] = C_id;
-						subinstance_row[j+1] = B_id ;
-						C.flipped();
-						//flipped_cell(C);
-						break;
-					case 6 :
-						swap_cell(B,C,total_displacement);
-						subinstance_row[j] = C_id;
-						subinstance_row[j+1] = B_id ;
-						B.flipped();
-						//flipped_cell(B);
-						break;
-					case 7 :
-						swap_cell(B,C,total_displacement);
-						subinstance_row[j] = C_id;
-						subinstance_row[j+1] = B_id ;
-						C.flipped();
-						//flipped_cell(C);
-						break;
-					default :
-						break;
-				}
-			}
-			/*else if(B.od_forbidden){
-				switch(test_od_forbidden(A,B,C,D)){
-					case 1 :
-						swap_cell(B,C);
-						subinstance_row[j] = C_id;
-						subinstance_row[j+1] = B_id ;
-						break;
-					default :
-						break;
-				}
-			}*/
+	while(!row_idxs.empty()){
+		#pragma omp parallel for schedule(dynamic) reduction(+:num_flips,num_swaps,total_displacement)
+		for(int i = 0; i < row_idxs.size(); i++){
+			SolveRowByDynamicProgramming(row_idxs[i],num_flips,num_swaps,total_displacement);
 		}
+		num_multirow_flips += FlipMultiRowInstances(row_idxs);
+		num_rounds++;
 	}
+	cout<<"#  DP rounds: "<<num_rounds<<", flips: "<<num_flips<<", multi-row flips: "
+		<<num_multirow_flips<<", swaps: "<<num_swaps<<endl;
 	cout<<"#  Total_displacement:  "<<total_displacement<<endl;
 	for(int i = 0; i < database_.num_sub_instances(); i++){
 		SubInstanceId sub_instance_id(i);
@@ -225,6 +201,187 @@ void Detailed::DynamicProgramming(){
 	}
 }
 
+void Detailed::SolveRowByDynamicProgramming(int row_idx,int& num_flips,int& num_swaps,double& total_displacement){
+	//Viterbi over the cells of the row from left to right. The state of a
+	//position is the cell placed there, its own or a neighbor swapped in, and
+	//its orientation; only adjacent cells share a forbidden pair
+	struct Cost {
+		int num_pairs;
+		double displacement;
+		int num_moves;
+	};
+	auto is_less = [](const Cost& a,const Cost& b){
+		if(a.num_pairs != b.num_pairs){ return a.num_pairs < b.num_pairs; }
+		if(fabs(a.displacement-b.displacement) > 1e-9){ return a.displacement < b.displacement; }
+		return a.num_moves < b.num_moves;
+	};
+	//role of the cell at a position: its own, the right one swapped in, or
+	//the left one swapped in
+	const int OWN = 0;
+	const int SWAP_RIGHT = 1;
+	const int SWAP_LEFT = 2;
+	const int NUM_STATES = 6;
+	const int ROLE_OFFSETS[3] = {0,1,-1};
+
+	vector<SubInstanceId>& subinstance_row = subinstancematrix_[row_idx];
+	const int num_cells = subinstance_row.size();
+	if(num_cells == 0){
+		return;
+	}
+	//gates of every cell as {lefttop, leftbottom, righttop, rightbottom},
+	//kept and flipped
+	vector< array<array<bool,4>,2> > gates(num_cells);
+	vector<char> can_flip(num_cells);
+	vector<char> can_swap(num_cells,false);
+	vector<double> swap_displacement(num_cells,0.0);
+	for(int i = 0; i < num_cells; i++){
+		SubInstance& subinstance = database_.sub_instance(subinstance_row[i]);
+		const Instance& instance = database_.instance(subinstance.instance_id());
+		gates[i][0] = {{subinstance.lefttop(),subinstance.leftbottom(),subinstance.righttop(),subinstance.rightbottom()}};
+		gates[i][1] = {{subinstance.righttop(),subinstance.rightbottom(),subinstance.lefttop(),subinstance.leftbottom()}};
+		can_flip[i] = (!instance.is_fixed() && instance.num_sub_instances() == 1);
+		if(is_adjacent_swap_allowed_ && i > 0){
+			can_swap[i-1] = can_swap_cell(subinstance_row[i-1],subinstance_row[i],swap_displacement[i-1]);
+		}
+	}
+
+	vector< array<Cost,NUM_STATES> > cost(num_cells);
+	vector< array<signed char,NUM_STATES> > previous_state(num_cells);
+	auto cell_idx = [&](int position,int state){
+		return position + ROLE_OFFSETS[state/2];
+	};
+	auto is_valid = [&](int position,int state){
+		const int role = state/2;
+		if(role == SWAP_RIGHT && (position+1 >= num_cells || !can_swap[position])){ return false; }
+		if(role == SWAP_LEFT && (position == 0 || !can_swap[position-1])){ return false; }
+		return (state%2 == 0 || can_flip[cell_idx(position,state)]);
+	};
+	for(int i = 0; i < num_cells; i++){
+		for(int s = 0; s < NUM_STATES; s++){
+			cost[i][s].num_pairs = numeric_limits<int>::max();
+			previous_state[i][s] = -1;
+			if(!is_valid(i,s) || (i == 0 && s/2 == SWAP_LEFT)){
+				continue;
+			}
+			Cost base = {0,0.0,0};
+			if(i > 0){
+				//the state kept first wins ties
+				for(int t = 0; t < NUM_STATES; t++){
+					const bool is_swap_open = (t/2 == SWAP_RIGHT);
+					if(cost[i-1][t].num_pairs == numeric_limits<int>::max() || is_swap_open != (s/2 == SWAP_LEFT)){
+						continue;
+					}
+					const array<bool,4>& left = gates[cell_idx(i-1,t)][t%2];
+					const array<bool,4>& right = gates[cell_idx(i,s)][s%2];
+					Cost candidate = cost[i-1][t];
+					if(judge_dda_pair(left[2],left[3],right[0],right[1])){
+						candidate.num_pairs++;
+					}
+					if(previous_state[i][s] == -1 || is_less(candidate,base)){
+						base = candidate;
+						previous_state[i][s] = t;
+					}
+				}
+				if(previous_state[i][s] == -1){
+					continue;
+				}
+			}
+			if(s%2 == 1){
+				base.num_moves++;
+			}
+			if(s/2 == SWAP_RIGHT){
+				base.displacement += swap_displacement[i];
+				base.num_moves++;
+			}
+			cost[i][s] = base;
+		}
+	}
+	int state = OWN*2;
+	for(int s = 1; s < NUM_STATES; s++){
+		if(s/2 != SWAP_RIGHT && cost[num_cells-1][s].num_pairs != numeric_limits<int>::max()
+			&& is_less(cost[num_cells-1][s],cost[num_cells-1][state])){
+			state = s;
+		}
+	}
+	//apply the states from right to left; a swap is applied at its left end,
+	//after its right end has been flipped
+	for(int i = num_cells-1; i >= 0; i--){
+		SubInstance& subinstance = database_.sub_instance(subinstance_row[cell_idx(i,state)]);
+		if(state%2 == 1){
+			subinstance.flipped();
+			num_flips++;
+		}
+		if(state/2 == SWAP_RIGHT){
+			swap_cell(subinstance_row[i],subinstance_row[i+1],total_displacement);
+			swap(subinstance_row[i],subinstance_row[i+1]);
+			num_swaps++;
+		}
+		state = previous_state[i][state];
+	}
+}
+
+int Detailed::FlipMultiRowInstances(vector<int>& row_idxs){
+	//position of every sub instance in its row
+	vector<int> row_idx_by_subinstance(database_.num_sub_instances(),UNDEFINED_ID);
+	vector<int> idx_by_subinstance(database_.num_sub_instances(),UNDEFINED_ID);
+	for(int i = 0; i < subinstancematrix_.size(); i++){
+		for(int j = 0 ; j < subinstancematrix_[i].size();j++){
+			row_idx_by_subinstance[(int)subinstancematrix_[i][j]] = i;
+			idx_by_subinstance[(int)subinstancematrix_[i][j]] = j;
+		}
+	}
+	//forbidden pairs of the sub instance with its neighbors in its row
+	auto count_pairs = [&](SubInstanceId subinstance_id){
+		const vector<SubInstanceId>& subinstance_row = subinstancematrix_[row_idx_by_subinstance[(int)subinstance_id]];
+		const int j = idx_by_subinstance[(int)subinstance_id];
+		SubInstance& subinstance = database_.sub_instance(subinstance_id);
+		int num_pairs = 0;
+		if(j > 0){
+			SubInstance& left = database_.sub_instance(subinstance_row[j-1]);
+			num_pairs += judge_dda_pair(left.righttop(),left.rightbottom(),subinstance.lefttop(),subinstance.leftbottom());
+		}
+		if(j+1 < subinstance_row.size()){
+			SubInstance& right = database_.sub_instance(subinstance_row[j+1]);
+			num_pairs += judge_dda_pair(subinstance.righttop(),subinstance.rightbottom(),right.lefttop(),right.leftbottom());
+		}
+		return num_pairs;
+	};
+	vector<char> is_row_changed(subinstancematrix_.size(),false);
+	int num_multirow_flips = 0;
+	for(int i = 0; i < database_.num_instances(); i++){
+		const InstanceId instance_id(i);
+		const Instance& instance = database_.instance(instance_id);
+		if(instance.is_fixed() || instance.num_sub_instances() < 2
+			|| row_idx_by_subinstance[(int)instance.sub_instance_id(0)] == UNDEFINED_ID){
+			continue;
+		}
+		int gain = 0;
+		for(int k = 0; k < instance.num_sub_instances(); k++){
+			const SubInstanceId subinstance_id = instance.sub_instance_id(k);
+			gain += count_pairs(subinstance_id);
+			database_.sub_instance(subinstance_id).flipped();
+			gain -= count_pairs(subinstance_id);
+		}
+		if(gain > 0){
+			for(int k = 0; k < instance.num_sub_instances(); k++){
+				is_row_changed[row_idx_by_subinstance[(int)instance.sub_instance_id(k)]] = true;
+			}
+			num_multirow_flips++;
+		} else {
+			for(int k = 0; k < instance.num_sub_instances(); k++){
+				database_.sub_instance(instance.sub_instance_id(k)).flipped();
+			}
+		}
+	}
+	row_idxs.clear();
+	for(int i = 0; i < is_row_changed.size(); i++){
+		if(is_row_changed[i]){
+			row_idxs.push_back(i);
+		}
+	}
+	return num_multirow_flips;
+}
+
 
 void Detailed::SatProblem(){
 	//build first variable
@@ -266,34 +423,35 @@ void Detailed::SatProblem(){
 }
 
 void Detailed::SatInput(){
-	vector< vector<int> >   forbidden_clause;
-	int total_clause = 0 ;
+	//clauses of every row as DIMACS literals, each clause terminated by 0,
+	//generated in parallel and then taken in row order
+	forbidden_clause_by_row_.assign(subinstancematrix_.size(),vector<int>());
 	int contraint_one = 0 ;
 	int contraint_two = 0 ;
 	int contraint_three = 0 ;
+	#pragma omp parallel for schedule(dynamic) reduction(+:contraint_one,contraint_two,contraint_three)
 	for(int i = 0; i < subinstancematrix_.size(); i++){
-		//constraint 1
+		vector<int>& forbidden_clause = forbidden_clause_by_row_[i];
+		//constraint 1, in the bottom row of the instance
 		for(int j = 0 ; j < subinstancematrix_[i].size();j++){
 			SubInstanceId subinstance_id = subinstancematrix_[i][j];
 			SubInstance& subinstance = database_.sub_instance(subinstance_id);
 			InstanceId instance_id = subinstance.instance_id();
 			Instance& instance = database_.instance(instance_id);
 			
-			if(instance.is_set_variable == false){
-				vector<int> clause;
-				vector<int> inv_clause;
+			if(instance.bottom_sub_instance_id() == subinstance_id){
 				for(int k = 0; k < instance.num_variables() ;k++){
 					VariableId variable_id = instance.variable_id(k);
-					//cout<<(int)variable_id<<"  ";
-					clause.push_back((int)variable_id);
-					inv_clause.push_back(-(int)variable_id);
+					forbidden_clause.push_back((int)variable_id);
 				}
-				//cout<<endl;
+				forbidden_clause.push_back(0);
+				for(int k = 0; k < instance.num_variables() ;k++){
+					VariableId variable_id = instance.variable_id(k);
+					forbidden_clause.push_back(-(int)variable_id);
+				}
+				forbidden_clause.push_back(0);
 				contraint_one++;
 				contraint_one++;
-				forbidden_clause.push_back(clause);
-				forbidden_clause.push_back(inv_clause);
-				instance.is_set_variable = true;
 			}
 		}
 		//constraint 2
@@ -301,17 +459,16 @@ void Detailed::SatInput(){
 			SiteId site_id = sitematrix_[i][j];
 			Site& site = database_.site(site_id);
 			if(site.num_variables()!=0){
-				vector<int> clause;
 				for(int k = 0; k < site.num_variables(); k++){
 					VariableId variable_id = site.variable_id(k);
-					clause.push_back(-(int)variable_id);
+					forbidden_clause.push_back(-(int)variable_id);
 				}
+				forbidden_clause.push_back(0);
 				contraint_two++;
-				forbidden_clause.push_back(clause);
 			}
 		}
 		//constraint 3
-		for(int j = 0; j < (subinstancematrix_[i].size()-1); j++){
+		for(int j = 0; j + 1 < subinstancematrix_[i].size(); j++){
 			SubInstanceId subinstance_id_A = subinstancematrix_[i][j];
 			SubInstanceId subinstance_id_B = subinstancematrix_[i][j+1];
 
@@ -349,11 +506,10 @@ void Detailed::SatInput(){
 						test4 =  B.leftbottom();					
 					}
 					if(judge_dda_pair(test1,test2,test3,test4)){
-						vector<int> clause;
-						clause.push_back(-(int)A_id);
-						clause.push_back(-(int)B_id);
+						forbidden_clause.push_back(-(int)A_id);
+						forbidden_clause.push_back(-(int)B_id);
+						forbidden_clause.push_back(0);
 						contraint_three++;
-						forbidden_clause.push_back(clause);
 					}
 				}
 			}	
@@ -366,252 +522,182 @@ void Detailed::SatInput(){
 	for(int i = 0;i < numvariable_.size();i++){
 		total_variable = (total_variable+numvariable_[i]);
 	}
+	const int total_clause = contraint_one + contraint_two + contraint_three;
 	//total output
-	fstream fp;
-	string output = "./pre/input";
-	string numtxt;
-	stringstream ss;
-	//ss << i; 
-	//ss >>numtxt;
-	
-	//string outputfile = (output+numtxt);
-	string outputfile = (output);
-	fp.open(outputfile.c_str(),ios::out);
-	
-	fp<<"p cnf "<<total_variable<<" "<<forbidden_clause.size()<<endl;
-	for(int j = 0 ; j < forbidden_clause.size();j++){
-		vector<int> clause = forbidden_clause[j];
-		for(int k = 0;k < clause.size(); k++){
-			fp<<clause[k]<<" ";
+	if(!sat_input_file_name_.empty()){
+		DimacsWriter writer;
+		if(!writer.Open(sat_input_file_name_)){
+			cout<<"Fail to open file: "<<sat_input_file_name_<<endl;
+		} else {
+			writer.WriteHeader(total_variable,total_clause);
+			for(int i = 0; i < forbidden_clause_by_row_.size(); i++){
+				writer.WriteClauses(forbidden_clause_by_row_[i].data(),forbidden_clause_by_row_[i].size());
+			}
+			if(!writer.Close()){
+				cout<<"Fail to write file: "<<sat_input_file_name_<<endl;
+			}
 		}
-		fp<<"0"<<endl;
 	}
+	//total clauses, kept by row when every partition gets its own solver
+	if(is_sat_partitioned_){
+		return;
+	}
+	for(int i = 0; i < forbidden_clause_by_row_.size(); i++){
+		const vector<int>& forbidden_clause = forbidden_clause_by_row_[i];
+		int begin = 0;
+		for(int j = 0; j < forbidden_clause.size(); j++){
+			if(forbidden_clause[j] == 0){
+				sat_solver_.AddClause(&forbidden_clause[begin],j-begin);
+				begin = j+1;
+			}
+		}
+	}
+	vector< vector<int> >().swap(forbidden_clause_by_row_);
 }
 
 void Detailed::SatOutput(){
-	ifstream fp;
-	string output = "./post/output";
-	stringstream ss;
-	string outputfile = (output);
-	fp.open(outputfile.c_str(),ios::in);
-	if(!fp){ 
-        cout<<"Fail to open file: "<<outputfile<<endl;
+	const SatResult result = sat_solver_.Solve();
+	cout<<"s "<<result<<" ("<<sat_solver_.num_conflicts()<<" conflicts, "
+		<<sat_solver_.num_decisions()<<" decisions)"<<endl;
+	if(result != SatResult::SATISFIABLE){
 		return;
-    }
-	string text;
-	bool is_start = false; 
-	while(is_start == false){
-		getline(fp,text);
-		if(text[0] == 's'){
-			is_start = true;
-		}
 	}
 	//output result
-	vector<int> satresult;
-	while(fp>>text){
-		satresult.push_back(atoi(text.c_str()));
-	}
-	for(int i = 0;i < satresult.size();i++){
-		if(satresult[i] > 0 ){
-			VariableId variableid = (VariableId)satresult[i];
+	for(int i = 1;i <= sat_solver_.num_variables();i++){
+		if(sat_solver_.value(i)){
+			VariableId variableid = (VariableId)i;
 			Variable& variable = database_.variable(variableid);
 			variable.selected = true;
 		}
 	}		
-	for(int i = 0 ; i < subinstancematrix_.size();i++){
-		for(int j = 0 ; j < subinstancematrix_[i].size();j++){
-			SubInstanceId subinstance_id = subinstancematrix_[i][j];
-			SubInstance& subinstance = database_.sub_instance(subinstance_id);
-			InstanceId instance_id = subinstance.instance_id();
-			Instance& instance = database_.instance(instance_id);
-			for(int k = 0 ; k < instance.num_variables();k++){
-				VariableId variable_id = instance.variable_id(k);
-				Variable& variable = database_.variable(variable_id);
-				if(variable.selected == true){
-					bool is_flipped = variable.flipped();
-					if(is_flipped){
-						subinstance.flipped();
-					}
-				}
-			}
-		}
-	}
+	FlipSelectedSubInstances();
 }
 
+void Detailed::SatOutputFile(){
+	SatResultReader reader(database_);
+	if(!reader.Read(sat_output_file_name_)){
+		cout<<"Fail to read SAT result: "<<reader.error()<<endl;
+		return;
+	}
+	FlipSelectedSubInstances();
+}
 
 void Detailed::SatProblemPartition(){
-	//build first variable
-	database_.add_variable(Variable());
-	for(int i = 0; i < subinstancematrix_.size(); i++){
-	//for(int i = 0; i < 1; i++){
-		int total_variable = 0 ;
-		for(int j = 0 ; j < subinstancematrix_[i].size();j++){
-			const SubInstanceId subinstance_id = subinstancematrix_[i][j];
-			SubInstance& subinstance = database_.sub_instance(subinstance_id);
-			VariableId variable_id = database_.add_variable(Variable(subinstance_id,false,subinstance.position()));
-			VariableId flip_variable_id = database_.add_variable(Variable(subinstance_id,true,subinstance.position()));
-			//cout<<(int)variable_id<<"   "<<(int)flip_variable_id<<endl;
-			subinstance.add_variable_id(variable_id);
-			subinstance.add_variable_id(flip_variable_id);
-			total_variable++;
-			total_variable++;
-			
-			SiteId site_id = database_.site_id_by_position(subinstance.position());
-			Site& site = database_.site(site_id);
-		
-			site.add_variable_id(variable_id);
-			site.add_variable_id(flip_variable_id);
+	//rows sharing a multi-row instance share its variables, so union them
+	const int num_rows = subinstancematrix_.size();
+	vector<int> parent_row_idx(num_rows);
+	for(int i = 0; i < num_rows; i++){
+		parent_row_idx[i] = i;
+	}
+	auto find_root_row_idx = [&](int row_idx){
+		while(parent_row_idx[row_idx] != row_idx){
+			parent_row_idx[row_idx] = parent_row_idx[parent_row_idx[row_idx]];
+			row_idx = parent_row_idx[row_idx];
 		}
-		numvariable_.push_back(total_variable);
-	}	
-}
-
-void Detailed::SatInputPartition(){
-	vector< vector<int> >   forbidden_clause;
-	
-	for(int i = 0; i < subinstancematrix_.size(); i++){
-		//constraint 1
+		return row_idx;
+	};
+	vector<int> bottom_row_idx_by_instance(database_.num_instances(),UNDEFINED_ID);
+	for(int i = 0; i < num_rows; i++){
 		for(int j = 0 ; j < subinstancematrix_[i].size();j++){
-			SubInstanceId subinstance_id = subinstancematrix_[i][j];
-			SubInstance& subinstance = database_.sub_instance(subinstance_id);
-			vector<int> clause;
-			vector<int> inv_clause;
-			for(int k = 0; k < subinstance.num_variables() ;k++){
-				VariableId variable_id = subinstance.variable_id(k);
-				//cout<<(int)variable_id<<"  ";
-				clause.push_back((int)variable_id);
-				inv_clause.push_back(-(int)variable_id);
+			SubInstance& subinstance = database_.sub_instance(subinstancematrix_[i][j]);
+			const int instance_idx = (int)subinstance.instance_id();
+			if(bottom_row_idx_by_instance[instance_idx] == UNDEFINED_ID){
+				bottom_row_idx_by_instance[instance_idx] = i;
+			} else {
+				parent_row_idx[find_root_row_idx(i)] =
+					find_root_row_idx(bottom_row_idx_by_instance[instance_idx]);
 			}
-			//cout<<endl;
-			forbidden_clause.push_back(clause);
-			forbidden_clause.push_back(inv_clause);
-			//instance.is_set_variable = true;
-
 		}
-		//constraint 2
-		for(int j = 0 ; j < sitematrix_[i].size(); j++){
-			SiteId site_id = sitematrix_[i][j];
-			Site& site = database_.site(site_id);
-			if(site.num_variables()!=0){
-				vector<int> clause;
-				for(int k = 0; k < site.num_variables(); k++){
-					VariableId variable_id = site.variable_id(k);
-					clause.push_back(-(int)variable_id);
-				}
-				forbidden_clause.push_back(clause);
-			}
+	}
+	//rows of every partition in ascending order
+	vector<int> partition_idx_by_root_row_idx(num_rows,UNDEFINED_ID);
+	for(int i = 0; i < num_rows; i++){
+		const int root_row_idx = find_root_row_idx(i);
+		if(partition_idx_by_root_row_idx[root_row_idx] == UNDEFINED_ID){
+			partition_idx_by_root_row_idx[root_row_idx] = rows_by_partition_.size();
+			rows_by_partition_.push_back(vector<int>());
 		}
-		//constraint 3
-		
-		for(int j = 0; j < (subinstancematrix_[i].size()-1); j++){
-			
-			SubInstanceId subinstance_id_A = subinstancematrix_[i][j];
-			SubInstanceId subinstance_id_B = subinstancematrix_[i][j+1];
+		rows_by_partition_[partition_idx_by_root_row_idx[root_row_idx]].push_back(i);
+	}
+	//largest partitions first, so they do not start last on the threads
+	stable_sort(rows_by_partition_.begin(),rows_by_partition_.end(),
+		[](const vector<int>& a,const vector<int>& b){ return a.size() > b.size(); });
+	cout<<"SAT partitions = "<<rows_by_partition_.size()<<" (largest "
+		<<(rows_by_partition_.empty() ? 0 : rows_by_partition_[0].size())<<" rows)"<<endl;
+}
 
-			SubInstance& A = database_.sub_instance(subinstance_id_A);
-			SubInstance& B = database_.sub_instance(subinstance_id_B);
-				
-			for(int k = 0; k < A.num_variables();k++){
-				VariableId A_id = A.variable_id(k);
-				Variable& A_a = database_.variable(A_id);
-				bool test1;
-				bool test2;
-				if(A_a.flipped()){
-					test1 = A.lefttop();
-					test2 = A.leftbottom();
-				} else {
-					test1 = A.righttop();
-					test2 = A.rightbottom();					
+void Detailed::SatInputPartition(){
+	//every variable belongs to the rows of one partition, so the partitions
+	//renumber their own variables from 1 without sharing any
+	partition_sat_solvers_.assign(rows_by_partition_.size(),SatSolver());
+	variable_ids_by_partition_.assign(rows_by_partition_.size(),vector<VariableId>());
+	vector<int> local_variable_by_variable(database_.num_variables(),0);
+	#pragma omp parallel for schedule(dynamic)
+	for(int i = 0; i < rows_by_partition_.size(); i++){
+		SatSolver& sat_solver = partition_sat_solvers_[i];
+		vector<VariableId>& variable_ids = variable_ids_by_partition_[i];
+		vector<int> clause;
+		for(int j = 0; j < rows_by_partition_[i].size(); j++){
+			vector<int>& forbidden_clause = forbidden_clause_by_row_[rows_by_partition_[i][j]];
+			for(int k = 0; k < forbidden_clause.size(); k++){
+				const int literal = forbidden_clause[k];
+				if(literal == 0){
+					sat_solver.AddClause(clause);
+					clause.clear();
+					continue;
 				}
-				
-				for(int m = 0; m < B.num_variables();m++){
-					VariableId B_id = B.variable_id(m);
-					Variable& B_b = database_.variable(B_id);
-					bool test3;
-					bool test4;
-					if(B_b.flipped()){
-						test3 = B.righttop();
-						test4 = B.rightbottom();
-					} else {
-						test3 =  B.lefttop();
-						test4 =  B.leftbottom();					
-					}
-					if(judge_dda_pair(test1,test2,test3,test4)){
-						vector<int> clause;
-						clause.push_back(-(int)A_id);
-						clause.push_back(-(int)B_id);
-						forbidden_clause.push_back(clause);
-					}
+				int& local_variable = local_variable_by_variable[abs(literal)];
+				if(local_variable == 0){
+					variable_ids.push_back((VariableId)abs(literal));
+					local_variable = variable_ids.size();
 				}
-			}	
-		}
-		
-	}
-	
-	int total_variable = 0;
-	for(int i = 0;i < numvariable_.size();i++){
-		total_variable = (total_variable+numvariable_[i]);
-	}
-	//total output
-	
-	fstream fp;
-	string output = "./pre/input";
-	//string numtxt;
-	stringstream ss;
-	//ss << i; 
-	//ss >>numtxt;
-	
-	//string outputfile = (output+numtxt);
-	string outputfile = (output);
-	fp.open(outputfile.c_str(),ios::out);
-	
-	fp<<"p cnf "<<total_variable<<" "<<forbidden_clause.size()<<endl;
-	for(int j = 0 ; j < forbidden_clause.size();j++){
-		vector<int> clause = forbidden_clause[j];
-		for(int k = 0;k < clause.size(); k++){
-			fp<<clause[k]<<" ";
+				clause.push_back(literal > 0 ? local_variable : -local_variable);
+			}
+			vector<int>().swap(forbidden_clause);
 		}
-		fp<<"0"<<endl;
 	}
+	vector< vector<int> >().swap(forbidden_clause_by_row_);
 }
 
 void Detailed::SatOutputPartition(){
-	for(int i = 0 ; i < subinstancematrix_.size();i++){
-		ifstream fp;
-		string output = "./post/output";
-		string numtxt;
-		stringstream ss;
-		ss << i; 
-		ss >>numtxt;
-		string outputfile = (output +numtxt);
-		fp.open(outputfile.c_str(),ios::in);
-		string text;
-		bool is_start = false; 
-		while(is_start == false){
-			getline(fp,text);
-			if(text[0] == 's'){
-				is_start = true;
-			}
+	const int num_partitions = partition_sat_solvers_.size();
+	int num_satisfiable = 0;
+	int num_unsatisfiable = 0;
+	int num_conflicts = 0;
+	#pragma omp parallel for schedule(dynamic) reduction(+:num_satisfiable,num_unsatisfiable,num_conflicts)
+	for(int i = 0; i < num_partitions; i++){
+		SatSolver& sat_solver = partition_sat_solvers_[i];
+		const SatResult result = sat_solver.Solve();
+		num_conflicts += sat_solver.num_conflicts();
+		if(result == SatResult::UNSATISFIABLE){
+			num_unsatisfiable++;
 		}
-		//output result
-		vector<int> satresult;
-		while(fp>>text){
-			satresult.push_back(atoi(text.c_str()));
+		if(result != SatResult::SATISFIABLE){
+			continue;
 		}
-		for(int i = 0;i < satresult.size();i++){
-			if(satresult[i] > 0 ){
-				VariableId variableid = (VariableId)satresult[i];
-				Variable& variable = database_.variable(variableid);
-				variable.selected = true;
+		num_satisfiable++;
+		//output result, a partition without a model keeps its orientation
+		for(int j = 1; j <= sat_solver.num_variables(); j++){
+			if(sat_solver.value(j)){
+				database_.variable(variable_ids_by_partition_[i][j-1]).selected = true;
 			}
-		}		
+		}
 	}
+	cout<<"s "<<num_satisfiable<<"/"<<num_partitions<<" partitions SATISFIABLE, "
+		<<num_unsatisfiable<<" UNSATISFIABLE ("<<num_conflicts<<" conflicts)"<<endl;
+	vector<SatSolver>().swap(partition_sat_solvers_);
+	FlipSelectedSubInstances();
+}
+
+void Detailed::FlipSelectedSubInstances(){
 	for(int i = 0 ; i < subinstancematrix_.size();i++){
 		for(int j = 0 ; j < subinstancematrix_[i].size();j++){
 			SubInstanceId subinstance_id = subinstancematrix_[i][j];
 			SubInstance& subinstance = database_.sub_instance(subinstance_id);
-			for(int k = 0 ; k < subinstance.num_variables();k++){
-				VariableId variable_id = subinstance.variable_id(k);
+			InstanceId instance_id = subinstance.instance_id();
+			Instance& instance = database_.instance(instance_id);
+			for(int k = 0 ; k < instance.num_variables();k++){
+				VariableId variable_id = instance.variable_id(k);
 				Variable& variable = database_.variable(variable_id);
 				if(variable.selected == true){
 					bool is_flipped = variable.flipped();
@@ -624,73 +710,6 @@ void Detailed::SatOutputPartition(){
 	}
 }
 
-int Detailed::test_dda_forbidden(SubInstance A,SubInstance B,SubInstance C,SubInstance D){
-	bool N1  = A.righttop();
-	bool N2  = A.rightbottom();
-	bool N3  = B.lefttop();
-	bool N4  = B.leftbottom();
-	bool N5  = B.righttop();
-	bool N6  = B.rightbottom();
-	bool N7  = C.lefttop();
-	bool N8  = C.leftbottom();
-	bool N9  = C.righttop();
-	bool N10 = C.rightbottom();
-	bool N11 = D.lefttop();
-	bool N12 = D.leftbottom();
-	
-	bool test1 = false;
-	bool test2 = false;
-	bool test3 = false;
-	bool test4 = false;
-	bool test5 = false;
-	bool test6 = false;
-	bool test7 = false;
-	if(judge_dda_pair(N1,N2,N5,N6)==false &&
-		judge_dda_pair(N3,N4,N7,N8)==false &&
-		judge_dda_pair(N9,N10,N11,N12)==false){
-			test1 = true;
-		}
-	if(judge_dda_pair(N1,N2,N3,N4)==false &&
-		judge_dda_pair(N5,N6,N9,N10)==false &&
-		judge_dda_pair(N7,N8,N11,N12)==false){
-			test2 = true;
-		}
-	if(judge_dda_pair(N1,N2,N5,N6)==false &&
-		judge_dda_pair(N3,N4,N9,N10)==false &&
-		judge_dda_pair(N7,N8,N11,N12)==false){
-			test3 = true;
-		}
-	if(judge_dda_pair(N1,N2,N7,N8)==false &&
-		judge_dda_pair(N9,N10,N3,N4)==false &&
-		judge_dda_pair(N5,N6,N11,N12)==false){
-			test4 = true;
-		}
-	if(judge_dda_pair(N1,N2,N9,N10)==false &&
-		judge_dda_pair(N7,N8,N3,N4)==false &&
-		judge_dda_pair(N5,N6,N11,N12)==false){
-			test5 = true;
-		}
-	if(judge_dda_pair(N1,N2,N7,N8)==false &&
-		judge_dda_pair(N9,N10,N5,N6)==false &&
-		judge_dda_pair(N3,N4,N11,N12)==false){
-			test6 = true;
-		}
-	if(judge_dda_pair(N1,N2,N9,N10)==false &&
-		judge_dda_pair(N7,N8,N5,N6)==false &&
-		judge_dda_pair(N3,N4,N11,N12)==false){
-			test7 = true;
-		}
-		
-	if(test1){ return 1; }
-	else if(test2){ return 2; }
-	else if(test3){ return 3; }
-	else if(test4){ return 4; }
-	else if(test5){ return 5; }
-	else if(test6){ return 6; }
-	else if(test7){ return 7; }
-	else { return 8; }
-}
-
 int Detailed::test_od_forbidden(SubInstance A,SubInstance B,SubInstance C,SubInstance D){
 	if(judge_od_pair(C,B)){
 		return 1;
@@ -710,16 +729,71 @@ void Detailed::flipped_cell(SubInstance& sub_cell){
 	
 }
 
-void Detailed::swap_cell(SubInstance& B,SubInstance& C,double& total_displacement){
-	double temp_B = B.position().x();
-	double temp_C = C.position().x();
-	B.set_position(Point(temp_C, B.position().y()));
+bool Detailed::can_swap_cell(SubInstanceId B_id,SubInstanceId C_id,double& displacement){
+	//C takes the left end of B and B the right end of C, so the gap between
+	//them is kept; equal edge types keep the spacing to the outer neighbors
+	SubInstance& B = database_.sub_instance(B_id);
+	SubInstance& C = database_.sub_instance(C_id);
+	const Instance& instance_B = database_.instance(B.instance_id());
+	const Instance& instance_C = database_.instance(C.instance_id());
+	if(instance_B.is_fixed() || instance_C.is_fixed()
+		|| instance_B.num_sub_instances() != 1 || instance_C.num_sub_instances() != 1
+		|| instance_B.fence_region_id() != instance_C.fence_region_id()){
+		return false;
+	}
+	const Cell& cell_B = database_.cell(instance_B.cell_id());
+	const Cell& cell_C = database_.cell(instance_C.cell_id());
+	if(cell_B.left_edge_type() != cell_C.left_edge_type()
+		|| cell_B.right_edge_type() != cell_C.right_edge_type()){
+		return false;
+	}
+	const double new_x_C = B.position().x();
+	const double new_x_B = C.position().x()+C.width()-B.width();
+	const double site_width = Site::width();
+	for(int k = 0; k < 2; k++){
+		SubInstance& subinstance = (k == 0) ? B : C;
+		const Instance& instance = (k == 0) ? instance_B : instance_C;
+		const double new_x = (k == 0) ? new_x_B : new_x_C;
+		if(fabs(new_x-instance.global_placed_position().x())+fabs(subinstance.position().y()-instance.global_placed_position().y())
+			> database_.displacement_limit()){
+			return false;
+		}
+		for(double x = new_x+0.5*site_width; x < new_x+subinstance.width(); x += site_width){
+			const Site& site = database_.site(database_.site_id_by_position(Point(x,subinstance.position().y())));
+			if(!site.is_valid() || site.fence_region_id() != instance.fence_region_id()){
+				return false;
+			}
+		}
+	}
+	displacement = fabs(new_x_B-instance_B.global_placed_position().x())-fabs(B.position().x()-instance_B.global_placed_position().x())
+		+fabs(new_x_C-instance_C.global_placed_position().x())-fabs(C.position().x()-instance_C.global_placed_position().x());
+	return true;
+}
+
+void Detailed::swap_cell(SubInstanceId B_id,SubInstanceId C_id,double& total_displacement){
+	SubInstance& B = database_.sub_instance(B_id);
+	SubInstance& C = database_.sub_instance(C_id);
+	const double temp_B = B.position().x();
+	const double temp_C = C.position().x();
+	const double site_width = Site::width();
+	//release the sites of both before taking the new ones, as they overlap
+	for(int k = 0; k < 2; k++){
+		SubInstance& subinstance = (k == 0) ? B : C;
+		for(double x = subinstance.position().x()+0.5*site_width; x < subinstance.position().x()+subinstance.width(); x += site_width){
+			database_.site(database_.site_id_by_position(Point(x,subinstance.position().y()))).remove_sub_instance_id();
+		}
+	}
 	C.set_position(Point(temp_B, C.position().y()));
-	total_displacement = (total_displacement+2*fabs(temp_B-temp_C));
-	/*InstanceId instance_id_b = B.instance_id();
-	InstanceId instance_id_c = C.instance_id();
-	Instance& instance_B = database_.instance(instance_id_b);
-	Instance& instance_C = database_.instance(instance_id_c);*/
+	B.set_position(Point(temp_C+C.width()-B.width(), B.position().y()));
+	total_displacement = (total_displacement+fabs(B.position().x()-temp_B)+fabs(C.position().x()-temp_C));
+	for(int k = 0; k < 2; k++){
+		SubInstance& subinstance = (k == 0) ? B : C;
+		for(double x = subinstance.position().x()+0.5*site_width; x < subinstance.position().x()+subinstance.width(); x += site_width){
+			database_.site(database_.site_id_by_position(Point(x,subinstance.position().y()))).set_sub_instance_id((k == 0) ? B_id : C_id);
+		}
+		Instance& instance = database_.instance(subinstance.instance_id());
+		instance.set_position(Point(subinstance.position().x(),instance.position().y()));
+	}
 }
 
 void Detailed::FindForbiddenPair(){
@@ -735,7 +809,7 @@ void Detailed::FindForbiddenPair(){
 	}
 	//for(int i = 0; i < 1;i++){
 	for(int i = 0; i <subinstancematrix_.size();i++){
-		for(int j = 0; j < (subinstancematrix_[i].size()-1); j++){
+		for(int j = 0; j + 1 < subinstancematrix_[i].size(); j++){
 			const SubInstanceId subinstance_id = subinstancematrix_[i][j];
 			const SubInstanceId next_subinstance_id = subinstancematrix_[i][j+1];
 			SubInstance& subinstance = database_.sub_instance(subinstance_id);
@@ -2,6 +2,7 @@
 #define DETAILED_HPP
 
 #include "../database/database.hpp"
+#include "sat_solver.hpp"
 
 class Detailed {
 	public:
@@ -13,6 +14,15 @@ class Detailed {
 		void PostSATMethod();
 		//Dynamic Programming
 		void DPMethod();
+		//Setter
+		//Also write the SAT clauses to the file in DIMACS CNF if not empty
+		void set_sat_input_file_name(const std::string& file_name);
+		//Read the model from the solver result file instead of solving if not empty
+		void set_sat_output_file_name(const std::string& file_name);
+		//Solve rows not coupled by multi-row instances as separate SAT problems in parallel
+		void set_is_sat_partitioned(bool is_sat_partitioned);
+		//Let the dynamic programming also swap adjacent single-row instances
+		void set_is_adjacent_swap_allowed(bool is_adjacent_swap_allowed);
 	private:
 		//Pre Detailed Placement
 		void InitialPlacementConstraint();
@@ -21,24 +31,44 @@ class Detailed {
 		void SatProblem();
 		void SatInput();
 		void SatOutput();
+		void SatOutputFile();
 		//SATPartition
 		void SatProblemPartition();
 		void SatInputPartition();
 		void SatOutputPartition();
+		void FlipSelectedSubInstances();
 		//Dynamic Programming
 		void DynamicProgramming();
+		//Fewest forbidden pairs, then least displacement, over the orientations
+		//(and swaps) of the single-row instances of the row
+		void SolveRowByDynamicProgramming(int row_idx,int& num_flips,int& num_swaps,double& total_displacement);
+		//Flip the multi-row instances which remove forbidden pairs over all
+		//their rows, leave the rows changed in row_idxs and return the flips
+		int FlipMultiRowInstances(std::vector<int>& row_idxs);
 		
 		//subfunction
 		bool judge_dda_pair(bool rt,bool rb,bool lt,bool lb);
 		bool judge_od_pair(SubInstance& subinstance,SubInstance& next_subinstance);
-		int test_dda_forbidden(SubInstance A,SubInstance B,SubInstance C,SubInstance D);
 		int test_od_forbidden(SubInstance A,SubInstance B,SubInstance C,SubInstance D);
-		void swap_cell(SubInstance& B,SubInstance& C,double& total_displacement);
+		bool can_swap_cell(SubInstanceId B_id,SubInstanceId C_id,double& displacement);
+		void swap_cell(SubInstanceId B_id,SubInstanceId C_id,double& total_displacement);
 		void flipped_cell(SubInstance& sub_cell);
 		
 		std::vector< std::vector<SubInstanceId> > 						subinstancematrix_;
 		std::vector< std::vector<SiteId> > 								sitematrix_;
 		std::vector< int > 												numvariable_;
+		//clause database of SatInput, solved in process by SatOutput
+		SatSolver														sat_solver_;
+		std::string														sat_input_file_name_;
+		std::string														sat_output_file_name_;
+		//clauses of every row as 0-terminated DIMACS literals
+		std::vector< std::vector<int> >									forbidden_clause_by_row_;
+		//rows coupled by multi-row instances, with one solver and its variables each
+		bool															is_sat_partitioned_;
+		std::vector< std::vector<int> >									rows_by_partition_;
+		std::vector< SatSolver >										partition_sat_solvers_;
+		std::vector< std::vector<VariableId> >							variable_ids_by_partition_;
+		bool															is_adjacent_swap_allowed_;
 		
 		Database& database_;
 };
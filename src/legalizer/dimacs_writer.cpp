@@ -0,0 +1,150 @@
+#include "dimacs_writer.hpp"
+
+#include "../util/const.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstring>
+
+using namespace std;
+
+const int BUFFER_CAPACITY = 1 << 22;
+// Sign, ten digits and a separator.
+const int MAX_INTEGER_LENGTH = 12;
+
+// "00" to "99", two digits at a time.
+const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+DimacsWriter::DimacsWriter()
+    : file_descriptor_(UNDEFINED_ID),
+      buffer_(),
+      buffer_size_(0),
+      is_failed_(false) {
+}
+
+DimacsWriter::~DimacsWriter() {
+  if (file_descriptor_ != UNDEFINED_ID) {
+    Close();
+  }
+}
+
+bool DimacsWriter::Open(const string& file_name) {
+  assert(file_descriptor_ == UNDEFINED_ID);
+
+  file_descriptor_ =
+      open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (file_descriptor_ < 0) {
+    file_descriptor_ = UNDEFINED_ID;
+
+    return false;
+  }
+
+  buffer_.resize(BUFFER_CAPACITY);
+  buffer_size_ = 0;
+  is_failed_ = false;
+
+  return true;
+}
+
+void DimacsWriter::WriteHeader(int num_variables, int num_clauses) {
+  const char prefix[] = "p cnf ";
+
+  if (buffer_size_ + sizeof(prefix) + 2 * MAX_INTEGER_LENGTH >
+      buffer_.size()) {
+    Flush();
+  }
+
+  memcpy(&buffer_[buffer_size_], prefix, sizeof(prefix) - 1);
+  buffer_size_ += sizeof(prefix) - 1;
+
+  WriteInteger(num_variables);
+  buffer_[buffer_size_++] = ' ';
+  WriteInteger(num_clauses);
+  buffer_[buffer_size_++] = '\n';
+}
+
+void DimacsWriter::WriteClauses(const int* literals, int num_literals) {
+  assert(file_descriptor_ != UNDEFINED_ID);
+
+  for (int i = 0; i < num_literals; ++i) {
+    if (buffer_size_ + MAX_INTEGER_LENGTH > buffer_.size()) {
+      Flush();
+    }
+
+    WriteInteger(literals[i]);
+    buffer_[buffer_size_++] = (literals[i] == 0) ? '\n' : ' ';
+  }
+}
+
+bool DimacsWriter::Close() {
+  assert(file_descriptor_ != UNDEFINED_ID);
+
+  Flush();
+
+  if (close(file_descriptor_) != 0) {
+    is_failed_ = true;
+  }
+
+  file_descriptor_ = UNDEFINED_ID;
+  vector<char>().swap(buffer_);
+
+  return !is_failed_;
+}
+
+// Private members
+
+void DimacsWriter::WriteInteger(int value) {
+  // Work on the magnitude as unsigned, so the most negative int is fine.
+  unsigned int magnitude = value;
+
+  if (value < 0) {
+    buffer_[buffer_size_++] = '-';
+    magnitude = 0u - magnitude;
+  }
+
+  char digits[MAX_INTEGER_LENGTH];
+  int digit_idx = MAX_INTEGER_LENGTH;
+
+  while (magnitude >= 100) {
+    const int pair_idx = 2 * (magnitude % 100);
+
+    magnitude /= 100;
+    digits[--digit_idx] = DIGIT_PAIRS[pair_idx + 1];
+    digits[--digit_idx] = DIGIT_PAIRS[pair_idx];
+  }
+
+  if (magnitude >= 10) {
+    digits[--digit_idx] = DIGIT_PAIRS[2 * magnitude + 1];
+    digits[--digit_idx] = DIGIT_PAIRS[2 * magnitude];
+  } else {
+    digits[--digit_idx] = '0' + magnitude;
+  }
+
+  memcpy(&buffer_[buffer_size_], &digits[digit_idx],
+         MAX_INTEGER_LENGTH - digit_idx);
+  buffer_size_ += MAX_INTEGER_LENGTH - digit_idx;
+}
+
+void DimacsWriter::Flush() {
+  int num_written_bytes = 0;
+
+  while (!is_failed_ && num_written_bytes < buffer_size_) {
+    const ssize_t num_bytes =
+        write(file_descriptor_, &buffer_[num_written_bytes],
+              buffer_size_ - num_written_bytes);
+
+    if (num_bytes <= 0) {
+      is_failed_ = true;
+    } else {
+      num_written_bytes += num_bytes;
+    }
+  }
+
+  buffer_size_ = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef DIMACS_WRITER_HPP
+#define DIMACS_WRITER_HPP
+
+#include <string>
+#include <vector>
+
+// Writer of CNF files in the DIMACS format. Integers are formatted by hand
+// into one large buffer, which is written out only when it fills up, so the
+// output is bound by I/O rather than by streams or allocations.
+
+class DimacsWriter {
+ public:
+  DimacsWriter();
+  ~DimacsWriter();
+
+  // Return false if the file cannot be created.
+  bool Open(const std::string& file_name);
+  void WriteHeader(int num_variables, int num_clauses);
+  // Clauses of DIMACS literals, each terminated by 0.
+  void WriteClauses(const int* literals, int num_literals);
+  // Return false if any write failed.
+  bool Close();
+
+ private:
+  void WriteInteger(int value);
+  void Flush();
+
+  int file_descriptor_;
+  std::vector<char> buffer_;
+  int buffer_size_;
+  bool is_failed_;
+};
+
+#endif
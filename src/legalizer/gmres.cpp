@@ -0,0 +1,107 @@
+#include "gmres.hpp"
+
+#include <cassert>
+#include <cmath>
+
+using namespace std;
+
+using Index = Eigen::Index;
+
+GmresSolver::GmresSolver()
+    : restart_(0),
+      krylov_basis_(),
+      hessenberg_(),
+      givens_cos_(),
+      givens_sin_(),
+      g_(),
+      w_() {
+}
+
+void GmresSolver::Initialize(Index num_rows, int restart) {
+  assert(restart > 0);
+
+  restart_ = restart;
+  krylov_basis_.resize(num_rows, restart + 1);
+  hessenberg_.resize(restart + 1, restart);
+  givens_cos_.resize(restart);
+  givens_sin_.resize(restart);
+  g_.resize(restart + 1);
+  w_.resize(num_rows);
+}
+
+bool GmresSolver::Solve(
+    const Eigen::SparseMatrix<double, Eigen::RowMajor>& matrix,
+    const BlockJacobiPreconditioner& preconditioner, const Vector& rhs,
+    Vector& x, double tolerance, int max_num_iterations) {
+  assert(matrix.rows() == matrix.cols() && rhs.rows() == matrix.rows());
+  assert(x.rows() == rhs.rows() && w_.rows() == rhs.rows());
+
+  const double threshold = tolerance * rhs.norm();
+
+  hessenberg_.setZero();
+
+  int num_iterations = 0;
+  while (true) {
+    w_ = rhs - matrix * x;
+    const double residual_norm = w_.norm();
+
+    if (residual_norm <= threshold || residual_norm == 0.0) {
+      return true;
+    }
+    if (num_iterations >= max_num_iterations) {
+      return false;
+    }
+
+    krylov_basis_.col(0) = w_ / residual_norm;
+    g_.setZero();
+    g_(0) = residual_norm;
+
+    int k = 0;
+    while (k < restart_ && num_iterations < max_num_iterations) {
+      w_ = matrix * preconditioner.solve(krylov_basis_.col(k));
+
+      // Modified Gram-Schmidt.
+      for (int i = 0; i <= k; ++i) {
+        hessenberg_(i, k) = w_.dot(krylov_basis_.col(i));
+        w_ -= hessenberg_(i, k) * krylov_basis_.col(i);
+      }
+      hessenberg_(k + 1, k) = w_.norm();
+      if (hessenberg_(k + 1, k) != 0.0) {
+        krylov_basis_.col(k + 1) = w_ / hessenberg_(k + 1, k);
+      }
+
+      // Reduce the Hessenberg column to upper triangular by Givens rotations.
+      for (int i = 0; i < k; ++i) {
+        const double h_i = hessenberg_(i, k);
+        const double h_i_plus_1 = hessenberg_(i + 1, k);
+
+        hessenberg_(i, k) = givens_cos_(i) * h_i + givens_sin_(i) * h_i_plus_1;
+        hessenberg_(i + 1, k) =
+            -givens_sin_(i) * h_i + givens_cos_(i) * h_i_plus_1;
+      }
+
+      const double r = hypot(hessenberg_(k, k), hessenberg_(k + 1, k));
+      givens_cos_(k) = hessenberg_(k, k) / r;
+      givens_sin_(k) = hessenberg_(k + 1, k) / r;
+      hessenberg_(k, k) = r;
+      hessenberg_(k + 1, k) = 0.0;
+      g_(k + 1) = -givens_sin_(k) * g_(k);
+      g_(k) = givens_cos_(k) * g_(k);
+
+      ++k;
+      ++num_iterations;
+
+      if (abs(g_(k)) <= threshold) {
+        break;
+      }
+    }
+
+    const Vector y = hessenberg_.topLeftCorner(k, k)
+                         .triangularView<Eigen::Upper>()
+                         .solve(g_.head(k));
+    x += preconditioner.solve(krylov_basis_.leftCols(k) * y);
+
+    // The next pass starts by checking the true residual, so a solve that
+    // converges on its last allowed iteration still succeeds.
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef GMRES_HPP
+#define GMRES_HPP
+
+#include "block_jacobi_preconditioner.hpp"
+#include "vector.hpp"
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+
+// Restarted GMRES with right preconditioning. The Krylov basis and the other
+// work arrays are allocated by Initialize and reused by every Solve.
+
+class GmresSolver {
+ public:
+  GmresSolver();
+
+  void Initialize(Eigen::Index num_rows, int restart);
+
+  // Start from x and stop when the residual norm drops below
+  // tolerance * |rhs|. Return false if that takes more than
+  // max_num_iterations inner iterations.
+  bool Solve(const Eigen::SparseMatrix<double, Eigen::RowMajor>& matrix,
+             const BlockJacobiPreconditioner& preconditioner,
+             const Vector& rhs, Vector& x, double tolerance,
+             int max_num_iterations);
+
+ private:
+  int restart_;
+  Eigen::MatrixXd krylov_basis_;
+  Eigen::MatrixXd hessenberg_;
+  Vector givens_cos_;
+  Vector givens_sin_;
+  Vector g_;
+  Vector w_;
+};
+
+#endif
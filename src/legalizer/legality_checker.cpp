@@ -0,0 +1,396 @@
+#include "legality_checker.hpp"
+
+#include "../util/const.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+using namespace std;
+
+// Positions are compared in sites, so a relative tolerance suffices.
+const double EPSILON = 1e-6;
+
+// Escape a name for a JSON string.
+static string EscapeJson(const string& name) {
+  string escaped_name;
+
+  for (const char c : name) {
+    if (c == '"' || c == '\\') {
+      escaped_name.push_back('\\');
+    }
+    escaped_name.push_back(c);
+  }
+
+  return escaped_name;
+}
+
+LegalityChecker::LegalityChecker(const Database& database, int max_num_samples)
+    : database_(database),
+      max_num_samples_(max_num_samples),
+      num_violations_by_violation_(num_violations_, 0),
+      samples_() {
+}
+
+void LegalityChecker::Check() {
+  const double row_height = Site::height();
+  const Rect& die_rect = database_.die_rect();
+  const int num_rows = database_.num_rows();
+
+  // Bucket all instances, fixed ones included, into the rows they cover.
+
+  vector<int> bottom_row_idx_by_instance_id(database_.num_instances(),
+                                            UNDEFINED_ID);
+  vector<vector<pair<double, InstanceId>>> x_and_instance_ids_by_row(num_rows);
+
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    const InstanceId instance_id(i);
+    const Instance& instance = database_.instance(instance_id);
+    const double y = instance.position().y() - die_rect.min_corner().y();
+
+    const int bottom_row_idx =
+        max(static_cast<int>(floor(y / row_height + EPSILON)), 0);
+    const int top_row_idx = min(
+        static_cast<int>(ceil((y + instance.height()) / row_height - EPSILON)),
+        num_rows);
+
+    if (bottom_row_idx >= top_row_idx) {
+      continue;
+    }
+
+    bottom_row_idx_by_instance_id[instance_id] = bottom_row_idx;
+
+    for (int j = bottom_row_idx; j < top_row_idx; ++j) {
+      x_and_instance_ids_by_row[j].push_back(
+          make_pair(instance.position().x(), instance_id));
+    }
+  }
+
+  vector<tuple<LegalityViolation, InstanceId, InstanceId, double>> violations;
+
+#pragma omp parallel
+  {
+    vector<tuple<LegalityViolation, InstanceId, InstanceId, double>>
+        thread_violations;
+
+#pragma omp for schedule(dynamic, 1024) nowait
+    for (int i = 0; i < database_.num_instances(); ++i) {
+      const InstanceId instance_id(i);
+
+      if (!database_.instance(instance_id).is_fixed()) {
+        CheckInstance(instance_id, thread_violations);
+      }
+    }
+
+#pragma omp for schedule(dynamic, 16) nowait
+    for (int i = 0; i < num_rows; ++i) {
+      sort(x_and_instance_ids_by_row[i].begin(),
+           x_and_instance_ids_by_row[i].end());
+
+      CheckRow(x_and_instance_ids_by_row[i], i, bottom_row_idx_by_instance_id,
+               thread_violations);
+    }
+
+#pragma omp critical
+    violations.insert(violations.end(), thread_violations.begin(),
+                      thread_violations.end());
+  }
+
+  // Sort so that the samples do not depend on the number of threads.
+
+  sort(violations.begin(), violations.end());
+
+  num_violations_by_violation_.assign(num_violations_, 0);
+  samples_.clear();
+
+  for (int i = 0; i < violations.size(); ++i) {
+    int& num_violations =
+        num_violations_by_violation_[static_cast<int>(get<0>(violations[i]))];
+
+    if (num_violations < max_num_samples_) {
+      samples_.push_back(violations[i]);
+    }
+
+    ++num_violations;
+  }
+}
+
+void LegalityChecker::Summary(ostream& os) const {
+  for (int i = 0; i < num_violations_; ++i) {
+    os << "# of " << static_cast<LegalityViolation>(i)
+       << " violations: " << num_violations_by_violation_[i] << endl;
+  }
+}
+
+void LegalityChecker::Report(ostream& os) const {
+  const streamsize precision = os.precision(15);
+
+  os << "{" << endl;
+  os << "  \"legal\": " << (is_legal() ? "true" : "false") << "," << endl;
+  os << "  \"num_violations\": " << num_violations() << "," << endl;
+  os << "  \"num_violations_by_type\": {" << endl;
+  for (int i = 0; i < num_violations_; ++i) {
+    os << "    \"" << static_cast<LegalityViolation>(i)
+       << "\": " << num_violations_by_violation_[i]
+       << (i + 1 < num_violations_ ? "," : "") << endl;
+  }
+  os << "  }," << endl;
+  os << "  \"samples\": [" << endl;
+  for (int i = 0; i < samples_.size(); ++i) {
+    const Instance& instance = database_.instance(get<1>(samples_[i]));
+
+    os << "    {\"type\": \"" << get<0>(samples_[i]) << "\", \"instance\": \""
+       << EscapeJson(instance.name()) << "\", \"other_instance\": ";
+    if (get<2>(samples_[i]) == UNDEFINED_ID) {
+      os << "null";
+    } else {
+      os << "\"" << EscapeJson(database_.instance(get<2>(samples_[i])).name())
+         << "\"";
+    }
+    os << ", \"x\": " << instance.position().x()
+       << ", \"y\": " << instance.position().y()
+       << ", \"value\": " << get<3>(samples_[i]) << "}"
+       << (i + 1 < samples_.size() ? "," : "") << endl;
+  }
+  os << "  ]" << endl;
+  os << "}" << endl;
+
+  os.precision(precision);
+}
+
+// Getters
+
+bool LegalityChecker::is_legal() const {
+  for (int i = 0; i < static_cast<int>(LegalityViolation::EDGE_SPACING); ++i) {
+    if (num_violations_by_violation_[i] > 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int LegalityChecker::num_violations() const {
+  int num_violations = 0;
+
+  for (int i = 0; i < num_violations_; ++i) {
+    num_violations += num_violations_by_violation_[i];
+  }
+
+  return num_violations;
+}
+
+int LegalityChecker::num_violations(LegalityViolation violation) const {
+  return num_violations_by_violation_[static_cast<int>(violation)];
+}
+
+int LegalityChecker::num_samples() const {
+  return samples_.size();
+}
+
+const tuple<LegalityViolation, InstanceId, InstanceId, double>&
+LegalityChecker::sample(int idx) const {
+  return samples_.at(idx);
+}
+
+// Private members
+
+void LegalityChecker::CheckInstance(
+    InstanceId instance_id,
+    vector<tuple<LegalityViolation, InstanceId, InstanceId, double>>&
+        violations) const {
+  const double site_width = Site::width();
+  const double row_height = Site::height();
+  const Rect& die_rect = database_.die_rect();
+  const int num_row_sites = database_.num_sites() / database_.num_rows();
+
+  const Instance& instance = database_.instance(instance_id);
+  const Point& position = instance.position();
+
+  const double displacement = ComputeManhattanDistanceBetweenPoints(
+      position, instance.global_placed_position());
+
+  if (displacement > database_.displacement_limit() + EPSILON * row_height) {
+    violations.push_back(make_tuple(LegalityViolation::DISPLACEMENT,
+                                    instance_id, InstanceId(UNDEFINED_ID),
+                                    displacement));
+  }
+
+  const double out_of_die_distance =
+      max(max(die_rect.min_corner().x() - position.x(),
+              die_rect.min_corner().y() - position.y()),
+          max(position.x() + instance.width() - die_rect.max_corner().x(),
+              position.y() + instance.height() - die_rect.max_corner().y()));
+
+  if (out_of_die_distance > EPSILON * site_width) {
+    violations.push_back(make_tuple(LegalityViolation::OUT_OF_DIE,
+                                    instance_id, InstanceId(UNDEFINED_ID),
+                                    out_of_die_distance));
+
+    return;
+  }
+
+  // Off-grid instances do not sit on sites at all.
+
+  const double x = (position.x() - die_rect.min_corner().x()) / site_width;
+  const double y = (position.y() - die_rect.min_corner().y()) / row_height;
+  const int site_idx = static_cast<int>(round(x));
+  const int row_idx = static_cast<int>(round(y));
+
+  if (abs(x - site_idx) > EPSILON || abs(y - row_idx) > EPSILON) {
+    violations.push_back(make_tuple(
+        LegalityViolation::INVALID_SITE, instance_id, InstanceId(UNDEFINED_ID),
+        max(abs(x - site_idx) * site_width, abs(y - row_idx) * row_height)));
+
+    return;
+  }
+
+  const int instance_site_width =
+      static_cast<int>(ceil(instance.width() / site_width - EPSILON));
+  const int instance_row_height =
+      static_cast<int>(ceil(instance.height() / row_height - EPSILON));
+
+  int num_invalid_sites = 0;
+  int num_wrong_fence_region_sites = 0;
+
+  for (int i = row_idx; i < row_idx + instance_row_height; ++i) {
+    for (int j = site_idx; j < site_idx + instance_site_width; ++j) {
+      const Site& site = database_.site(SiteId(i * num_row_sites + j));
+
+      if (!site.is_valid()) {
+        ++num_invalid_sites;
+      } else if (site.fence_region_id() != instance.fence_region_id()) {
+        ++num_wrong_fence_region_sites;
+      }
+    }
+  }
+
+  if (num_invalid_sites > 0) {
+    violations.push_back(make_tuple(LegalityViolation::INVALID_SITE,
+                                    instance_id, InstanceId(UNDEFINED_ID),
+                                    num_invalid_sites));
+  }
+  if (num_wrong_fence_region_sites > 0) {
+    violations.push_back(make_tuple(LegalityViolation::WRONG_FENCE_REGION,
+                                    instance_id, InstanceId(UNDEFINED_ID),
+                                    num_wrong_fence_region_sites));
+  }
+
+  const Row& row = database_.row(RowId(row_idx));
+
+  bool is_pg_rail_aligned =
+      instance.orientation() == row.orientation() ||
+      FlipOrientation(instance.orientation()) == row.orientation();
+
+  // Only the rails on metal 1 are considered, as in Legalizer. Flipping does
+  // not move an even-row-height instance onto the other rail type.
+  if (row.has_rail_on_layer(LayerId(0)) && instance_row_height % 2 == 0) {
+    const Rail& rail = database_.rail(row.rail_id_on_layer(LayerId(0)));
+
+    is_pg_rail_aligned =
+        is_pg_rail_aligned &&
+        ((instance.is_bottom_ground() && rail.type() != NetType::POWER) ||
+         (!instance.is_bottom_ground() && rail.type() != NetType::GROUND));
+  }
+
+  if (!is_pg_rail_aligned) {
+    violations.push_back(make_tuple(LegalityViolation::PG_RAIL_MISALIGNMENT,
+                                    instance_id, InstanceId(UNDEFINED_ID),
+                                    0.0));
+  }
+}
+
+void LegalityChecker::CheckRow(
+    const vector<pair<double, InstanceId>>& x_and_instance_ids, int row_idx,
+    const vector<int>& bottom_row_idx_by_instance_id,
+    vector<tuple<LegalityViolation, InstanceId, InstanceId, double>>&
+        violations) const {
+  const double site_width = Site::width();
+
+  double max_edge_spacing = 0.0;
+  for (int i = 0; i < Database::num_edge_types_; ++i) {
+    for (int j = 0; j < Database::num_edge_types_; ++j) {
+      max_edge_spacing = max(max_edge_spacing,
+                             database_.edge_type_spacing(EdgeType(i),
+                                                         EdgeType(j)));
+    }
+  }
+
+  // Instances starting before the right end of one overlap it, and the first
+  // one starting after is its neighbour for edge spacing.
+
+  for (int i = 0; i < x_and_instance_ids.size(); ++i) {
+    const InstanceId instance_id = x_and_instance_ids[i].second;
+    const Instance& instance = database_.instance(instance_id);
+    const double right_x = instance.position().x() + instance.width();
+
+    for (int j = i + 1; j < x_and_instance_ids.size(); ++j) {
+      const InstanceId next_instance_id = x_and_instance_ids[j].second;
+      const Instance& next_instance = database_.instance(next_instance_id);
+      const double next_x = next_instance.position().x();
+      const bool is_overlapped = next_x < right_x - EPSILON * site_width;
+
+      // Report a pair only once, in the lowest row they share.
+
+      if ((!instance.is_fixed() || !next_instance.is_fixed()) &&
+          row_idx == max(bottom_row_idx_by_instance_id[instance_id],
+                         bottom_row_idx_by_instance_id[next_instance_id])) {
+        if (is_overlapped) {
+          violations.push_back(make_tuple(
+              LegalityViolation::OVERLAP, min(instance_id, next_instance_id),
+              max(instance_id, next_instance_id),
+              min(right_x, next_x + next_instance.width()) - next_x));
+        } else if (next_x - right_x < max_edge_spacing) {
+          const double edge_spacing = database_.edge_type_spacing(
+              instance.right_edge_type(), next_instance.left_edge_type());
+
+          if (next_x - right_x < edge_spacing - EPSILON * site_width) {
+            violations.push_back(make_tuple(
+                LegalityViolation::EDGE_SPACING, instance_id,
+                next_instance_id, edge_spacing - (next_x - right_x)));
+          }
+        }
+      }
+
+      if (!is_overlapped) {
+        break;
+      }
+    }
+  }
+}
+
+ostream& operator<<(ostream& os, const LegalityViolation& violation) {
+  switch (violation) {
+    case LegalityViolation::OUT_OF_DIE: {
+      os << "out_of_die";
+      break;
+    }
+    case LegalityViolation::INVALID_SITE: {
+      os << "invalid_site";
+      break;
+    }
+    case LegalityViolation::WRONG_FENCE_REGION: {
+      os << "wrong_fence_region";
+      break;
+    }
+    case LegalityViolation::OVERLAP: {
+      os << "overlap";
+      break;
+    }
+    case LegalityViolation::PG_RAIL_MISALIGNMENT: {
+      os << "pg_rail_misalignment";
+      break;
+    }
+    case LegalityViolation::EDGE_SPACING: {
+      os << "edge_spacing";
+      break;
+    }
+    case LegalityViolation::DISPLACEMENT: {
+      os << "displacement";
+      break;
+    }
+    default: { break; }
+  }
+
+  return os;
+}
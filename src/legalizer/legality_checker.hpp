@@ -0,0 +1,74 @@
+#ifndef LEGALITY_CHECKER_HPP
+#define LEGALITY_CHECKER_HPP
+
+#include "../database/database.hpp"
+
+#include <iostream>
+#include <tuple>
+#include <vector>
+
+// Do not change the order! Those before EDGE_SPACING make a result illegal.
+enum class LegalityViolation {
+  OUT_OF_DIE,
+  INVALID_SITE,
+  WRONG_FENCE_REGION,
+  OVERLAP,
+  PG_RAIL_MISALIGNMENT,
+  EDGE_SPACING,
+  DISPLACEMENT
+};
+
+// Collect every violation of a placement instead of stopping at the first
+// one. Movable instances are checked in parallel, then the instances of each
+// row, fixed ones included, are sorted by x and swept in parallel for
+// overlaps and edge spacing. A pair of multi-row-height instances is reported
+// once, in the lowest row they share.
+
+class LegalityChecker {
+ public:
+  static const int num_violations_ = 7;
+
+  LegalityChecker(const Database& database, int max_num_samples = 10);
+
+  void Check();
+  // Counts per violation, one line each.
+  void Summary(std::ostream& os = std::cout) const;
+  // Counts and samples as JSON.
+  void Report(std::ostream& os) const;
+
+  // Getters
+
+  // Whether there is no violation making the result illegal.
+  bool is_legal() const;
+  int num_violations() const;
+  int num_violations(LegalityViolation violation) const;
+  // At most max_num_samples per violation, sorted by violation and then
+  // instances. A sample is (violation, instance, other instance of an
+  // overlap or edge spacing pair, value), the value being the overlap or
+  // spacing shortage, the displacement, or the off-grid offset.
+  int num_samples() const;
+  const std::tuple<LegalityViolation, InstanceId, InstanceId, double>& sample(
+      int idx) const;
+
+ private:
+  void CheckInstance(
+      InstanceId instance_id,
+      std::vector<std::tuple<LegalityViolation, InstanceId, InstanceId,
+                             double>>& violations) const;
+  void CheckRow(
+      const std::vector<std::pair<double, InstanceId>>& x_and_instance_ids,
+      int row_idx,
+      const std::vector<int>& bottom_row_idx_by_instance_id,
+      std::vector<std::tuple<LegalityViolation, InstanceId, InstanceId,
+                             double>>& violations) const;
+
+  const Database& database_;
+  int max_num_samples_;
+  std::vector<int> num_violations_by_violation_;
+  std::vector<std::tuple<LegalityViolation, InstanceId, InstanceId, double>>
+      samples_;
+};
+
+std::ostream& operator<<(std::ostream& os, const LegalityViolation& violation);
+
+#endif
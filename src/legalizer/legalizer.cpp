@@ -1,34 +1,64 @@
 #include "legalizer.hpp"
 
 #include "../util/const.hpp"
+#include "legality_checker.hpp"
 #include "sparse_matrix.hpp"
 #include "vector.hpp"
 
-#include <Eigen/SparseLU>
-
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cmath>
 #include <fstream>
 #include <limits>
-#include <map>
-#include <set>
-#include <stack>
+#include <tuple>
 
 using namespace std;
 
-using Triplet = Eigen::Triplet<double>;
-
 // Public members
 
 Legalizer::Legalizer(Database& database)
     : database_(database),
+      is_mmsim_decomposed_(false),
+      is_single_row_solved_exactly_(false),
+      mmsim_freeze_iterations_(0),
+      mmsim_linear_solver_(MmsimLinearSolver::BLOCK_TRIANGULAR),
+      mmsim_precision_(MmsimPrecision::DOUBLE),
+      is_window_legalized_(false),
+      is_row_alignment_parallel_(false),
+      is_placement_spread_(false),
+      is_edge_spacing_resolved_(false),
+      mmsim_variable_idx_by_sub_instance_id_(),
+      mmsim_solvers_(),
+      mmsim_instance_ids_by_solver_(),
+      mmsim_solver_idx_by_instance_id_(),
+      mmsim_single_row_ids_(),
+      mmsim_target_x_by_instance_id_(),
+      candidate_row_ids_by_key_(),
       x_and_instance_id_sorted_by_x_(),
       x_and_instance_id_sorted_by_x_by_row_height_(
           database_.max_instance_row_height(),
           vector<pair<double, InstanceId>>()),
       illegal_instance_ids_by_row_height_(database_.max_instance_row_height(),
-                                          vector<InstanceId>()) {
+                                          vector<InstanceId>()),
+      instance_ids_sorted_by_x_by_row_(),
+      sorted_idx_by_sub_instance_id_(),
+      site_occupancy_map_(),
+      num_bin_rows_(0),
+      num_bin_columns_(0),
+      bins_(),
+      free_area_by_bin_(),
+      num_window_rows_(0),
+      num_window_sites_(0),
+      num_window_columns_(0),
+      is_placed_in_window_by_instance_id_(),
+      push_call_idx_(0),
+      push_pop_idx_(0),
+      push_call_idx_by_instance_id_(database_.num_instances(), 0),
+      push_pop_idx_by_instance_id_(database_.num_instances(), 0),
+      push_reference_x_by_instance_id_(database_.num_instances(), 0.0),
+      push_stack_(),
+      push_journal_() {
   x_and_instance_id_sorted_by_x_.reserve(database_.num_instances());
 }
 
@@ -39,12 +69,133 @@ void Legalizer::Legalize() {
   PreDDA();
 }
 
+void Legalizer::Relegalize(const vector<InstanceId>& moved_instance_ids) {
+  // Undo everything after MMSIM: free all sites and move instances back to
+  // their aligned rows and MMSIM targets.
+
+  for (int i = 0; i < database_.num_sites(); ++i) {
+    Site& site = database_.site(SiteId(i));
+
+    if (site.has_sub_instance()) {
+      site.remove_sub_instance_id();
+    }
+  }
+
+  for (int i = 0; i < illegal_instance_ids_by_row_height_.size(); ++i) {
+    illegal_instance_ids_by_row_height_[i].clear();
+  }
+
+  for (InstanceId instance_id : moved_instance_ids) {
+    mmsim_target_x_by_instance_id_[instance_id] =
+        database_.instance(instance_id).global_placed_position().x();
+  }
+
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    const InstanceId instance_id(i);
+    Instance& instance = database_.instance(instance_id);
+
+    if (instance.is_fixed()) {
+      continue;
+    }
+
+    const Row& row =
+        database_.row(FindSubInstanceRowId(instance.sub_instance_id(0)));
+
+    if (instance.orientation() != row.orientation()) {
+      instance.FlipVertically();
+    }
+
+    instance.set_position(Point(mmsim_target_x_by_instance_id_[instance_id],
+                                row.position().y()));
+    database_.UpdateInstanceSubInstancePositions(instance_id);
+  }
+
+  // Only q of the moved instances changes, so their solvers resume from the
+  // previous solution without refactorizing.
+
+  vector<bool> is_solver_restarted(mmsim_solvers_.size(), false);
+  for (InstanceId instance_id : moved_instance_ids) {
+    const int solver_idx = mmsim_solver_idx_by_instance_id_[instance_id];
+
+    if (solver_idx == UNDEFINED_ID) {
+      continue;
+    }
+
+    const Instance& instance = database_.instance(instance_id);
+
+    for (int j = 0; j < instance.num_sub_instances(); ++j) {
+      mmsim_solvers_[solver_idx].set_q(
+          mmsim_variable_idx_by_sub_instance_id_[instance.sub_instance_id(j)],
+          -1 * mmsim_target_x_by_instance_id_[instance_id]);
+    }
+
+    is_solver_restarted[solver_idx] = true;
+  }
+
+  vector<int> solver_indices;
+  for (int i = 0; i < mmsim_solvers_.size(); ++i) {
+    if (is_solver_restarted[i]) {
+      mmsim_solvers_[i].Restart();
+      solver_indices.push_back(i);
+    }
+  }
+
+  SolveSingleRows();
+  IterateMmsimSolvers(solver_indices);
+  UpdateMmsimPositions();
+
+  PostMmsim();
+  PreDDA();
+}
+
+// Setters
+
+void Legalizer::set_is_mmsim_decomposed(bool is_mmsim_decomposed) {
+  is_mmsim_decomposed_ = is_mmsim_decomposed;
+}
+
+void Legalizer::set_is_single_row_solved_exactly(
+    bool is_single_row_solved_exactly) {
+  is_single_row_solved_exactly_ = is_single_row_solved_exactly;
+}
+
+void Legalizer::set_mmsim_freeze_iterations(int mmsim_freeze_iterations) {
+  mmsim_freeze_iterations_ = mmsim_freeze_iterations;
+}
+
+void Legalizer::set_mmsim_linear_solver(
+    MmsimLinearSolver mmsim_linear_solver) {
+  mmsim_linear_solver_ = mmsim_linear_solver;
+}
+
+void Legalizer::set_mmsim_precision(MmsimPrecision mmsim_precision) {
+  mmsim_precision_ = mmsim_precision;
+}
+
+void Legalizer::set_is_window_legalized(bool is_window_legalized) {
+  is_window_legalized_ = is_window_legalized;
+}
+
+void Legalizer::set_is_row_alignment_parallel(bool is_row_alignment_parallel) {
+  is_row_alignment_parallel_ = is_row_alignment_parallel;
+}
+
+void Legalizer::set_is_placement_spread(bool is_placement_spread) {
+  is_placement_spread_ = is_placement_spread;
+}
+
+void Legalizer::set_is_edge_spacing_resolved(bool is_edge_spacing_resolved) {
+  is_edge_spacing_resolved_ = is_edge_spacing_resolved;
+}
+
 // Private members
 
 void Legalizer::PreMmsim() {
-  /* cout << "Spread instances..." << endl; */
+  if (is_placement_spread_) {
+    cout << "Spread instances..." << endl;
 
-  /* SpreadInstances(); */
+    SpreadInstances();
+  }
 
   /* ofstream plot_sp(database_.design_name() + "_sp.plt"); */
   /* database_.Plot( */
@@ -64,111 +215,502 @@ void Legalizer::PreMmsim() {
 void Legalizer::Mmsim() {
   //cout << "MMSIM..." << endl;
 
+  mmsim_variable_idx_by_sub_instance_id_.assign(database_.num_sub_instances(),
+                                                UNDEFINED_ID);
+  mmsim_single_row_ids_.clear();
+
+  // Aligned positions are the targets of MMSIM, and Relegalize restarts from
+  // them.
+
+  mmsim_target_x_by_instance_id_.resize(database_.num_instances());
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    const InstanceId instance_id(i);
+
+    mmsim_target_x_by_instance_id_[instance_id] =
+        database_.instance(instance_id).position().x();
+  }
+
+  vector<vector<RowId>> row_ids_by_component;
+  vector<vector<InstanceId>> instance_ids_by_component;
+
+  if (is_mmsim_decomposed_ || is_single_row_solved_exactly_) {
+    FindMmsimComponents(row_ids_by_component, instance_ids_by_component);
+  } else {
+    row_ids_by_component.push_back(vector<RowId>());
+    instance_ids_by_component.push_back(vector<InstanceId>());
+
+    for (int i = 0; i < database_.num_rows(); ++i) {
+      row_ids_by_component.back().push_back(RowId(i));
+    }
+    for (int i = 0; i < database_.num_instances(); ++i) {
+      const InstanceId instance_id(i);
+
+      if (!database_.instance(instance_id).is_fixed()) {
+        instance_ids_by_component.back().push_back(instance_id);
+      }
+    }
+  }
+
+  // Components of a single row need no MMSIM. Only the rows coupled by
+  // multi-row-height instances are left, as one system unless decomposed.
+
+  if (is_single_row_solved_exactly_) {
+    vector<vector<RowId>> coupled_row_ids_by_component;
+    vector<vector<InstanceId>> coupled_instance_ids_by_component;
+
+    for (int i = 0; i < row_ids_by_component.size(); ++i) {
+      if (instance_ids_by_component[i].empty()) {
+        continue;
+      }
+
+      if (row_ids_by_component[i].size() == 1) {
+        mmsim_single_row_ids_.push_back(row_ids_by_component[i].front());
+      } else if (is_mmsim_decomposed_ ||
+                 coupled_row_ids_by_component.empty()) {
+        coupled_row_ids_by_component.push_back(row_ids_by_component[i]);
+        coupled_instance_ids_by_component.push_back(
+            instance_ids_by_component[i]);
+      } else {
+        coupled_row_ids_by_component.back().insert(
+            coupled_row_ids_by_component.back().end(),
+            row_ids_by_component[i].begin(), row_ids_by_component[i].end());
+        coupled_instance_ids_by_component.back().insert(
+            coupled_instance_ids_by_component.back().end(),
+            instance_ids_by_component[i].begin(),
+            instance_ids_by_component[i].end());
+      }
+    }
+
+    if (!is_mmsim_decomposed_ && !coupled_row_ids_by_component.empty()) {
+      sort(coupled_row_ids_by_component.back().begin(),
+           coupled_row_ids_by_component.back().end());
+      sort(coupled_instance_ids_by_component.back().begin(),
+           coupled_instance_ids_by_component.back().end());
+    }
+
+    SolveSingleRows();
+
+    row_ids_by_component.swap(coupled_row_ids_by_component);
+    instance_ids_by_component.swap(coupled_instance_ids_by_component);
+  }
+
+  // Components are independent, so each one is factorized and iterated on its
+  // own thread. Big components go first to balance the load. The solvers are
+  // kept for Relegalize.
+
+  vector<int> component_indices;
+  for (int i = 0; i < instance_ids_by_component.size(); ++i) {
+    if (!instance_ids_by_component[i].empty()) {
+      component_indices.push_back(i);
+    }
+  }
+  sort(component_indices.begin(), component_indices.end(),
+       [&](int idx_a, int idx_b) {
+         return instance_ids_by_component[idx_a].size() >
+                instance_ids_by_component[idx_b].size();
+       });
+
+  const int num_solvers = component_indices.size();
+
+  mmsim_solvers_ = vector<MmsimSolver>(num_solvers);
+  mmsim_instance_ids_by_solver_.resize(num_solvers);
+  mmsim_solver_idx_by_instance_id_.assign(database_.num_instances(),
+                                          UNDEFINED_ID);
+
+  for (int i = 0; i < num_solvers; ++i) {
+    mmsim_instance_ids_by_solver_[i].swap(
+        instance_ids_by_component[component_indices[i]]);
+
+    for (InstanceId instance_id : mmsim_instance_ids_by_solver_[i]) {
+      mmsim_solver_idx_by_instance_id_[instance_id] = i;
+    }
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < num_solvers; ++i) {
+    mmsim_solvers_[i].set_freeze_iterations(mmsim_freeze_iterations_);
+    mmsim_solvers_[i].set_linear_solver(mmsim_linear_solver_);
+    mmsim_solvers_[i].set_precision(mmsim_precision_);
+    BuildMmsim(row_ids_by_component[component_indices[i]],
+               mmsim_instance_ids_by_solver_[i], mmsim_solvers_[i]);
+  }
+
+  vector<int> solver_indices(num_solvers);
+  for (int i = 0; i < num_solvers; ++i) {
+    solver_indices[i] = i;
+  }
+
+  IterateMmsimSolvers(solver_indices);
+  UpdateMmsimPositions();
+}
+
+void Legalizer::IterateMmsimSolvers(const vector<int>& solver_indices) {
+  // Components share no variables, so each solver iterates to its own
+  // convergence and a small component does not wait for the slowest one.
+
+  const int num_solvers = solver_indices.size();
+
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < num_solvers; ++i) {
+    MmsimSolver& mmsim_solver = mmsim_solvers_[solver_indices[i]];
+
+    while (!mmsim_solver.is_converged()) {
+      mmsim_solver.Iterate();
+    }
+  }
+
+  int num_failed_inner_solves = 0;
+  for (int i = 0; i < num_solvers; ++i) {
+    num_failed_inner_solves +=
+        mmsim_solvers_[solver_indices[i]].num_failed_inner_solves();
+  }
+
+  if (num_failed_inner_solves > 0) {
+    cout << "Fail to solve " << num_failed_inner_solves
+         << " MMSIM inner systems to tolerance" << endl;
+  }
+}
+
+void Legalizer::UpdateMmsimPositions() {
+  for (int i = 0; i < mmsim_solvers_.size(); ++i) {
+    const Vector& z = mmsim_solvers_[i].z();
+
+    for (InstanceId instance_id : mmsim_instance_ids_by_solver_[i]) {
+      Instance& instance = database_.instance(instance_id);
+
+      for (int j = 0; j < instance.num_sub_instances(); ++j) {
+        const SubInstanceId sub_instance_id = instance.sub_instance_id(j);
+        SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
+
+        sub_instance.set_position(
+            Point(z(mmsim_variable_idx_by_sub_instance_id_[sub_instance_id]),
+                  sub_instance.position().y()));
+
+        if (j == 0) {
+          instance.set_position(
+              Point(sub_instance.position().x(), instance.position().y()));
+        }
+      }
+    }
+  }
+}
+
+void Legalizer::FindMmsimComponents(
+    vector<vector<RowId>>& row_ids_by_component,
+    vector<vector<InstanceId>>& instance_ids_by_component) const {
   const int num_rows = database_.num_rows();
-  const double site_width = Site::width();
-  const int num_instances = database_.num_instances();
-  const int num_sub_instances = database_.num_sub_instances();
 
-  vector<Triplet> non_zero_elements;
-  int row_idx = 0;
-  int col_idx = 0;
-  vector<double> v;
-  int dummy_variable_idx = 0;
+  // Union rows spanned by the same multi-row-height instance.
 
-  // Construct cell ordering constraint matrix.
+  vector<int> parent_row_idx(num_rows);
+  for (int i = 0; i < num_rows; ++i) {
+    parent_row_idx[i] = i;
+  }
 
-  non_zero_elements.clear();
-  row_idx = 0;
-  col_idx = 0;
-  dummy_variable_idx = 0;
-  v.clear();
+  auto find_root_row_idx = [&](int row_idx) {
+    while (parent_row_idx[row_idx] != row_idx) {
+      parent_row_idx[row_idx] = parent_row_idx[parent_row_idx[row_idx]];
+      row_idx = parent_row_idx[row_idx];
+    }
+    return row_idx;
+  };
 
-  vector<double> interval_end_sub_instance_xs;
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    const InstanceId instance_id(i);
+    const Instance& instance = database_.instance(instance_id);
+
+    if (instance.is_fixed() || instance.num_sub_instances() < 2) {
+      continue;
+    }
+
+    const int bottom_row_idx = find_root_row_idx(
+        FindSubInstanceRowId(instance.sub_instance_id(0)));
+
+    for (int j = 1; j < instance.num_sub_instances(); ++j) {
+      const int row_idx =
+          find_root_row_idx(FindSubInstanceRowId(instance.sub_instance_id(j)));
+
+      parent_row_idx[row_idx] = bottom_row_idx;
+    }
+  }
+
+  // Collect rows and instances of each component in ascending order.
+
+  vector<int> component_idx_by_root_row_idx(num_rows, UNDEFINED_ID);
 
   for (int i = 0; i < num_rows; ++i) {
-    const RowId row_id(i);
-    const Row& row = database_.row(row_id);
+    const int root_row_idx = find_root_row_idx(i);
 
-    SubInstanceId previous_sub_instance_id(UNDEFINED_ID);
-    for (int j = 0; j < row.num_intervals(); ++j) {
-      const IntervalId interval_id = row.interval_id(j);
-      const Interval& interval = database_.interval(interval_id);
+    if (component_idx_by_root_row_idx[root_row_idx] == UNDEFINED_ID) {
+      component_idx_by_root_row_idx[root_row_idx] = row_ids_by_component.size();
+      row_ids_by_component.push_back(vector<RowId>());
+      instance_ids_by_component.push_back(vector<InstanceId>());
+    }
 
-      for (int k = 0; k < interval.num_sub_instances(); ++k) {
-        const SubInstanceId sub_instance_id = interval.sub_instance_id(k);
+    row_ids_by_component[component_idx_by_root_row_idx[root_row_idx]]
+        .push_back(RowId(i));
+  }
 
-        if (previous_sub_instance_id != UNDEFINED_ID) {
-          col_idx = previous_sub_instance_id;
-          non_zero_elements.push_back(Triplet(row_idx, col_idx, -1));
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    const InstanceId instance_id(i);
+    const Instance& instance = database_.instance(instance_id);
 
-          col_idx = sub_instance_id;
-          non_zero_elements.push_back(Triplet(row_idx, col_idx, 1));
+    if (instance.is_fixed()) {
+      continue;
+    }
 
-          ++row_idx;
+    const int root_row_idx =
+        find_root_row_idx(FindSubInstanceRowId(instance.sub_instance_id(0)));
 
-          if (previous_sub_instance_id < num_sub_instances) {
-            const SubInstance& previous_sub_instance =
-                database_.sub_instance(previous_sub_instance_id);
+    instance_ids_by_component[component_idx_by_root_row_idx[root_row_idx]]
+        .push_back(instance_id);
+  }
+}
 
-            v.push_back(previous_sub_instance.width());
-          } else {
-            v.push_back(0.0);
-          }
+void Legalizer::SolveSingleRows() {
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < mmsim_single_row_ids_.size(); ++i) {
+    SolveSingleRow(mmsim_single_row_ids_[i]);
+  }
+}
+
+void Legalizer::SolveSingleRow(RowId row_id) {
+  // Abacus: instances are appended in x order to the last cluster, which is
+  // placed at the mean of its members' desired positions within the interval
+  // and merged with its predecessor while they overlap. Each cluster keeps
+  // the number of members, the sum of desired positions shifted by member
+  // offsets, and its total width.
+
+  struct Cluster {
+    int num_sub_instances;
+    double shifted_x_sum;
+    double width;
+    double x;
+  };
+
+  const Row& row = database_.row(row_id);
+  vector<Cluster> clusters;
+
+  for (int i = 0; i < row.num_intervals(); ++i) {
+    const Interval& interval = database_.interval(row.interval_id(i));
+
+    // An overfilled interval keeps its begin, as the end of an interval is
+    // only a penalty in MMSIM.
+    auto place_cluster = [&](Cluster& cluster) {
+      cluster.x = max(interval.begin(),
+                      min(cluster.shifted_x_sum / cluster.num_sub_instances,
+                          interval.end() - cluster.width));
+    };
+
+    clusters.clear();
+    for (int j = 0; j < interval.num_sub_instances(); ++j) {
+      const SubInstance& sub_instance =
+          database_.sub_instance(interval.sub_instance_id(j));
+      const double x = sub_instance.position().x();
+
+      if (clusters.empty() ||
+          clusters.back().x + clusters.back().width <= x) {
+        clusters.push_back(Cluster{1, x, sub_instance.width(), 0.0});
+      } else {
+        Cluster& last_cluster = clusters.back();
+        ++last_cluster.num_sub_instances;
+        last_cluster.shifted_x_sum += x - last_cluster.width;
+        last_cluster.width += sub_instance.width();
+      }
+      place_cluster(clusters.back());
+
+      while (clusters.size() > 1) {
+        const Cluster& cluster = clusters.back();
+        Cluster& previous_cluster = clusters[clusters.size() - 2];
+
+        if (previous_cluster.x + previous_cluster.width <= cluster.x) {
+          break;
         }
 
-        previous_sub_instance_id = sub_instance_id;
+        previous_cluster.shifted_x_sum +=
+            cluster.shifted_x_sum -
+            cluster.num_sub_instances * previous_cluster.width;
+        previous_cluster.num_sub_instances += cluster.num_sub_instances;
+        previous_cluster.width += cluster.width;
+        clusters.pop_back();
+        place_cluster(clusters.back());
       }
+    }
 
-      {
-        const SubInstanceId sub_instance_id(num_sub_instances +
-                                            dummy_variable_idx);
+    int sub_instance_idx = 0;
+    for (const Cluster& cluster : clusters) {
+      double x = cluster.x;
 
-        interval_end_sub_instance_xs.push_back(interval.end());
+      for (int j = 0; j < cluster.num_sub_instances; ++j) {
+        SubInstance& sub_instance =
+            database_.sub_instance(interval.sub_instance_id(sub_instance_idx));
+        Instance& instance = database_.instance(sub_instance.instance_id());
 
-        ++dummy_variable_idx;
+        sub_instance.set_position(Point(x, sub_instance.position().y()));
+        instance.set_position(Point(x, instance.position().y()));
 
-        if (previous_sub_instance_id != UNDEFINED_ID) {
-          col_idx = previous_sub_instance_id;
-          non_zero_elements.push_back(Triplet(row_idx, col_idx, -1));
+        x += sub_instance.width();
+        ++sub_instance_idx;
+      }
+    }
+  }
+}
 
-          col_idx = sub_instance_id;
-          non_zero_elements.push_back(Triplet(row_idx, col_idx, 1));
+RowId Legalizer::FindSubInstanceRowId(SubInstanceId sub_instance_id) const {
+  const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
 
-          ++row_idx;
+  return database_.interval(sub_instance.interval_id()).row_id();
+}
 
-          if (previous_sub_instance_id < num_sub_instances) {
-            const SubInstance& previous_sub_instance =
-                database_.sub_instance(previous_sub_instance_id);
+void Legalizer::BuildMmsim(const vector<RowId>& row_ids,
+                           const vector<InstanceId>& instance_ids,
+                           MmsimSolver& mmsim_solver) {
+  const double site_width = Site::width();
 
-            v.push_back(previous_sub_instance.width());
-          } else {
-            v.push_back(0.0);
-          }
+  // Number the sub instances by row and then by x instead of in DEF order,
+  // so that each constraint only couples nearby variables. All sub instances
+  // of a multi-row-height instance are numbered together when the first one
+  // is met. Results are mapped back through
+  // mmsim_variable_idx_by_sub_instance_id_.
+
+  vector<SubInstanceId> sub_instance_ids;
+  for (RowId row_id : row_ids) {
+    const Row& row = database_.row(row_id);
+
+    for (int j = 0; j < row.num_intervals(); ++j) {
+      const Interval& interval = database_.interval(row.interval_id(j));
+
+      for (int k = 0; k < interval.num_sub_instances(); ++k) {
+        const SubInstanceId sub_instance_id = interval.sub_instance_id(k);
+
+        if (mmsim_variable_idx_by_sub_instance_id_[sub_instance_id] !=
+            UNDEFINED_ID) {
+          continue;
         }
 
-        previous_sub_instance_id = sub_instance_id;
+        const Instance& instance = database_.instance(
+            database_.sub_instance(sub_instance_id).instance_id());
+
+        for (int l = 0; l < instance.num_sub_instances(); ++l) {
+          mmsim_variable_idx_by_sub_instance_id_[instance.sub_instance_id(l)] =
+              sub_instance_ids.size();
+          sub_instance_ids.push_back(instance.sub_instance_id(l));
+        }
       }
     }
   }
 
-  const int num_interval_end_sub_instances = dummy_variable_idx;
+  const int num_sub_instances = sub_instance_ids.size();
 
-  SparseMatrix cell_ordering_constraint_matrix(
-      row_idx, num_sub_instances + num_interval_end_sub_instances);
-  cell_ordering_constraint_matrix.setFromTriplets(non_zero_elements.begin(),
-                                                  non_zero_elements.end());
+  // Variables are laid out as sub instances, interval end dummies, slack
+  // variables of the interval begin constraints and dummy variables of the
+  // multi-row-height instance constraints. Dummy variables are placed after
+  // the slack variables. Sharing columns with the slacks would couple
+  // instances with unrelated intervals on other rows.
 
-  Vector width_vector(Eigen::Map<Vector>(v.data(), v.size()));
+  int num_interval_end_sub_instances = 0;
+  int num_interval_begin_constraints = 0;
+  for (RowId row_id : row_ids) {
+    const Row& row = database_.row(row_id);
 
-  // Construct interval constraint matrix.
+    num_interval_end_sub_instances += row.num_intervals();
 
-  non_zero_elements.clear();
-  row_idx = 0;
-  col_idx = 0;
-  v.clear();
+    for (int j = 0; j < row.num_intervals(); ++j) {
+      const Interval& interval = database_.interval(row.interval_id(j));
 
-  for (int i = 0; i < num_rows; ++i) {
-    const RowId row_id(i);
+      if (interval.num_sub_instances() > 0) {
+        ++num_interval_begin_constraints;
+      }
+    }
+  }
+
+  int num_multi_row_height_instance_constraints = 0;
+  int num_dummy_variables = num_interval_begin_constraints;
+  for (InstanceId instance_id : instance_ids) {
+    const Instance& instance = database_.instance(instance_id);
+
+    if (instance.num_sub_instances() > 1) {
+      num_multi_row_height_instance_constraints +=
+          instance.num_sub_instances() - 1;
+    }
+    if (instance.num_sub_instances() > 2) {
+      num_dummy_variables += instance.num_sub_instances() - 2;
+    }
+  }
+
+  const int first_slack_variable_idx =
+      num_sub_instances + num_interval_end_sub_instances;
+  const int first_dummy_variable_idx =
+      first_slack_variable_idx + num_interval_begin_constraints;
+  const int num_variables =
+      num_sub_instances + num_interval_end_sub_instances + num_dummy_variables;
+
+  // Construct constraint matrix B and multiplier vector b. Cell ordering
+  // constraints come first, then interval begin constraints. Every row has
+  // exactly two nonzeros, which are also kept for computing D below.
+
+  const int max_num_constraints = num_sub_instances +
+                                  num_interval_end_sub_instances +
+                                  num_interval_begin_constraints;
+
+  vector<int> constraint_variable_indices;
+  vector<double> constraint_coefficients;
+  vector<double> multipliers;
+  constraint_variable_indices.reserve(2 * max_num_constraints);
+  constraint_coefficients.reserve(2 * max_num_constraints);
+  multipliers.reserve(max_num_constraints);
+
+  auto add_constraint = [&](int variable_idx_a, double coefficient_a,
+                            int variable_idx_b, double coefficient_b,
+                            double multiplier) {
+    constraint_variable_indices.push_back(variable_idx_a);
+    constraint_coefficients.push_back(coefficient_a);
+    constraint_variable_indices.push_back(variable_idx_b);
+    constraint_coefficients.push_back(coefficient_b);
+    multipliers.push_back(multiplier);
+  };
+
+  vector<double> interval_end_sub_instance_xs;
+  interval_end_sub_instance_xs.reserve(num_interval_end_sub_instances);
+
+  for (RowId row_id : row_ids) {
+    const Row& row = database_.row(row_id);
+
+    int previous_variable_idx = UNDEFINED_ID;
+    for (int j = 0; j < row.num_intervals(); ++j) {
+      const IntervalId interval_id = row.interval_id(j);
+      const Interval& interval = database_.interval(interval_id);
+
+      for (int k = 0; k <= interval.num_sub_instances(); ++k) {
+        int variable_idx = UNDEFINED_ID;
+        if (k < interval.num_sub_instances()) {
+          variable_idx = mmsim_variable_idx_by_sub_instance_id_
+              [interval.sub_instance_id(k)];
+        } else {
+          variable_idx =
+              num_sub_instances + interval_end_sub_instance_xs.size();
+
+          interval_end_sub_instance_xs.push_back(interval.end());
+        }
+
+        if (previous_variable_idx != UNDEFINED_ID) {
+          double width = 0.0;
+          if (previous_variable_idx < num_sub_instances) {
+            width = database_
+                        .sub_instance(sub_instance_ids[previous_variable_idx])
+                        .width();
+          }
+
+          add_constraint(previous_variable_idx, -1, variable_idx, 1, width);
+        }
+
+        previous_variable_idx = variable_idx;
+      }
+    }
+  }
+
+  int slack_variable_idx = first_slack_variable_idx;
+  for (RowId row_id : row_ids) {
     const Row& row = database_.row(row_id);
 
     for (int j = 0; j < row.num_intervals(); ++j) {
@@ -178,308 +720,244 @@ void Legalizer::Mmsim() {
       if (interval.num_sub_instances() > 0) {
         const SubInstanceId sub_instance_id = interval.first_sub_instance_id();
 
-        col_idx = sub_instance_id;
-        non_zero_elements.push_back(Triplet(row_idx, col_idx, 1));
+        add_constraint(mmsim_variable_idx_by_sub_instance_id_[sub_instance_id],
+                       1, slack_variable_idx, -1, interval.begin());
 
-        v.push_back(interval.begin());
-
-        ++row_idx;
+        ++slack_variable_idx;
       }
     }
   }
 
-  SparseMatrix interval_begin_constraint_matrix(
-      row_idx, num_sub_instances + num_interval_end_sub_instances);
-  interval_begin_constraint_matrix.setFromTriplets(non_zero_elements.begin(),
-                                                   non_zero_elements.end());
+  const int num_constraints = multipliers.size();
 
-  Vector interval_begin_vector(Eigen::Map<Vector>(v.data(), v.size()));
+  vector<Triplet> non_zero_elements;
+  non_zero_elements.reserve(constraint_variable_indices.size());
+  for (int i = 0; i < constraint_variable_indices.size(); ++i) {
+    non_zero_elements.push_back(Triplet(i / 2, constraint_variable_indices[i],
+                                        constraint_coefficients[i]));
+  }
 
-  SparseMatrix interval_constraint_matrix = interval_begin_constraint_matrix;
-  Vector interval_vector = interval_begin_vector;
+  SparseMatrix B(num_constraints, num_variables);
+  B.setFromTriplets(non_zero_elements.begin(), non_zero_elements.end());
 
-  // Construct multi-row-height instance constraint matrix.
+  // Construct multi-row-height instance constraint matrix E, and F = Q +
+  // lambda * E^T * E from the same nonzeros. Dummy variables are chained so
+  // that E * E^T is diagonal.
+
+  const double lambda = 1000;
+  const double interval_end_sub_instance_penalty_weight = 1.0e9;  // TODO: Tune.
+
+  vector<Triplet> multi_row_height_non_zero_elements;
+  multi_row_height_non_zero_elements.reserve(
+      4 * num_multi_row_height_instance_constraints);
 
   non_zero_elements.clear();
-  row_idx = 0;
-  col_idx = 0;
-  dummy_variable_idx = 0;
+  non_zero_elements.reserve(num_variables +
+                            16 * num_multi_row_height_instance_constraints);
 
-  for (int i = 0; i < num_instances; ++i) {
-    const InstanceId instance_id(i);
-    const Instance& instance = database_.instance(instance_id);
+  for (int i = 0; i < num_variables; ++i) {
+    const bool is_interval_end = i >= num_sub_instances &&
+                                 i < first_slack_variable_idx;
 
-    if (instance.is_fixed()) {
-      continue;
-    }
+    non_zero_elements.push_back(Triplet(
+        i, i, is_interval_end ? interval_end_sub_instance_penalty_weight : 1));
+  }
+
+  vector<double> multi_row_height_constraint_squared_norms;
+  multi_row_height_constraint_squared_norms.reserve(
+      num_multi_row_height_instance_constraints);
+
+  int dummy_variable_idx = first_dummy_variable_idx;
+  for (InstanceId instance_id : instance_ids) {
+    const Instance& instance = database_.instance(instance_id);
 
     for (int j = 1; j < instance.num_sub_instances(); ++j) {
-      const SubInstanceId lower_sub_instance_id =
-          instance.sub_instance_id(j - 1);
-      const SubInstanceId sub_instance_id = instance.sub_instance_id(j);
+      const int row_idx = multi_row_height_constraint_squared_norms.size();
 
-      col_idx = lower_sub_instance_id;
-      non_zero_elements.push_back(Triplet(row_idx, col_idx, -1));
+      int variable_indices[4];
+      int num_variable_indices = 0;
 
-      col_idx = sub_instance_id;
-      non_zero_elements.push_back(Triplet(row_idx, col_idx, 1));
+      variable_indices[num_variable_indices++] =
+          mmsim_variable_idx_by_sub_instance_id_[instance.sub_instance_id(j -
+                                                                          1)];
+      variable_indices[num_variable_indices++] =
+          mmsim_variable_idx_by_sub_instance_id_[instance.sub_instance_id(j)];
 
       if (instance.num_sub_instances() > 2) {
         if (j == 1) {
-          col_idx = num_sub_instances + num_interval_end_sub_instances +
-                    dummy_variable_idx;
-          non_zero_elements.push_back(Triplet(row_idx, col_idx, 1));
+          variable_indices[num_variable_indices++] = dummy_variable_idx;
         } else if (j == instance.num_sub_instances() - 1) {
-          col_idx = num_sub_instances + num_interval_end_sub_instances +
-                    dummy_variable_idx;
-          non_zero_elements.push_back(Triplet(row_idx, col_idx, 1));
+          variable_indices[num_variable_indices++] = dummy_variable_idx;
 
           ++dummy_variable_idx;
         } else {
-          col_idx = num_sub_instances + num_interval_end_sub_instances +
-                    dummy_variable_idx;
-          non_zero_elements.push_back(Triplet(row_idx, col_idx, 1));
+          variable_indices[num_variable_indices++] = dummy_variable_idx;
 
           ++dummy_variable_idx;
 
-          col_idx = num_sub_instances + num_interval_end_sub_instances +
-                    dummy_variable_idx;
-          non_zero_elements.push_back(Triplet(row_idx, col_idx, 1));
+          variable_indices[num_variable_indices++] = dummy_variable_idx;
         }
       }
 
-      ++row_idx;
+      for (int k = 0; k < num_variable_indices; ++k) {
+        const double coefficient_k = (k == 0) ? -1 : 1;
+
+        multi_row_height_non_zero_elements.push_back(
+            Triplet(row_idx, variable_indices[k], coefficient_k));
+
+        for (int l = 0; l < num_variable_indices; ++l) {
+          const double coefficient_l = (l == 0) ? -1 : 1;
+
+          non_zero_elements.push_back(
+              Triplet(variable_indices[k], variable_indices[l],
+                      lambda * coefficient_k * coefficient_l));
+        }
+      }
+
+      multi_row_height_constraint_squared_norms.push_back(num_variable_indices);
     }
   }
 
-  SparseMatrix multi_row_height_instance_constraint_matrix(
-      row_idx,
-      num_sub_instances + num_interval_end_sub_instances + dummy_variable_idx);
-  multi_row_height_instance_constraint_matrix.setFromTriplets(
-      non_zero_elements.begin(), non_zero_elements.end());
+  assert(dummy_variable_idx == num_variables);
 
-  // Combine constraint matrices and make sure the result is of full row rank.
+  SparseMatrix E(num_multi_row_height_instance_constraints, num_variables);
+  E.setFromTriplets(multi_row_height_non_zero_elements.begin(),
+                    multi_row_height_non_zero_elements.end());
 
-  const int num_dummy_variables =
-      max(interval_constraint_matrix.rows(),
-          multi_row_height_instance_constraint_matrix.cols() -
-              num_sub_instances - num_interval_end_sub_instances);
-  const int num_variables =
-      num_sub_instances + num_interval_end_sub_instances + num_dummy_variables;
+  SparseMatrix F(num_variables, num_variables);
+  F.setFromTriplets(non_zero_elements.begin(), non_zero_elements.end());
 
-  SparseMatrix constraint_matrix = ConcatenateMatricesVertically(
-      ConcatenateMatricesHorizontally(
-          cell_ordering_constraint_matrix,
-          SparseMatrix(cell_ordering_constraint_matrix.rows(),
-                       num_dummy_variables)),
-      ConcatenateMatricesHorizontally(
-          interval_constraint_matrix,
-          num_dummy_variables > interval_constraint_matrix.rows()
-              ? ConcatenateMatricesHorizontally(
-                    -1 * MakeIdentityMatrix(interval_constraint_matrix.rows()),
-                    SparseMatrix(interval_constraint_matrix.rows(),
-                                 num_dummy_variables -
-                                     interval_constraint_matrix.rows()))
-              : -1 * MakeIdentityMatrix(interval_constraint_matrix.rows())));
-
-  Vector multiplier_vector(width_vector.rows() + interval_vector.rows());
-  multiplier_vector << width_vector, interval_vector;
-
-  if (num_variables > multi_row_height_instance_constraint_matrix.cols()) {
-    multi_row_height_instance_constraint_matrix =
-        ConcatenateMatricesHorizontally(
-            multi_row_height_instance_constraint_matrix,
-            SparseMatrix(
-                multi_row_height_instance_constraint_matrix.rows(),
-                num_variables -
-                    multi_row_height_instance_constraint_matrix.cols()));
-  }
-
-  // Construct global placed position vector.
+  //cout << "F: " << F.rows() << " X " << F.cols() << endl;
 
-  const double interval_end_sub_instance_penalty_weight = 1.0e9;  // TODO: Tune.
+  // Construct q = [p; -b] where p is the negative global placed position.
 
-  v = vector<double>(num_variables, 0.0);
+  Vector q = Vector::Zero(num_variables + num_constraints);
 
   for (int i = 0; i < num_sub_instances; ++i) {
-    const SubInstanceId sub_instance_id(i);
-    const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
+    const SubInstance& sub_instance =
+        database_.sub_instance(sub_instance_ids[i]);
 
-    v[i] = -1 * sub_instance.position().x();
+    q(i) = -1 * sub_instance.position().x();
   }
   for (int i = 0; i < num_interval_end_sub_instances; ++i) {
-    v[num_sub_instances + i] = -1 * interval_end_sub_instance_penalty_weight *
+    q(num_sub_instances + i) = -1 * interval_end_sub_instance_penalty_weight *
                                interval_end_sub_instance_xs[i];
   }
+  for (int i = 0; i < num_constraints; ++i) {
+    q(num_variables + i) = -1 * multipliers[i];
+  }
 
-  Vector global_placed_position_vector(Eigen::Map<Vector>(v.data(), v.size()));
-
-  // Prepare matrices.
-
-  /* const SparseMatrix Q = MakeIdentityMatrix(num_variables); */
-  const SparseMatrix Q = ConcatenateMatricesVertically(
-      ConcatenateMatricesHorizontally(
-          ConcatenateMatricesVertically(
-              ConcatenateMatricesHorizontally(
-                  MakeIdentityMatrix(num_sub_instances),
-                  SparseMatrix(num_sub_instances,
-                               num_interval_end_sub_instances)),
-              ConcatenateMatricesHorizontally(
-                  SparseMatrix(num_interval_end_sub_instances,
-                               num_sub_instances),
-                  interval_end_sub_instance_penalty_weight *
-                      MakeIdentityMatrix(num_interval_end_sub_instances))),
-          SparseMatrix(num_sub_instances + num_interval_end_sub_instances,
-                       num_dummy_variables)),
-      ConcatenateMatricesHorizontally(
-          SparseMatrix(num_dummy_variables,
-                       num_sub_instances + num_interval_end_sub_instances),
-          MakeIdentityMatrix(num_dummy_variables)));
-  const SparseMatrix E = multi_row_height_instance_constraint_matrix;
-  const SparseMatrix B = constraint_matrix;
-  const Vector p = global_placed_position_vector;
-  const Vector b = multiplier_vector;
-
-  /*cout << "Q: " << Q.rows() << " X " << Q.cols() << endl;
-  cout << "E: " << E.rows() << " X " << E.cols() << endl;
-  cout << "B: " << B.rows() << " X " << B.cols() << endl;
-  cout << "p: " << p.rows() << endl;
-  cout << "b: " << b.rows() << endl;*/
-
-  const SparseMatrix E_T = E.transpose();
-  const SparseMatrix B_T = B.transpose();
+  //cout << "q: " << q.rows() << endl;
 
-  const double lambda = 1000;
+  // Construct D = Tridiag(B * (I - lambda * E^T * H * E) * B^T) where H =
+  // (I + lambda * E * E^T)^-1 is diagonal. Entry (i, j) is
+  //
+  //   b_i . b_j - lambda * sum_r H_r * (E_r . b_i) * (E_r . b_j),
+  //
+  // and E_r . b_i is nonzero only for the few rows r of E that share a
+  // variable with constraint i.
+
+  auto compute_projections = [&](int constraint_idx,
+                                 vector<pair<int, double>>& projections) {
+    projections.clear();
+
+    for (int k = 2 * constraint_idx; k < 2 * constraint_idx + 2; ++k) {
+      for (SparseMatrix::InnerIterator it(E, constraint_variable_indices[k]);
+           it; ++it) {
+        const double value = constraint_coefficients[k] * it.value();
+
+        auto projection_it = find_if(
+            projections.begin(), projections.end(),
+            [&](const pair<int, double>& p) { return p.first == it.row(); });
+
+        if (projection_it == projections.end()) {
+          projections.push_back(make_pair(it.row(), value));
+        } else {
+          projection_it->second += value;
+        }
+      }
+    }
+  };
+
+  auto compute_entry = [&](int constraint_idx_a,
+                           const vector<pair<int, double>>& projections_a,
+                           int constraint_idx_b,
+                           const vector<pair<int, double>>& projections_b) {
+    double entry = 0.0;
+
+    for (int k = 2 * constraint_idx_a; k < 2 * constraint_idx_a + 2; ++k) {
+      for (int l = 2 * constraint_idx_b; l < 2 * constraint_idx_b + 2; ++l) {
+        if (constraint_variable_indices[k] == constraint_variable_indices[l]) {
+          entry += constraint_coefficients[k] * constraint_coefficients[l];
+        }
+      }
+    }
+
+    for (const pair<int, double>& projection_a : projections_a) {
+      for (const pair<int, double>& projection_b : projections_b) {
+        if (projection_a.first == projection_b.first) {
+          entry -= lambda * projection_a.second * projection_b.second /
+                   (1 + lambda * multi_row_height_constraint_squared_norms
+                                     [projection_a.first]);
+        }
+      }
+    }
 
-  const SparseMatrix F = Q + lambda * E_T * E;
+    return entry;
+  };
 
-  //cout << "F: " << F.rows() << " X " << F.cols() << endl;
+  non_zero_elements.clear();
+  non_zero_elements.reserve(3 * num_constraints);
+
+  vector<pair<int, double>> projections;
+  vector<pair<int, double>> next_projections;
+  if (num_constraints > 0) {
+    compute_projections(0, projections);
+  }
+  for (int i = 0; i < num_constraints; ++i) {
+    non_zero_elements.push_back(
+        Triplet(i, i, compute_entry(i, projections, i, projections)));
 
-  const SparseMatrix A = ConcatenateMatricesVertically(
-      ConcatenateMatricesHorizontally(F, -1 * B_T),
-      ConcatenateMatricesHorizontally(B, SparseMatrix(B.rows(), B.rows())));
-  const Vector q = [&]() {
-    Vector tmp(p.rows() + b.rows());
-    tmp << p, -1 * b;
-    return tmp;
-  }();
+    if (i + 1 < num_constraints) {
+      compute_projections(i + 1, next_projections);
 
-  //cout << "A: " << A.rows() << " X " << A.cols() << endl;
-  //cout << "q: " << q.rows() << endl;
+      const double entry =
+          compute_entry(i, projections, i + 1, next_projections);
+
+      non_zero_elements.push_back(Triplet(i, i + 1, entry));
+      non_zero_elements.push_back(Triplet(i + 1, i, entry));
+
+      projections.swap(next_projections);
+    }
+  }
 
-  const SparseMatrix D = TridiagMatrix(
-      (B * B_T) -
-      (B *
-       (lambda * E_T *
-        InverseDiagonalMatrix(MakeIdentityMatrix(E.rows()) + lambda * E * E_T) *
-        E) *
-       B_T));
+  SparseMatrix D(num_constraints, num_constraints);
+  D.setFromTriplets(non_zero_elements.begin(), non_zero_elements.end());
 
   //cout << "D: " << D.rows() << " X " << D.cols() << endl;
 
   const double beta = 0.5;
   const double theta = 0.5;
 
-  const SparseMatrix M = ConcatenateMatricesVertically(
-      ConcatenateMatricesHorizontally((1 / beta) * F,
-                                      SparseMatrix(B.cols(), B.rows())),
-      ConcatenateMatricesHorizontally(B, (1 / theta) * D));
-  const SparseMatrix N = ConcatenateMatricesVertically(
-      ConcatenateMatricesHorizontally((1 / beta - 1) * F, B_T),
-      ConcatenateMatricesHorizontally(SparseMatrix(B.rows(), B.cols()),
-                                      (1 / theta) * D));
-  const SparseMatrix I = MakeIdentityMatrix(M.rows());
-
-  //cout << "M: " << M.rows() << " X " << M.cols() << endl;
-  //cout << "N: " << N.rows() << " X " << N.cols() << endl;
-
   const double gamma = 10;
   const double epsilon = site_width / 4;  // TODO: Tune.
 
-  v = vector<double>(q.rows(), epsilon);
-
-  const Vector e(Eigen::Map<Vector>(v.data(), v.size()));
-
-  // Start main algorithm.
-
-  v = vector<double>(q.rows(), 0.0);
-
-  Vector s(Eigen::Map<Vector>(v.data(), v.size()));
-
-  v = vector<double>(q.rows(), 0.0);
+  Vector z = Vector::Zero(q.rows());
 
   for (int i = 0; i < num_sub_instances; ++i) {
-    const SubInstanceId sub_instance_id(i);
-    const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
-
-    v[i] = sub_instance.position().x();
+    z(i) = database_.sub_instance(sub_instance_ids[i]).position().x();
   }
   for (int i = 0; i < num_interval_end_sub_instances; ++i) {
-    v[num_sub_instances + i] = interval_end_sub_instance_xs[i];
-  }
-
-  Vector z(Eigen::Map<Vector>(v.data(), v.size()));
-
-  Vector previous_z(z);
-  Vector z_sub_instance_diff_abs;
-  int k = 0;
-  Eigen::SparseLU<SparseMatrix> lu_solver;
-  const SparseMatrix M_plus_I = M + I;
-  const SparseMatrix I_minus_A = I - A;
-  const Vector gamma_multiply_q = gamma * q;
-  lu_solver.compute(M_plus_I);
-  do {
-    s = lu_solver.solve(N * s + I_minus_A * AbsVector(s) - gamma_multiply_q);
-
-    previous_z = z;
-    z = (1 / gamma) * (AbsVector(s) + s);
-
-    Vector z_sub_instance = z.head(num_sub_instances);
-    Vector previous_z_sub_instance = previous_z.head(num_sub_instances);
-    z_sub_instance_diff_abs =
-        AbsVector(z_sub_instance - previous_z_sub_instance);
-
-    /* cout << endl; */
-    /* cout << "k: " << k << endl; */
-    /* for (int i = 0; i < num_sub_instances; ++i) { */
-    /*   cout << z(i) << " " << previous_z(i) << endl; */
-    /* } */
-
-    /* int count = 0; */
-    /* for (Eigen::Index i = 0; i < z_sub_instance_diff_abs.rows(); ++i) { */
-    /*   if (z_sub_instance_diff_abs(i) >= epsilon) { */
-    /*     ++count; */
-    /*   } */
-    /* } */
-    /* cout << count << endl; */
-
-    ++k;
-  } while (!(z_sub_instance_diff_abs < e));
-
-  for (int i = 0; i < num_instances; ++i) {
-    const InstanceId instance_id(i);
-    Instance& instance = database_.instance(instance_id);
-
-    if (instance.is_fixed()) {
-      continue;
-    }
-
-    for (int j = 0; j < instance.num_sub_instances(); ++j) {
-      const SubInstanceId sub_instance_id = instance.sub_instance_id(j);
-      SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
-
-      sub_instance.set_position(
-          Point(z(sub_instance_id), sub_instance.position().y()));
-
-      if (j == 0) {
-        instance.set_position(
-            Point(sub_instance.position().x(), instance.position().y()));
-      }
-    }
+    z(num_sub_instances + i) = interval_end_sub_instance_xs[i];
   }
+
+  mmsim_solver.Initialize(F, B, D, beta, theta, q, z, num_sub_instances, gamma,
+                          epsilon);
 }
 
 void Legalizer::PostMmsim() {
+  site_occupancy_map_.Initialize(database_);
+
   //cout << "Align instances to sites..." << endl;
 
   AlignInstancesToSites();
@@ -488,9 +966,11 @@ void Legalizer::PostMmsim() {
 
   AllocateIllegalInstances();
 
-  /* cout << "Meet edge spacing constraints..." << endl; */
+  if (is_edge_spacing_resolved_) {
+    cout << "Meet edge spacing constraints..." << endl;
 
-  /* ResolveEdgeSpacingConstraint(); */
+    ResolveEdgeSpacingConstraint();
+  }
 
   cout << "Check if the result is legal..." << endl;
 
@@ -514,349 +994,767 @@ void Legalizer::PreDDA() {
 	}
 }
 
+void Legalizer::BuildBins() {
+  const double row_height = Site::height();
+  const double site_area = Site::width() * row_height;
+  const Point& die_min_corner = database_.die_rect().min_corner();
+  const double die_width =
+      database_.die_rect().max_corner().x() - die_min_corner.x();
+  const double die_height =
+      database_.die_rect().max_corner().y() - die_min_corner.y();
+  const int num_bin_instances = 16;  // TODO: Tune.
+
+  // Bins are a whole number of rows high.
+
+  double movable_area = 0.0;
+  int num_movable_instances = 0;
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    const Instance& instance = database_.instance(InstanceId(i));
+
+    if (!instance.is_fixed()) {
+      movable_area += instance.width() * instance.height();
+      ++num_movable_instances;
+    }
+  }
+
+  const int max_num_bin_rows = max(database_.num_rows(), 1);
+  num_bin_rows_ = max_num_bin_rows;
+  if (num_movable_instances > 0) {
+    num_bin_rows_ = static_cast<int>(
+        round(sqrt(num_bin_instances * movable_area / num_movable_instances) /
+              row_height));
+    num_bin_rows_ = min(max(num_bin_rows_, 1), max_num_bin_rows);
+  }
+
+  const double bin_width = num_bin_rows_ * row_height;
+  const int num_bin_row_groups =
+      max(static_cast<int>(ceil(die_height / bin_width)), 1);
+
+  num_bin_columns_ = max(static_cast<int>(ceil(die_width / bin_width)), 1);
+
+  bins_.assign(num_bin_row_groups * num_bin_columns_, Bin());
+  free_area_by_bin_.assign(bins_.size(), 0.0);
+
+  for (int i = 0; i < bins_.size(); ++i) {
+    bins_[i] = Bin(die_min_corner + Point((i % num_bin_columns_) * bin_width,
+                                          (i / num_bin_columns_) * bin_width),
+                   bin_width);
+  }
+
+  // Sites are created row by row from the bottom left, num_row_sites per
+  // row, as SiteOccupancyMap assumes. A site belongs to the bin its left edge
+  // is in.
+
+  const int num_rows = database_.num_rows();
+  const int num_row_sites = database_.num_sites() / num_rows;
+
+  for (int i = 0; i < num_rows; ++i) {
+    const int bin_row_group_idx =
+        min(i / num_bin_rows_, num_bin_row_groups - 1);
+
+    for (int j = 0; j < num_row_sites; ++j) {
+      if (!database_.site(SiteId(i * num_row_sites + j)).is_valid()) {
+        continue;
+      }
+
+      const int bin_column_idx =
+          min(static_cast<int>(j * Site::width() / bin_width),
+              num_bin_columns_ - 1);
+
+      free_area_by_bin_[bin_row_group_idx * num_bin_columns_ +
+                        bin_column_idx] += site_area;
+    }
+  }
+}
+
+void Legalizer::FindNearestBins(const Point& point,
+                                array<int, 4>& bin_indices,
+                                array<double, 4>& weights) const {
+  const double bin_width = num_bin_rows_ * Site::height();
+  const int num_bin_row_groups = bins_.size() / num_bin_columns_;
+  const Point offset = point - database_.die_rect().min_corner();
+
+  // Bin centres are half a bin in from the lower left corners of the bins.
+
+  const double column_position = offset.x() / bin_width - 0.5;
+  const double row_group_position = offset.y() / bin_width - 0.5;
+  const int left_bin_column_idx =
+      min(max(static_cast<int>(floor(column_position)), 0),
+          num_bin_columns_ - 1);
+  const int bottom_bin_row_group_idx =
+      min(max(static_cast<int>(floor(row_group_position)), 0),
+          num_bin_row_groups - 1);
+  const int right_bin_column_idx =
+      min(left_bin_column_idx + 1, num_bin_columns_ - 1);
+  const int top_bin_row_group_idx =
+      min(bottom_bin_row_group_idx + 1, num_bin_row_groups - 1);
+  const double x_weight =
+      min(max(column_position - left_bin_column_idx, 0.0), 1.0);
+  const double y_weight =
+      min(max(row_group_position - bottom_bin_row_group_idx, 0.0), 1.0);
+
+  bin_indices = {
+      {bottom_bin_row_group_idx * num_bin_columns_ + left_bin_column_idx,
+       bottom_bin_row_group_idx * num_bin_columns_ + right_bin_column_idx,
+       top_bin_row_group_idx * num_bin_columns_ + left_bin_column_idx,
+       top_bin_row_group_idx * num_bin_columns_ + right_bin_column_idx}};
+  weights = {{(1.0 - x_weight) * (1.0 - y_weight), x_weight * (1.0 - y_weight),
+              (1.0 - x_weight) * y_weight, x_weight * y_weight}};
+}
+
+void Legalizer::FillBins() {
+  const int num_nearest_bins = 4;
+
+  // Split the area of each movable instance among the bins near its centre,
+  // then bucket the shares by bin, so that each bin is filled by one thread.
+
+  vector<int> bin_idx_by_share(num_nearest_bins * database_.num_instances(),
+                               UNDEFINED_ID);
+  vector<double> area_by_share(bin_idx_by_share.size(), 0.0);
+
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    const Instance& instance = database_.instance(InstanceId(i));
+
+    if (instance.is_fixed()) {
+      continue;
+    }
+
+    array<int, num_nearest_bins> bin_indices;
+    array<double, num_nearest_bins> weights;
+
+    FindNearestBins(instance.position() + Point(0.5 * instance.width(),
+                                                0.5 * instance.height()),
+                    bin_indices, weights);
+
+    for (int j = 0; j < num_nearest_bins; ++j) {
+      if (weights[j] > 0.0) {
+        bin_idx_by_share[i * num_nearest_bins + j] = bin_indices[j];
+        area_by_share[i * num_nearest_bins + j] =
+            weights[j] * instance.width() * instance.height();
+      }
+    }
+  }
+
+  vector<int> begin_idx_by_bin(bins_.size() + 1, 0);
+  for (int i = 0; i < bin_idx_by_share.size(); ++i) {
+    if (bin_idx_by_share[i] != UNDEFINED_ID) {
+      ++begin_idx_by_bin[bin_idx_by_share[i] + 1];
+    }
+  }
+  for (int i = 0; i < bins_.size(); ++i) {
+    begin_idx_by_bin[i + 1] += begin_idx_by_bin[i];
+  }
+
+  vector<int> share_indices_by_bin(begin_idx_by_bin.back());
+  vector<int> end_idx_by_bin(begin_idx_by_bin.begin(),
+                             begin_idx_by_bin.end() - 1);
+  for (int i = 0; i < bin_idx_by_share.size(); ++i) {
+    if (bin_idx_by_share[i] != UNDEFINED_ID) {
+      share_indices_by_bin[end_idx_by_bin[bin_idx_by_share[i]]++] = i;
+    }
+  }
+
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int i = 0; i < bins_.size(); ++i) {
+    bins_[i].remove_instance_ids();
+    bins_[i].set_free_area(free_area_by_bin_[i]);
+
+    for (int j = begin_idx_by_bin[i]; j < begin_idx_by_bin[i + 1]; ++j) {
+      const int share_idx = share_indices_by_bin[j];
+
+      bins_[i].add_instance_id(InstanceId(share_idx / num_nearest_bins), false,
+                               area_by_share[share_idx]);
+    }
+  }
+}
+
 void Legalizer::SpreadInstances() {
-  /* #pragma omp parallel for */
+  const double density_target = database_.density_target();
+  const double max_spread_distance = 0.5 * database_.displacement_limit();
+  const Rect& die_rect = database_.die_rect();
+
+  // Explicit diffusion is stable for time steps up to a quarter.
+  const double time_step = 0.2;           // TODO: Tune.
+  const int max_num_iterations = 100;     // TODO: Tune.
+  const double density_tolerance = 0.01;  // TODO: Tune.
+
+  BuildBins();
+
+  const double bin_width = num_bin_rows_ * Site::height();
+  const double bin_area = bin_width * bin_width;
+  const int num_bin_row_groups = bins_.size() / num_bin_columns_;
+
+  vector<double> densities(bins_.size());
+  vector<double> x_velocities(bins_.size());
+  vector<double> y_velocities(bins_.size());
+
+  for (int iteration = 0; iteration < max_num_iterations; ++iteration) {
+    FillBins();
+
+    // Bins with little free area would have huge densities, so their free
+    // area is bounded below.
+
+    double max_density = density_target;
+
+#pragma omp parallel for schedule(static) reduction(max : max_density)
+    for (int i = 0; i < bins_.size(); ++i) {
+      densities[i] =
+          max(bins_[i].instances_area() /
+                  max(bins_[i].free_area(), 0.1 * bin_area),  // TODO: Tune.
+              density_target);
+      max_density = max(max_density, densities[i]);
+    }
+
+    if (max_density <= density_target + density_tolerance) {
+      break;
+    }
+
+    // The velocity at a bin is minus the density gradient over the density,
+    // with no flow across the die edges.
+
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < bins_.size(); ++i) {
+      const int bin_row_group_idx = i / num_bin_columns_;
+      const int bin_column_idx = i % num_bin_columns_;
+      const double left_density = densities[bin_column_idx > 0 ? i - 1 : i];
+      const double right_density =
+          densities[bin_column_idx + 1 < num_bin_columns_ ? i + 1 : i];
+      const double bottom_density =
+          densities[bin_row_group_idx > 0 ? i - num_bin_columns_ : i];
+      const double top_density =
+          densities[bin_row_group_idx + 1 < num_bin_row_groups
+                        ? i + num_bin_columns_
+                        : i];
+
+      x_velocities[i] = -0.5 * (right_density - left_density) / densities[i];
+      y_velocities[i] = -0.5 * (top_density - bottom_density) / densities[i];
+    }
+
+    // Move the instance centres at the velocities interpolated between the
+    // bins near them. Instances in fence regions stay, as the bins do not
+    // tell the regions apart.
+
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < database_.num_instances(); ++i) {
+      const InstanceId instance_id(i);
+      Instance& instance = database_.instance(instance_id);
+
+      if (instance.is_fixed() || instance.has_fence_region()) {
+        continue;
+      }
+
+      array<int, 4> bin_indices;
+      array<double, 4> weights;
+
+      FindNearestBins(instance.position() + Point(0.5 * instance.width(),
+                                                  0.5 * instance.height()),
+                      bin_indices, weights);
+
+      double x_velocity = 0.0;
+      double y_velocity = 0.0;
+      for (int j = 0; j < bin_indices.size(); ++j) {
+        x_velocity += weights[j] * x_velocities[bin_indices[j]];
+        y_velocity += weights[j] * y_velocities[bin_indices[j]];
+      }
+
+      const Point& global_placed_position = instance.global_placed_position();
+      const Point new_position =
+          instance.position() + Point(x_velocity * time_step * bin_width,
+                                      y_velocity * time_step * bin_width);
+
+      instance.set_position(Point(
+          min(max(new_position.x(),
+                  max(die_rect.min_corner().x(),
+                      global_placed_position.x() - max_spread_distance)),
+              min(die_rect.max_corner().x() - instance.width(),
+                  global_placed_position.x() + max_spread_distance)),
+          min(max(new_position.y(),
+                  max(die_rect.min_corner().y(),
+                      global_placed_position.y() - max_spread_distance)),
+              min(die_rect.max_corner().y() - instance.height(),
+                  global_placed_position.y() + max_spread_distance))));
+      database_.UpdateInstanceSubInstancePositions(instance_id);
+    }
+  }
 }
 
 void Legalizer::AlignInstancesToRows() {
-  const double row_height = Site::height();
-  const RowId bottom_row_id(0);
-  const RowId top_row_id(database_.num_rows() - 1);
+  if (candidate_row_ids_by_key_.empty()) {
+    BuildCandidateRows();
+  }
 
   // Align instances from left to right.
 
   SortInstancesByX();
 
+  if (is_row_alignment_parallel_) {
+    AlignInstancesToRowsInParallel();
+
+    return;
+  }
+
+  RowId best_row_id(UNDEFINED_ID);
+  double best_x = 0.0;
+  vector<IntervalId> best_interval_ids;
+
   for (int i = 0; i < database_.num_instances(); ++i) {
     const InstanceId current_instance_id =
         x_and_instance_id_sorted_by_x_[i].second;
-    Instance& current_instance = database_.instance(current_instance_id);
 
-    if (current_instance.is_fixed()) {
+    if (database_.instance(current_instance_id).is_fixed()) {
       continue;
     }
 
-    const int current_instance_row_height =
-        current_instance.num_sub_instances();
-
-    const RowId nearest_row_id(
-        static_cast<int>((current_instance.position().y() + 0.5 * row_height -
-                          database_.die_rect().min_corner().y()) /
-                         row_height));
+    FindInstanceRow(current_instance_id, best_row_id, best_x,
+                    best_interval_ids, nullptr);
+    AssignInstanceRow(current_instance_id, best_row_id, best_x,
+                      best_interval_ids);
+  }
+}
 
-    // Find best row.
+void Legalizer::AlignInstancesToRowsInParallel() {
+  const double die_min_x = database_.die_rect().min_corner().x();
+  const double die_width = database_.die_rect().max_corner().x() - die_min_x;
 
-    RowId best_row_id = nearest_row_id;
-    vector<IntervalId> best_interval_ids;
-    double best_x = current_instance.position().x();
-    double best_cost = numeric_limits<double>::max();
+  int num_movable_instances = 0;
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    if (!database_.instance(InstanceId(i)).is_fixed()) {
+      ++num_movable_instances;
+    }
+  }
 
-    RowId current_row_id = nearest_row_id;
-    for (int j = 0; j < 2 * database_.num_rows(); ++j) {
-      if (j % 2 == 0) {
-        current_row_id += j;
-      } else {
-        current_row_id -= j;
-      }
+  const int num_stripe_instances = 128;  // TODO: Tune.
+  const int num_stripes =
+      max(num_movable_instances / num_stripe_instances, 1);
 
-      if (current_row_id < bottom_row_id ||
-          current_row_id > top_row_id - current_instance_row_height + 1) {
-        continue;
-      }
+  vector<InstanceId> stripe_instance_ids;
+  vector<RowId> best_row_ids;
+  vector<double> best_xs;
+  vector<vector<IntervalId>> best_interval_ids;
+  vector<vector<tuple<IntervalId, double, double>>> overlaps;
 
-      const Row& current_row = database_.row(current_row_id);
-      const double current_row_y = current_row.position().y();
-      const double y_intrinsic_displacement =
-          abs(current_instance.global_placed_position().y() - current_row_y);
+  int i = 0;
+  for (int j = 0; j < num_stripes; ++j) {
+    const double stripe_right_x = die_min_x + die_width * (j + 1) / num_stripes;
 
-      if (y_intrinsic_displacement >= best_cost) {
+    stripe_instance_ids.clear();
+    for (; i < database_.num_instances(); ++i) {
+      if (j + 1 < num_stripes &&
+          x_and_instance_id_sorted_by_x_[i].first >= stripe_right_x) {
         break;
       }
 
-      // Meet P/G rail constraints.
+      const InstanceId instance_id = x_and_instance_id_sorted_by_x_[i].second;
 
-      bool is_pg_rail_correct = true;
+      if (!database_.instance(instance_id).is_fixed()) {
+        stripe_instance_ids.push_back(instance_id);
+      }
+    }
 
-      // Only consider the rails on metal 1.
-      if (current_row.has_rail_on_layer(LayerId(0))) {
-        const RailId rail_id = current_row.rail_id_on_layer(LayerId(0));
-        const Rail& rail = database_.rail(rail_id);
+    const int num_instances = stripe_instance_ids.size();
 
-        // Wrong rail alignments of even-row-height instances can not be
-        // resolved by just flipping vertically.
-        if ((current_instance_row_height % 2 == 0) &&
-            ((current_instance.is_bottom_ground() &&
-              rail.type() == NetType::POWER) ||
-             (!current_instance.is_bottom_ground() &&
-              rail.type() == NetType::GROUND))) {
-          is_pg_rail_correct = false;
-        }
-      }
+    best_row_ids.assign(num_instances, RowId(UNDEFINED_ID));
+    best_xs.assign(num_instances, 0.0);
+    best_interval_ids.resize(num_instances);
+    overlaps.resize(num_instances);
 
-      if (!is_pg_rail_correct) {
-        continue;
-      }
+    // Evaluate the stripe against the intervals as left by the previous
+    // stripes, recording every overlap read.
 
-      // Meet fence region constraints.
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int k = 0; k < num_instances; ++k) {
+      overlaps[k].clear();
+      FindInstanceRow(stripe_instance_ids[k], best_row_ids[k], best_xs[k],
+                      best_interval_ids[k], &overlaps[k]);
+    }
 
-      bool has_interval_of_current_instance_fence_region = true;
+    // Commit in x order. An evaluation all of whose overlap reads still
+    // hold is what the serial pass would compute, otherwise redo it.
 
-      for (int k = 0; k < current_instance_row_height; ++k) {
-        const RowId row_id(current_row_id + k);
-        const Row& row = database_.row(row_id);
+    for (int k = 0; k < num_instances; ++k) {
+      const InstanceId instance_id = stripe_instance_ids[k];
+      const Instance& instance = database_.instance(instance_id);
 
-        if (!row.has_interval_of_fence_region(
-                current_instance.fence_region_id())) {
-          has_interval_of_current_instance_fence_region = false;
-        }
+      bool is_evaluation_valid = true;
+      for (const auto& overlap : overlaps[k]) {
+        const Interval& interval = database_.interval(get<0>(overlap));
 
-        if (!has_interval_of_current_instance_fence_region) {
+        if (interval.ComputeAccumulatedOverlap(get<1>(overlap),
+                                               instance.width()) !=
+            get<2>(overlap)) {
+          is_evaluation_valid = false;
           break;
         }
       }
 
-      if (!has_interval_of_current_instance_fence_region) {
+      if (!is_evaluation_valid) {
+        FindInstanceRow(instance_id, best_row_ids[k], best_xs[k],
+                        best_interval_ids[k], nullptr);
+      }
+
+      AssignInstanceRow(instance_id, best_row_ids[k], best_xs[k],
+                        best_interval_ids[k]);
+    }
+  }
+}
+
+void Legalizer::FindInstanceRow(
+    InstanceId instance_id, RowId& best_row_id, double& best_x,
+    vector<IntervalId>& best_interval_ids,
+    vector<tuple<IntervalId, double, double>>* overlaps) const {
+  const double row_height = Site::height();
+  const Instance& current_instance = database_.instance(instance_id);
+
+  const int current_instance_row_height = current_instance.num_sub_instances();
+
+  const RowId nearest_row_id(
+      static_cast<int>((current_instance.position().y() + 0.5 * row_height -
+                        database_.die_rect().min_corner().y()) /
+                       row_height));
+
+  // Find best row.
+
+  best_row_id = nearest_row_id;
+  best_interval_ids.clear();
+  best_x = current_instance.position().x();
+  double best_cost = numeric_limits<double>::max();
+
+  // Visit the rows meeting the P/G rail and fence region constraints in the
+  // order of a spiral over all rows from the nearest one, which visits
+  // offset -k at position 2k - 1 and +k at 2k. The spiral stops at the
+  // first row within the die at least best_cost away vertically, so the
+  // rows skipped between two candidates are checked too. Distances are
+  // convex in the row, so the ends of each skipped range suffice.
+
+  const int max_bottom_row_idx =
+      database_.num_rows() - current_instance_row_height;
+  // The position is the global placed one unless the placement was spread.
+  const double target_y = current_instance.position().y();
+
+  auto is_spiral_stopped = [&](int begin_position, int end_position,
+                               double best_cost) {
+    const int range_row_idxs[2][2] = {
+        {nearest_row_id - (end_position / 2),
+         nearest_row_id - (begin_position + 2) / 2},
+        {nearest_row_id + (begin_position + 1) / 2,
+         nearest_row_id + (end_position + 1) / 2 - 1}};
+
+    for (int k = 0; k < 2; ++k) {
+      const int begin_row_idx = max(range_row_idxs[k][0], 0);
+      const int end_row_idx = min(range_row_idxs[k][1], max_bottom_row_idx);
+
+      if (begin_row_idx > end_row_idx) {
         continue;
       }
 
-      // Compute cost.
+      const Row& begin_row = database_.row(RowId(begin_row_idx));
+      const Row& end_row = database_.row(RowId(end_row_idx));
 
-      const double overlap_weight = 3.0;
+      if (abs(target_y - begin_row.position().y()) >= best_cost ||
+          abs(target_y - end_row.position().y()) >= best_cost) {
+        return true;
+      }
+    }
 
-      vector<IntervalId> interval_ids;
+    return false;
+  };
+
+  const vector<RowId>& candidate_row_ids =
+      FindCandidateRowIds(current_instance);
+  int upper_idx =
+      lower_bound(candidate_row_ids.begin(), candidate_row_ids.end(),
+                  nearest_row_id) -
+      candidate_row_ids.begin();
+  int lower_idx = upper_idx - 1;
+  int position = -1;
+
+  while (lower_idx >= 0 || upper_idx < candidate_row_ids.size()) {
+    const bool is_lower =
+        lower_idx >= 0 &&
+        (upper_idx == candidate_row_ids.size() ||
+         nearest_row_id - candidate_row_ids[lower_idx] <=
+             candidate_row_ids[upper_idx] - nearest_row_id);
+    const RowId current_row_id = is_lower ? candidate_row_ids[lower_idx--]
+                                          : candidate_row_ids[upper_idx++];
+    const int current_position =
+        is_lower ? 2 * (nearest_row_id - current_row_id) - 1
+                 : 2 * (current_row_id - nearest_row_id);
+
+    if (is_spiral_stopped(position + 1, current_position, best_cost)) {
+      break;
+    }
 
-      bool can_be_placed_directly = true;
-      for (int k = 0; k < current_instance_row_height; ++k) {
-        const RowId row_id(current_row_id + k);
-        const Row& row = database_.row(row_id);
+    position = current_position;
 
-        if (row.has_interval_of_fence_region_before(
-                current_instance.fence_region_id(),
-                current_instance.position().x() + current_instance.width())) {
-          const IntervalId interval_id = row.interval_id_of_fence_region_before(
-              current_instance.fence_region_id(),
-              current_instance.position().x() + current_instance.width());
-          const Interval& interval = database_.interval(interval_id);
+    const Row& current_row = database_.row(current_row_id);
+    const double current_row_y = current_row.position().y();
+    const double y_intrinsic_displacement = abs(target_y - current_row_y);
 
-          interval_ids.push_back(interval_id);
+    if (y_intrinsic_displacement >= best_cost) {
+      break;
+    }
 
-          if (interval.end() - interval.begin() < current_instance.width()) {
-            can_be_placed_directly = false;
-          }
+    // Compute cost.
 
-          if (interval.end() <= current_instance.position().x()) {
-            can_be_placed_directly = false;
-          }
-        } else {
+    const double overlap_weight = 3.0;
+
+    vector<IntervalId> interval_ids;
+
+    bool can_be_placed_directly = true;
+    for (int k = 0; k < current_instance_row_height; ++k) {
+      const RowId row_id(current_row_id + k);
+      const Row& row = database_.row(row_id);
+
+      if (row.has_interval_of_fence_region_before(
+              current_instance.fence_region_id(),
+              current_instance.position().x() + current_instance.width())) {
+        const IntervalId interval_id = row.interval_id_of_fence_region_before(
+            current_instance.fence_region_id(),
+            current_instance.position().x() + current_instance.width());
+        const Interval& interval = database_.interval(interval_id);
+
+        interval_ids.push_back(interval_id);
+
+        if (interval.end() - interval.begin() < current_instance.width()) {
           can_be_placed_directly = false;
         }
 
-        if (!can_be_placed_directly) {
-          break;
+        if (interval.end() <= current_instance.position().x()) {
+          can_be_placed_directly = false;
         }
+      } else {
+        can_be_placed_directly = false;
       }
 
-      if (can_be_placed_directly) {
-        double min_interval_end = numeric_limits<double>::max();
-        for (IntervalId id : interval_ids) {
-          const Interval& interval = database_.interval(id);
+      if (!can_be_placed_directly) {
+        break;
+      }
+    }
 
-          if (interval.end() < min_interval_end) {
-            min_interval_end = interval.end();
-          }
+    if (can_be_placed_directly) {
+      double min_interval_end = numeric_limits<double>::max();
+      for (IntervalId id : interval_ids) {
+        const Interval& interval = database_.interval(id);
+
+        if (interval.end() < min_interval_end) {
+          min_interval_end = interval.end();
         }
+      }
 
-        double max_interval_begin = 0.0;
-        for (IntervalId id : interval_ids) {
-          const Interval& interval = database_.interval(id);
+      double max_interval_begin = 0.0;
+      for (IntervalId id : interval_ids) {
+        const Interval& interval = database_.interval(id);
 
-          if (interval.begin() > max_interval_begin) {
-            max_interval_begin = interval.begin();
-          }
+        if (interval.begin() > max_interval_begin) {
+          max_interval_begin = interval.begin();
         }
+      }
 
-        double current_instance_new_x = current_instance.position().x();
-        if (current_instance_new_x + current_instance.width() >
-            min_interval_end) {
-          current_instance_new_x = min_interval_end - current_instance.width();
-        } else if (current_instance_new_x < max_interval_begin) {
-          current_instance_new_x = max_interval_begin;
-        }
-        const double x_intrinsic_displacement =
-            abs(current_instance_new_x - current_instance.position().x());
+      double current_instance_new_x = current_instance.position().x();
+      if (current_instance_new_x + current_instance.width() >
+          min_interval_end) {
+        current_instance_new_x = min_interval_end - current_instance.width();
+      } else if (current_instance_new_x < max_interval_begin) {
+        current_instance_new_x = max_interval_begin;
+      }
+      const double x_intrinsic_displacement =
+          abs(current_instance_new_x - current_instance.position().x());
+
+      double overlap = 0.0;
+      for (IntervalId id : interval_ids) {
+        const Interval& interval = database_.interval(id);
 
-        double overlap = 0.0;
-        for (IntervalId id : interval_ids) {
-          const Interval& interval = database_.interval(id);
+        const double interval_overlap = interval.ComputeAccumulatedOverlap(
+            current_instance_new_x, current_instance.width());
 
-          overlap += interval.ComputeAccumulatedOverlap(
-              current_instance_new_x, current_instance.width());
+        overlap += interval_overlap;
+        if (overlaps != nullptr) {
+          overlaps->push_back(
+              make_tuple(id, current_instance_new_x, interval_overlap));
         }
+      }
 
-        const double cost = y_intrinsic_displacement +
-                            x_intrinsic_displacement + overlap_weight * overlap;
+      const double cost = y_intrinsic_displacement +
+                          x_intrinsic_displacement + overlap_weight * overlap;
 
-        if (cost < best_cost) {
-          best_cost = cost;
-          best_x = current_instance_new_x;
-          best_row_id = current_row_id;
-          best_interval_ids = interval_ids;
-        }
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_x = current_instance_new_x;
+        best_row_id = current_row_id;
+        best_interval_ids = interval_ids;
       }
+    }
 
-      interval_ids.clear();
+    interval_ids.clear();
 
-      bool can_be_placed_on_previous_interval = true;
-      for (int k = 0; k < current_instance_row_height; ++k) {
-        const RowId row_id(current_row_id + k);
-        const Row& row = database_.row(row_id);
+    bool can_be_placed_on_previous_interval = true;
+    for (int k = 0; k < current_instance_row_height; ++k) {
+      const RowId row_id(current_row_id + k);
+      const Row& row = database_.row(row_id);
 
-        if (row.has_interval_of_fence_region_before(
-                current_instance.fence_region_id(),
-                current_instance.position().x())) {
-          const IntervalId interval_id = row.interval_id_of_fence_region_before(
+      if (row.has_interval_of_fence_region_before(
               current_instance.fence_region_id(),
-              current_instance.position().x());
-          const Interval& interval = database_.interval(interval_id);
-
-          interval_ids.push_back(interval_id);
+              current_instance.position().x())) {
+        const IntervalId interval_id = row.interval_id_of_fence_region_before(
+            current_instance.fence_region_id(),
+            current_instance.position().x());
+        const Interval& interval = database_.interval(interval_id);
 
-          if (interval.end() - interval.begin() < current_instance.width()) {
-            can_be_placed_on_previous_interval = false;
-          }
+        interval_ids.push_back(interval_id);
 
-          if (interval.end() > current_instance.position().x()) {
-            can_be_placed_on_previous_interval = false;
-          }
-        } else {
+        if (interval.end() - interval.begin() < current_instance.width()) {
           can_be_placed_on_previous_interval = false;
         }
 
-        if (!can_be_placed_on_previous_interval) {
-          break;
+        if (interval.end() > current_instance.position().x()) {
+          can_be_placed_on_previous_interval = false;
         }
+      } else {
+        can_be_placed_on_previous_interval = false;
+      }
+
+      if (!can_be_placed_on_previous_interval) {
+        break;
       }
+    }
 
-      if (can_be_placed_on_previous_interval) {
-        double min_interval_end = numeric_limits<double>::max();
-        for (IntervalId id : interval_ids) {
-          const Interval& interval = database_.interval(id);
+    if (can_be_placed_on_previous_interval) {
+      double min_interval_end = numeric_limits<double>::max();
+      for (IntervalId id : interval_ids) {
+        const Interval& interval = database_.interval(id);
 
-          if (interval.end() < min_interval_end) {
-            min_interval_end = interval.end();
-          }
+        if (interval.end() < min_interval_end) {
+          min_interval_end = interval.end();
         }
+      }
+
+      const double current_instance_new_x =
+          min_interval_end - current_instance.width();
+      const double x_intrinsic_displacement =
+          abs(current_instance_new_x - current_instance.position().x());
 
-        const double current_instance_new_x =
-            min_interval_end - current_instance.width();
-        const double x_intrinsic_displacement =
-            abs(current_instance_new_x - current_instance.position().x());
+      double overlap = 0.0;
+      for (IntervalId id : interval_ids) {
+        const Interval& interval = database_.interval(id);
 
-        double overlap = 0.0;
-        for (IntervalId id : interval_ids) {
-          const Interval& interval = database_.interval(id);
+        const double interval_overlap = interval.ComputeAccumulatedOverlap(
+            current_instance_new_x, current_instance.width());
 
-          overlap += interval.ComputeAccumulatedOverlap(
-              current_instance_new_x, current_instance.width());
+        overlap += interval_overlap;
+        if (overlaps != nullptr) {
+          overlaps->push_back(
+              make_tuple(id, current_instance_new_x, interval_overlap));
         }
+      }
 
-        const double cost = y_intrinsic_displacement +
-                            x_intrinsic_displacement + overlap_weight * overlap;
+      const double cost = y_intrinsic_displacement +
+                          x_intrinsic_displacement + overlap_weight * overlap;
 
-        if (cost < best_cost) {
-          best_cost = cost;
-          best_x = current_instance_new_x;
-          best_row_id = current_row_id;
-          best_interval_ids = interval_ids;
-        }
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_x = current_instance_new_x;
+        best_row_id = current_row_id;
+        best_interval_ids = interval_ids;
       }
+    }
 
-      interval_ids.clear();
+    interval_ids.clear();
 
-      bool can_be_placed_on_next_interval = true;
-      for (int k = 0; k < current_instance_row_height; ++k) {
-        const RowId row_id(current_row_id + k);
-        const Row& row = database_.row(row_id);
+    bool can_be_placed_on_next_interval = true;
+    for (int k = 0; k < current_instance_row_height; ++k) {
+      const RowId row_id(current_row_id + k);
+      const Row& row = database_.row(row_id);
 
-        if (row.has_interval_of_fence_region_after(
-                current_instance.fence_region_id(),
-                current_instance.position().x() + current_instance.width())) {
-          const IntervalId interval_id = row.interval_id_of_fence_region_after(
+      if (row.has_interval_of_fence_region_after(
               current_instance.fence_region_id(),
-              current_instance.position().x() + current_instance.width());
-          const Interval& interval = database_.interval(interval_id);
+              current_instance.position().x() + current_instance.width())) {
+        const IntervalId interval_id = row.interval_id_of_fence_region_after(
+            current_instance.fence_region_id(),
+            current_instance.position().x() + current_instance.width());
+        const Interval& interval = database_.interval(interval_id);
 
-          interval_ids.push_back(interval_id);
+        interval_ids.push_back(interval_id);
 
-          if (interval.end() - interval.begin() < current_instance.width()) {
-            can_be_placed_on_next_interval = false;
-          }
-        } else {
+        if (interval.end() - interval.begin() < current_instance.width()) {
           can_be_placed_on_next_interval = false;
         }
+      } else {
+        can_be_placed_on_next_interval = false;
+      }
 
-        if (!can_be_placed_on_next_interval) {
-          break;
-        }
+      if (!can_be_placed_on_next_interval) {
+        break;
       }
+    }
 
-      if (can_be_placed_on_next_interval) {
-        double max_interval_begin = 0.0;
-        for (IntervalId id : interval_ids) {
-          const Interval& interval = database_.interval(id);
+    if (can_be_placed_on_next_interval) {
+      double max_interval_begin = 0.0;
+      for (IntervalId id : interval_ids) {
+        const Interval& interval = database_.interval(id);
 
-          if (interval.begin() > max_interval_begin) {
-            max_interval_begin = interval.begin();
-          }
+        if (interval.begin() > max_interval_begin) {
+          max_interval_begin = interval.begin();
         }
+      }
 
-        const double current_instance_new_x = max_interval_begin;
-        const double x_intrinsic_displacement =
-            abs(current_instance_new_x - current_instance.position().x());
+      const double current_instance_new_x = max_interval_begin;
+      const double x_intrinsic_displacement =
+          abs(current_instance_new_x - current_instance.position().x());
 
-        double overlap = 0.0;
-        for (IntervalId id : interval_ids) {
-          const Interval& interval = database_.interval(id);
+      double overlap = 0.0;
+      for (IntervalId id : interval_ids) {
+        const Interval& interval = database_.interval(id);
 
-          overlap += interval.ComputeAccumulatedOverlap(
-              current_instance_new_x, current_instance.width());
+        const double interval_overlap = interval.ComputeAccumulatedOverlap(
+            current_instance_new_x, current_instance.width());
+
+        overlap += interval_overlap;
+        if (overlaps != nullptr) {
+          overlaps->push_back(
+              make_tuple(id, current_instance_new_x, interval_overlap));
         }
+      }
 
-        const double cost = y_intrinsic_displacement +
-                            x_intrinsic_displacement + overlap_weight * overlap;
+      const double cost = y_intrinsic_displacement +
+                          x_intrinsic_displacement + overlap_weight * overlap;
 
-        if (cost < best_cost) {
-          best_cost = cost;
-          best_x = current_instance_new_x;
-          best_row_id = current_row_id;
-          best_interval_ids = interval_ids;
-        }
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_x = current_instance_new_x;
+        best_row_id = current_row_id;
+        best_interval_ids = interval_ids;
       }
     }
+  }
+}
 
-    // Save best result.
+void Legalizer::AssignInstanceRow(InstanceId instance_id, RowId best_row_id,
+                                  double best_x,
+                                  const vector<IntervalId>& best_interval_ids) {
+  const double row_height = Site::height();
+  Instance& current_instance = database_.instance(instance_id);
 
-    const Row& best_row = database_.row(best_row_id);
+  const Row& best_row = database_.row(best_row_id);
 
-    if (current_instance.orientation() != best_row.orientation()) {
-      current_instance.FlipVertically();
-    }
+  if (current_instance.orientation() != best_row.orientation()) {
+    current_instance.FlipVertically();
+  }
 
-    current_instance.set_position(Point(best_x, best_row.position().y()));
+  current_instance.set_position(Point(best_x, best_row.position().y()));
 
-    for (int j = 0; j < current_instance.num_sub_instances(); ++j) {
-      const SubInstanceId sub_instance_id = current_instance.sub_instance_id(j);
-      const IntervalId interval_id = best_interval_ids.at(j);
-      SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
-      Interval& interval = database_.interval(interval_id);
+  for (int j = 0; j < current_instance.num_sub_instances(); ++j) {
+    const SubInstanceId sub_instance_id = current_instance.sub_instance_id(j);
+    const IntervalId interval_id = best_interval_ids.at(j);
+    SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
+    Interval& interval = database_.interval(interval_id);
 
-      sub_instance.set_position(
-          Point(best_x, best_row.position().y() + j * row_height));
+    sub_instance.set_position(
+        Point(best_x, best_row.position().y() + j * row_height));
 
-      sub_instance.set_interval_id(interval_id);
-      interval.add_sub_instance_id(sub_instance_id, best_x,
-                                   sub_instance.width());
-    }
+    sub_instance.set_interval_id(interval_id);
+    interval.add_sub_instance_id(sub_instance_id, best_x,
+                                 sub_instance.width());
   }
 }
 
@@ -864,11 +1762,13 @@ void Legalizer::AlignInstancesToSites() {
   const double die_right_x = database_.die_rect().max_corner().x();
   const double site_width = Site::width();
   const double row_height = Site::height();
-  const int num_sites_limit = static_cast<int>(
-      database_.num_rows() / 1 * row_height / site_width);  // TODO: Tune.
 
   SortInstancesByRowHeightByX();
 
+  if (is_window_legalized_) {
+    LegalizeWindows();
+  }
+
   for (int h = x_and_instance_id_sorted_by_x_by_row_height_.size() - 1; h >= 0;
        --h) {
     const auto& x_and_instance_id_sorted_by_x =
@@ -879,7 +1779,9 @@ void Legalizer::AlignInstancesToSites() {
           x_and_instance_id_sorted_by_x[i].second;
       Instance& current_instance = database_.instance(current_instance_id);
 
-      if (current_instance.is_fixed()) {
+      if (current_instance.is_fixed() ||
+          (is_window_legalized_ &&
+           is_placed_in_window_by_instance_id_[current_instance_id])) {
         continue;
       }
 
@@ -892,60 +1794,41 @@ void Legalizer::AlignInstancesToSites() {
       const double nearest_site_x = database_.die_rect().min_corner().x() +
                                     nearest_site_idx_x * site_width;
 
-      bool is_trial_successful = false;
-      double best_x = die_right_x;
-      for (int j = 0; j < num_sites_limit; ++j) {
-        const double site_x = nearest_site_x + j * site_width;
-
-        if (site_x + current_instance.width() > die_right_x) {
-          break;
-        }
-
-        bool are_sites_available = true;
-        bool is_overlap = false;
-        for (int k = 0; k < current_instance.num_sub_instances(); ++k) {
-          const SubInstanceId sub_instance_id =
-              current_instance.sub_instance_id(k);
-          const SubInstance& sub_instance =
-              database_.sub_instance(sub_instance_id);
-
-          for (int l = 0; l < current_instance_site_width; ++l) {
-            const SiteId site_id = database_.site_id_by_position(
-                Point(site_x + l * site_width, sub_instance.position().y()));
-            const Site& site = database_.site(site_id);
+      const int row_idx = static_cast<int>(
+          (current_instance.position().y() -
+           database_.die_rect().min_corner().y()) /
+          row_height);
 
-            if (!site.is_valid() || site.has_sub_instance() ||
-                site.fence_region_id() != current_instance.fence_region_id()) {
-              are_sites_available = false;
+      // Stay within a few sites of the global placed x, and within the
+      // maximum movement given the displacement in y. Free sites beyond can
+      // not be taken, so the search stops there.
 
-              if (site.has_sub_instance()) {
-                is_overlap = true;
-              }
+      const double global_placed_x =
+          current_instance.global_placed_position().x();
+      const double displacement_limit =
+          min(10 * site_width,  // TODO: Tune.
+              database_.displacement_limit() -
+                  abs(current_instance.position().y() -
+                      current_instance.global_placed_position().y()));
 
-              break;
-            }
-          }
+      bool is_trial_successful = false;
+      double best_x = die_right_x;
 
-          if (!are_sites_available) {
-            break;
-          }
-        }
+      const int site_idx_x = site_occupancy_map_.FindFreeSitesAfter(
+          current_instance.fence_region_id(), row_idx,
+          current_instance.num_sub_instances(), current_instance_site_width,
+          nearest_site_idx_x,
+          static_cast<int>((global_placed_x + displacement_limit -
+                            database_.die_rect().min_corner().x()) /
+                           site_width));
 
-        if (are_sites_available) {
-          const double displacement_limit = 10 * site_width;  // TODO: Tune.
-          const double displacement =
-              abs(site_x - current_instance.global_placed_position().x());
-
-          if (displacement < displacement_limit) {
-            best_x = site_x;
-            /* } else { */
-            /*   if (TryPlaceInstance(current_instance_id, site_x, */
-            /*                        displacement / 2)) { */
-            /*     is_trial_successful = true; */
-            /*   } */
-          }
+      if (site_idx_x != UNDEFINED_ID) {
+        const double site_x =
+            database_.die_rect().min_corner().x() + site_idx_x * site_width;
+        const double displacement = abs(site_x - global_placed_x);
 
-          break;
+        if (displacement < displacement_limit) {
+          best_x = site_x;
         }
       }
 
@@ -955,7 +1838,7 @@ void Legalizer::AlignInstancesToSites() {
 
       if (best_x == die_right_x) {
         if (TryPlaceInstance(current_instance_id, nearest_site_x,
-                             10 * site_width)) {
+                             displacement_limit)) {
           is_trial_successful = true;
         }
       }
@@ -1093,186 +1976,859 @@ void Legalizer::AllocateIllegalInstances() {
                              site_width);
       }
 
-      double displacement;
-      double displacement_x;
-      double displacement_y;
-      double best_displacement = numeric_limits<double>::max();
-      int best_site_x = 0;
-      int best_site_y = 0;
+      double displacement;
+      double displacement_x;
+      double displacement_y;
+      double best_displacement = numeric_limits<double>::max();
+      int best_site_x = 0;
+      int best_site_y = 0;
+
+      // Visit the candidate rows as in AlignInstancesToRows, within the
+      // maximum movement first, and everywhere only if no site is free there.
+
+      const vector<RowId>& candidate_row_ids =
+          FindCandidateRowIds(current_instance);
+
+      for (const double displacement_limit :
+           {database_.displacement_limit(), numeric_limits<double>::max()}) {
+        if (best_displacement < numeric_limits<double>::max()) {
+          break;
+        }
+
+        int upper_idx =
+            lower_bound(candidate_row_ids.begin(), candidate_row_ids.end(),
+                        nearest_row_id) -
+            candidate_row_ids.begin();
+        int lower_idx = upper_idx - 1;
+
+        bool out_of_loop = false;
+        while (lower_idx >= 0 || upper_idx < candidate_row_ids.size()) {
+          if (out_of_loop) {
+            break;
+          }
+
+          const bool is_lower =
+              lower_idx >= 0 &&
+              (upper_idx == candidate_row_ids.size() ||
+               nearest_row_id - candidate_row_ids[lower_idx] <=
+                   candidate_row_ids[upper_idx] - nearest_row_id);
+          const RowId current_row_id =
+              is_lower ? candidate_row_ids[lower_idx--]
+                       : candidate_row_ids[upper_idx++];
+
+          const Row& current_row = database_.row(current_row_id);
+          const double site_y = current_row.position().y();
+
+          displacement_y = fabs(site_y - current_instance_y);
+          if (displacement_y >= best_displacement ||
+              displacement_y > displacement_limit) {
+            if (is_lower && site_y <= current_instance_y) {
+              lower_idx = -1;
+            } else if (!is_lower && site_y >= current_instance_y) {
+              upper_idx = candidate_row_ids.size();
+            }
+
+            continue;
+          }
+
+          // Visit the free sites outwards from nearest_row_site, the left one
+          // first on a tie, until one improves the best displacement. A side
+          // is dropped once it moves away from the instance without improving.
+          // Sites further than the maximum movement are never visited.
+
+          const double displacement_x_limit =
+              displacement_limit - displacement_y;
+          const bool is_site_bounded =
+              displacement_x_limit < num_row_sites * site_width;
+          const int begin_row_site =
+              is_site_bounded
+                  ? max(left_site,
+                        static_cast<int>(ceil(
+                            (current_instance_x - displacement_x_limit) /
+                            site_width)))
+                  : left_site;
+          const int end_row_site =
+              is_site_bounded
+                  ? min(right_site,
+                        static_cast<int>(floor(
+                            (current_instance_x + displacement_x_limit) /
+                            site_width)))
+                  : right_site;
+
+          int right_row_site = site_occupancy_map_.FindFreeSitesAfter(
+              fenge_region_id, current_row_id, current_instance_row_height,
+              current_instance_site_width,
+              max(nearest_row_site, begin_row_site), end_row_site);
+          int left_row_site = site_occupancy_map_.FindFreeSitesBefore(
+              fenge_region_id, current_row_id, current_instance_row_height,
+              current_instance_site_width, begin_row_site,
+              min(nearest_row_site - 1, end_row_site));
+
+          while (right_row_site != UNDEFINED_ID ||
+                 left_row_site != UNDEFINED_ID) {
+            const bool is_left =
+                left_row_site != UNDEFINED_ID &&
+                (right_row_site == UNDEFINED_ID ||
+                 nearest_row_site - left_row_site <=
+                     right_row_site - nearest_row_site);
+            const int current_row_site =
+                is_left ? left_row_site : right_row_site;
+
+            // decide position
+            const double site_x = current_row_site * site_width;
+
+            displacement_x = fabs(site_x - current_instance_x);
+            displacement = displacement_x + displacement_y;
+            if (displacement < best_displacement) {
+              best_displacement = displacement;
+              best_site_x = site_x;
+              best_site_y = site_y;
+              if (displacement_x < row_height) {
+                out_of_loop = true;
+              }
+              break;
+            }
+
+            if (is_left) {
+              left_row_site =
+                  (site_x <= current_instance_x)
+                      ? UNDEFINED_ID
+                      : site_occupancy_map_.FindFreeSitesBefore(
+                            fenge_region_id, current_row_id,
+                            current_instance_row_height,
+                            current_instance_site_width, begin_row_site,
+                            current_row_site - 1);
+            } else {
+              right_row_site =
+                  (site_x >= current_instance_x)
+                      ? UNDEFINED_ID
+                      : site_occupancy_map_.FindFreeSitesAfter(
+                            fenge_region_id, current_row_id,
+                            current_instance_row_height,
+                            current_instance_site_width, current_row_site + 1,
+                            end_row_site);
+            }
+          }
+        }
+      }
+
+      current_instance.set_position(Point(best_site_x, best_site_y));
+
+      const RowId best_row_id(
+          (best_site_y - database_.die_rect().min_corner().y()) / row_height);
+
+      assert(best_row_id >= bottom_row_id &&
+             best_row_id <= top_row_id - current_instance_row_height + 1);
+
+      const Row& best_row = database_.row(best_row_id);
+
+      if (current_instance.orientation() != best_row.orientation()) {
+        current_instance.FlipVertically();
+      }
+
+      for (int j = 0; j < current_instance.num_sub_instances(); ++j) {
+        const SubInstanceId sub_instance_id =
+            current_instance.sub_instance_id(j);
+        SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
+        sub_instance.set_position(
+            Point(current_instance.position().x(),
+                  current_instance.position().y() + j * row_height));
+
+        if (sub_instance.position().x() <
+            database_.die_rect().max_corner().x()) {
+          for (int k = 0; k < current_instance_site_width; ++k) {
+            const SiteId site_id = database_.site_id_by_position(
+                Point(current_instance.position().x() + k * site_width,
+                      current_instance.position().y() + j * row_height));
+            Site& site = database_.site(site_id);
+            site.set_sub_instance_id(sub_instance_id);
+          }
+
+          site_occupancy_map_.set_is_occupied(
+              best_row_id + j,
+              static_cast<int>((current_instance.position().x() -
+                                database_.die_rect().min_corner().x()) /
+                               site_width),
+              current_instance_site_width, true);
+        }
+      }
+    }
+  }
+}
+
+void Legalizer::ResolveEdgeSpacingConstraint() {
+  const double row_height = Site::height();
+  const double die_min_y = database_.die_rect().min_corner().y();
+  const int num_rows = database_.num_rows();
+
+  // Bucket the placed instances into the rows they cover. Fixed instances
+  // only take part as neighbours.
+
+  instance_ids_sorted_by_x_by_row_.assign(num_rows, vector<InstanceId>());
+  sorted_idx_by_sub_instance_id_.assign(database_.num_sub_instances(),
+                                        UNDEFINED_ID);
+
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    const InstanceId instance_id(i);
+    const Instance& instance = database_.instance(instance_id);
+    const double y = instance.position().y() - die_min_y;
+
+    if (!instance.is_fixed() && !IsInstancePlaced(instance_id)) {
+      continue;
+    }
+
+    const int bottom_row_idx = max(static_cast<int>(y / row_height), 0);
+    const int top_row_idx = min(
+        static_cast<int>(ceil((y + instance.height()) / row_height)), num_rows);
+
+    for (int j = bottom_row_idx; j < top_row_idx; ++j) {
+      instance_ids_sorted_by_x_by_row_[j].push_back(instance_id);
+    }
+  }
+
+  // Rows only move their own single-row-height instances, so they are swept
+  // concurrently. Pairs left unresolved are collected from the lowest row
+  // they share.
+
+  vector<pair<InstanceId, InstanceId>> unresolved_instance_id_pairs;
+
+#pragma omp parallel
+  {
+    vector<pair<InstanceId, InstanceId>> thread_unresolved_instance_id_pairs;
+
+#pragma omp for schedule(dynamic, 16)
+    for (int i = 0; i < num_rows; ++i) {
+      vector<InstanceId>& instance_ids = instance_ids_sorted_by_x_by_row_[i];
+
+      sort(instance_ids.begin(), instance_ids.end(),
+           [&](InstanceId instance_id_a, InstanceId instance_id_b) {
+             const Instance& instance_a = database_.instance(instance_id_a);
+             const Instance& instance_b = database_.instance(instance_id_b);
+
+             return make_pair(instance_a.position().x(), instance_id_a) <
+                    make_pair(instance_b.position().x(), instance_id_b);
+           });
+
+      for (int j = 0; j < instance_ids.size(); ++j) {
+        const Instance& instance = database_.instance(instance_ids[j]);
+
+        if (!instance.is_fixed()) {
+          const int bottom_row_idx = static_cast<int>(
+              (instance.position().y() - die_min_y) / row_height);
+
+          sorted_idx_by_sub_instance_id_[instance.sub_instance_id(
+              i - bottom_row_idx)] = j;
+        }
+      }
+    }
+
+#pragma omp for schedule(dynamic, 16)
+    for (int i = 0; i < num_rows; ++i) {
+      const vector<InstanceId>& instance_ids =
+          instance_ids_sorted_by_x_by_row_[i];
+
+      for (int j = 0; j + 1 < instance_ids.size(); ++j) {
+        const Instance& left_instance = database_.instance(instance_ids[j]);
+        const Instance& right_instance =
+            database_.instance(instance_ids[j + 1]);
+
+        if ((left_instance.is_fixed() && right_instance.is_fixed()) ||
+            right_instance.position().x() <
+                left_instance.position().x() + left_instance.width() ||
+            ComputeEdgeSpacingSurplus(instance_ids[j], instance_ids[j + 1]) >=
+                0) {
+          continue;
+        }
+
+        if (!ResolveEdgeSpacing(instance_ids[j], instance_ids[j + 1], false) &&
+            i == max(static_cast<int>((left_instance.position().y() -
+                                       die_min_y) /
+                                      row_height),
+                     static_cast<int>((right_instance.position().y() -
+                                       die_min_y) /
+                                      row_height))) {
+          thread_unresolved_instance_id_pairs.push_back(
+              make_pair(instance_ids[j], instance_ids[j + 1]));
+        }
+      }
+    }
+
+#pragma omp critical
+    unresolved_instance_id_pairs.insert(
+        unresolved_instance_id_pairs.end(),
+        thread_unresolved_instance_id_pairs.begin(),
+        thread_unresolved_instance_id_pairs.end());
+  }
+
+  // Fix up serially, now also moving multi-row-height instances. Sorting
+  // keeps the result independent of the number of threads.
+
+  sort(unresolved_instance_id_pairs.begin(),
+       unresolved_instance_id_pairs.end());
+
+  for (int i = 0; i < unresolved_instance_id_pairs.size(); ++i) {
+    const InstanceId left_instance_id = unresolved_instance_id_pairs[i].first;
+    const InstanceId right_instance_id =
+        unresolved_instance_id_pairs[i].second;
+
+    if (ComputeEdgeSpacingSurplus(left_instance_id, right_instance_id) < 0) {
+      ResolveEdgeSpacing(left_instance_id, right_instance_id, true);
+    }
+  }
+}
+
+bool Legalizer::IsInstancePlaced(InstanceId instance_id) const {
+  const Instance& instance = database_.instance(instance_id);
+  const SubInstanceId sub_instance_id = instance.sub_instance_id(0);
+  const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
+
+  if (sub_instance.position().x() < database_.die_rect().min_corner().x() ||
+      sub_instance.position().x() >= database_.die_rect().max_corner().x() ||
+      sub_instance.position().y() < database_.die_rect().min_corner().y() ||
+      sub_instance.position().y() >= database_.die_rect().max_corner().y()) {
+    return false;
+  }
+
+  const Site& site =
+      database_.site(database_.site_id_by_position(sub_instance.position()));
+
+  return site.has_sub_instance() && site.sub_instance_id() == sub_instance_id;
+}
+
+int Legalizer::ComputeEdgeSpacingSurplus(InstanceId left_instance_id,
+                                         InstanceId right_instance_id) const {
+  const double site_width = Site::width();
+
+  const Instance& left_instance = database_.instance(left_instance_id);
+  const Instance& right_instance = database_.instance(right_instance_id);
+  const double edge_spacing = database_.edge_type_spacing(
+      left_instance.right_edge_type(), right_instance.left_edge_type());
+  const double distance =
+      right_instance.position().x() -
+      (left_instance.position().x() + left_instance.width());
+
+  return static_cast<int>(floor(distance / site_width + 0.5)) -
+         static_cast<int>(ceil(edge_spacing / site_width - 1e-6));
+}
+
+bool Legalizer::FindEdgeSpacingPushes(
+    InstanceId instance_id, bool is_left, int num_sites,
+    bool is_multi_row_height_movable,
+    vector<pair<InstanceId, int>>& instance_id_and_num_sites_pushes) const {
+  const double site_width = Site::width();
+  const double row_height = Site::height();
+  const int num_row_sites = site_occupancy_map_.num_row_sites();
+  const int max_num_pushes = 16;  // TODO: Tune.
+
+  // Each instance is pushed by the most sites any neighbour needs, and its
+  // own neighbours are visited again whenever that grows.
+
+  instance_id_and_num_sites_pushes.clear();
+  vector<int> push_indices;
+
+  auto push = [&](InstanceId pushed_instance_id, int num_pushed_sites) -> bool {
+    const Instance& instance = database_.instance(pushed_instance_id);
+
+    if (instance.is_fixed() ||
+        (instance.num_sub_instances() > 1 && !is_multi_row_height_movable)) {
+      return false;
+    }
+
+    for (int i = 0; i < instance_id_and_num_sites_pushes.size(); ++i) {
+      if (instance_id_and_num_sites_pushes[i].first == pushed_instance_id) {
+        if (instance_id_and_num_sites_pushes[i].second < num_pushed_sites) {
+          instance_id_and_num_sites_pushes[i].second = num_pushed_sites;
+          push_indices.push_back(i);
+        }
+
+        return true;
+      }
+    }
+
+    if (instance_id_and_num_sites_pushes.size() == max_num_pushes) {
+      return false;
+    }
+
+    push_indices.push_back(instance_id_and_num_sites_pushes.size());
+    instance_id_and_num_sites_pushes.push_back(
+        make_pair(pushed_instance_id, num_pushed_sites));
+
+    return true;
+  };
+
+  if (!push(instance_id, num_sites)) {
+    return false;
+  }
+
+  while (!push_indices.empty()) {
+    const InstanceId current_instance_id =
+        instance_id_and_num_sites_pushes[push_indices.back()].first;
+    const int current_num_sites =
+        instance_id_and_num_sites_pushes[push_indices.back()].second;
+
+    push_indices.pop_back();
+
+    const Instance& instance = database_.instance(current_instance_id);
+    const int instance_site_width =
+        static_cast<int>(ceil(instance.width() / site_width));
+    const int site_idx =
+        static_cast<int>((instance.position().x() -
+                          database_.die_rect().min_corner().x()) /
+                         site_width);
+    const int bottom_row_idx =
+        static_cast<int>((instance.position().y() -
+                          database_.die_rect().min_corner().y()) /
+                         row_height);
+
+    for (int i = 0; i < instance.num_sub_instances(); ++i) {
+      const int row_idx = bottom_row_idx + i;
+      const vector<InstanceId>& instance_ids =
+          instance_ids_sorted_by_x_by_row_[row_idx];
+      const int neighbour_idx =
+          sorted_idx_by_sub_instance_id_[instance.sub_instance_id(i)] +
+          (is_left ? -1 : 1);
+      const InstanceId neighbour_instance_id =
+          (neighbour_idx >= 0 && neighbour_idx < instance_ids.size())
+              ? instance_ids[neighbour_idx]
+              : InstanceId(UNDEFINED_ID);
+
+      // The sites moved onto must be of the fence region, and those occupied
+      // belong to the neighbour, which is pushed on.
+
+      for (int j = 0; j < current_num_sites; ++j) {
+        const int moved_site_idx = is_left
+                                       ? site_idx - 1 - j
+                                       : site_idx + instance_site_width + j;
+
+        if (moved_site_idx < 0 || moved_site_idx >= num_row_sites) {
+          return false;
+        }
+
+        const Site& site =
+            database_.site(SiteId(row_idx * num_row_sites + moved_site_idx));
+
+        if (!site.is_valid() ||
+            site.fence_region_id() != instance.fence_region_id() ||
+            (site.has_sub_instance() &&
+             database_.sub_instance(site.sub_instance_id()).instance_id() !=
+                 neighbour_instance_id)) {
+          return false;
+        }
+      }
+
+      if (neighbour_instance_id == UNDEFINED_ID) {
+        continue;
+      }
+
+      const int surplus =
+          is_left ? ComputeEdgeSpacingSurplus(neighbour_instance_id,
+                                              current_instance_id)
+                  : ComputeEdgeSpacingSurplus(current_instance_id,
+                                              neighbour_instance_id);
+
+      if (current_num_sites > surplus &&
+          !push(neighbour_instance_id, current_num_sites - surplus)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool Legalizer::IsEdgeSpacingMet(InstanceId instance_id) const {
+  const double row_height = Site::height();
+
+  const Instance& instance = database_.instance(instance_id);
+  const int bottom_row_idx =
+      static_cast<int>((instance.position().y() -
+                        database_.die_rect().min_corner().y()) /
+                       row_height);
+
+  for (int i = 0; i < instance.num_sub_instances(); ++i) {
+    const vector<InstanceId>& instance_ids =
+        instance_ids_sorted_by_x_by_row_[bottom_row_idx + i];
+    const int idx = sorted_idx_by_sub_instance_id_[instance.sub_instance_id(i)];
+
+    if ((idx > 0 &&
+         ComputeEdgeSpacingSurplus(instance_ids[idx - 1], instance_id) < 0) ||
+        (idx + 1 < instance_ids.size() &&
+         ComputeEdgeSpacingSurplus(instance_id, instance_ids[idx + 1]) < 0)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Legalizer::ResolveEdgeSpacing(InstanceId left_instance_id,
+                                   InstanceId right_instance_id,
+                                   bool is_multi_row_height_movable) {
+  const double site_width = Site::width();
+
+  // Increase of the displacement by the pushes, to the left if is_left.
+  auto compute_cost = [&](const vector<pair<InstanceId, int>>& pushes,
+                          bool is_left) {
+    double cost = 0.0;
+
+    for (const pair<InstanceId, int>& push : pushes) {
+      const Instance& instance = database_.instance(push.first);
+      const double x = instance.position().x();
+      const double global_placed_x = instance.global_placed_position().x();
+      const double new_x =
+          x + (is_left ? -push.second : push.second) * site_width;
+
+      cost += abs(new_x - global_placed_x) - abs(x - global_placed_x);
+    }
+
+    return cost;
+  };
+
+  // Split the missing sites between pushing the left instance left and the
+  // right one right, whichever way displaces the pushed instances least.
+
+  const int num_missing_sites =
+      -ComputeEdgeSpacingSurplus(left_instance_id, right_instance_id);
+
+  vector<pair<InstanceId, int>> left_pushes;
+  vector<pair<InstanceId, int>> right_pushes;
+  vector<pair<InstanceId, int>> best_left_pushes;
+  vector<pair<InstanceId, int>> best_right_pushes;
+  double best_cost = numeric_limits<double>::max();
+
+  for (int i = 0; i <= num_missing_sites; ++i) {
+    const int num_left_sites = num_missing_sites - i;
+
+    left_pushes.clear();
+    right_pushes.clear();
+
+    if ((num_left_sites > 0 &&
+         !FindEdgeSpacingPushes(left_instance_id, true, num_left_sites,
+                                is_multi_row_height_movable, left_pushes)) ||
+        (i > 0 &&
+         !FindEdgeSpacingPushes(right_instance_id, false, i,
+                                is_multi_row_height_movable, right_pushes))) {
+      continue;
+    }
+
+    const double cost =
+        compute_cost(left_pushes, true) + compute_cost(right_pushes, false);
+
+    if (cost < best_cost) {
+      best_cost = cost;
+      best_left_pushes.swap(left_pushes);
+      best_right_pushes.swap(right_pushes);
+    }
+  }
+
+  if (best_cost < numeric_limits<double>::max()) {
+    for (const pair<InstanceId, int>& push : best_left_pushes) {
+      ClearInstanceSites(push.first);
+    }
+    for (const pair<InstanceId, int>& push : best_right_pushes) {
+      ClearInstanceSites(push.first);
+    }
+    for (const pair<InstanceId, int>& push : best_left_pushes) {
+      Instance& instance = database_.instance(push.first);
+      instance.set_position(instance.position() -
+                            Point(push.second * site_width, 0.0));
+      database_.UpdateInstanceSubInstancePositions(push.first);
+      FillInstanceSites(push.first);
+    }
+    for (const pair<InstanceId, int>& push : best_right_pushes) {
+      Instance& instance = database_.instance(push.first);
+      instance.set_position(instance.position() +
+                            Point(push.second * site_width, 0.0));
+      database_.UpdateInstanceSubInstancePositions(push.first);
+      FillInstanceSites(push.first);
+    }
+
+    return true;
+  }
+
+  // Otherwise flipping either instance horizontally swaps its edge types.
+
+  for (InstanceId instance_id : {right_instance_id, left_instance_id}) {
+    Instance& instance = database_.instance(instance_id);
+    const Orientation orientation = instance.orientation();
+
+    if (instance.is_fixed() ||
+        (instance.num_sub_instances() > 1 && !is_multi_row_height_movable) ||
+        (orientation != Orientation::N && orientation != Orientation::FN &&
+         orientation != Orientation::S && orientation != Orientation::FS)) {
+      continue;
+    }
 
-      RowId current_row_id = nearest_row_id;
-      bool out_of_loop = false;
-      for (int j = 0; j < 2 * database_.num_rows(); ++j) {
-        if (out_of_loop) {
-          break;
-        }
-        if (j % 2 == 0) {
-          current_row_id += j;
-        } else {
-          current_row_id -= j;
-        }
+    instance.FlipHorizontally();
 
-        // Meet top and bottom row
-        if (current_row_id < bottom_row_id ||
-            current_row_id > top_row_id - current_instance_row_height + 1) {
-          continue;
-        }
+    if (IsEdgeSpacingMet(instance_id)) {
+      return true;
+    }
 
-        assert(current_row_id >= bottom_row_id &&
-               current_row_id <= top_row_id - current_instance_row_height + 1);
+    instance.FlipHorizontally();
+  }
 
-        const Row& current_row = database_.row(current_row_id);
-        // meet fence region constraint
-        if (!current_row.has_interval_of_fence_region(fenge_region_id)) {
-          continue;
-        }
-        const double site_y = current_row.position().y();
-
-        // Meet P/G rail constraints.
-        bool is_pg_rail_correct = true;
-        // Only consider the rails on metal 1.
-        if (current_row.has_rail_on_layer(LayerId(0))) {
-          const RailId rail_id = current_row.rail_id_on_layer(LayerId(0));
-          const Rail& rail = database_.rail(rail_id);
-          // Wrong rail alignments of even-row-height instances can not be
-          // resolved by just flipping vertically.
-          if ((current_instance_row_height % 2 == 0) &&
-              ((current_instance.is_bottom_ground() &&
-                rail.type() == NetType::POWER) ||
-               (!current_instance.is_bottom_ground() &&
-                rail.type() == NetType::GROUND))) {
-            is_pg_rail_correct = false;
-          }
-        }
-        if (!is_pg_rail_correct) {
-          continue;
-        }
+  return false;
+}
 
-        int current_row_site = nearest_row_site;
-        for (int k = 0; k < 2 * num_row_sites; k++) {
-          if (k % 2 == 0) {
-            current_row_site += k;
-          } else {
-            current_row_site -= k;
-          }
-          // Meet left and right site
-          if ((current_row_site < left_site) ||
-              ((current_row_site + current_instance_site_width) >
-               (right_site + 1))) {
-            continue;
-          }
+void Legalizer::BuildWindows() {
+  const double site_width = Site::width();
+  const double row_height = Site::height();
+  const int num_rows = database_.num_rows();
+  const int num_row_sites = database_.num_sites() / num_rows;
+  const int num_word_sites = SiteOccupancyMap::num_word_sites();
 
-          // decide position
-          const double site_x = current_row_site * site_width;
-
-          // check sub_instance bottom to top
-          bool jump_out_of_loop = false;
-          for (int m = 0; m < current_instance.num_sub_instances(); ++m) {
-            // check sub_instance left to right
-            for (int n = 0; n < current_instance_site_width; ++n) {
-              const SiteId site_id = database_.site_id_by_position(
-                  Point(site_x + n * site_width, site_y + m * row_height));
-              const Site& site = database_.site(site_id);
-              const FenceRegionId& site_fenge_region_id =
-                  site.fence_region_id();
-              if (!site.is_valid() || site.has_sub_instance() ||
-                  site_fenge_region_id != fenge_region_id) {
-                jump_out_of_loop = true;
-                break;
-              }
-            }
-            if (jump_out_of_loop) {
-              break;
-            }
-          }
-          if (jump_out_of_loop) {
-            continue;
-          }
+  double instance_area = 0.0;
+  for (int i = 0; i < database_.num_instances(); ++i) {
+    const Instance& instance = database_.instance(InstanceId(i));
 
-          displacement_x = fabs(site_x - current_instance_x);
-          displacement_y = fabs(site_y - current_instance_y);
-          displacement = displacement_x + displacement_y;
-          if (displacement < best_displacement) {
-            best_displacement = displacement;
-            best_site_x = site_x;
-            best_site_y = site_y;
-            if (displacement_x < row_height) {
-              out_of_loop = true;
-            }
-            break;
-          }
-        }
-      }
+    if (!instance.is_fixed()) {
+      instance_area += instance.width() * instance.height();
+    }
+  }
 
-      current_instance.set_position(Point(best_site_x, best_site_y));
+  int num_valid_sites = 0;
+  for (int i = 0; i < database_.num_sites(); ++i) {
+    if (database_.site(SiteId(i)).is_valid()) {
+      ++num_valid_sites;
+    }
+  }
 
-      const RowId best_row_id(
-          (best_site_y - database_.die_rect().min_corner().y()) / row_height);
+  const double density =
+      min(instance_area / (num_valid_sites * site_width * row_height), 1.0);
+
+  // Square windows of four tallest instances, scaled so that each keeps
+  // about the same free area. Widths are rounded up to whole occupancy words.
+  const double scale = 1.0 / sqrt(max(1.0 - density, 0.1));  // TODO: Tune.
+
+  num_window_rows_ =
+      min(static_cast<int>(ceil(4 * database_.max_instance_row_height() *
+                                scale)),
+          num_rows);
+  num_window_sites_ =
+      static_cast<int>(
+          ceil(num_window_rows_ * row_height / site_width / num_word_sites)) *
+      num_word_sites;
+  num_window_columns_ =
+      (num_row_sites + num_window_sites_ - 1) / num_window_sites_;
+
+  const int num_window_row_groups =
+      (num_rows + num_window_rows_ - 1) / num_window_rows_;
+
+  for (int i = 0; i < num_window_row_groups; ++i) {
+    for (int j = 0; j < num_window_columns_; ++j) {
+      const Point position_down(
+          database_.die_rect().min_corner().x() +
+              j * num_window_sites_ * site_width,
+          database_.die_rect().min_corner().y() +
+              i * num_window_rows_ * row_height);
+      const Point position_top(
+          database_.die_rect().min_corner().x() +
+              min((j + 1) * num_window_sites_, num_row_sites) * site_width,
+          database_.die_rect().min_corner().y() +
+              min((i + 1) * num_window_rows_, num_rows) * row_height);
+
+      database_.add_window(Window(position_top, position_down,
+                                  vector<SiteId>(), vector<SubInstanceId>()));
+    }
+  }
+}
 
-      assert(best_row_id >= bottom_row_id &&
-             best_row_id <= top_row_id - current_instance_row_height + 1);
+void Legalizer::LegalizeWindows() {
+  const double site_width = Site::width();
+  const double row_height = Site::height();
+  const int num_row_sites = site_occupancy_map_.num_row_sites();
 
-      const Row& best_row = database_.row(best_row_id);
+  if (database_.num_windows() == 0) {
+    BuildWindows();
+  }
 
-      if (current_instance.orientation() != best_row.orientation()) {
-        current_instance.FlipVertically();
+  for (int i = 0; i < database_.num_windows(); ++i) {
+    database_.window(WindowId(i)).clear_subinstances();
+  }
+
+  is_placed_in_window_by_instance_id_.assign(database_.num_instances(), false);
+
+  // Hand each instance lying inside a window to it by its bottom
+  // sub-instance, in the order of AlignInstancesToSites.
+
+  for (int h = x_and_instance_id_sorted_by_x_by_row_height_.size() - 1; h >= 0;
+       --h) {
+    const auto& x_and_instance_id_sorted_by_x =
+        x_and_instance_id_sorted_by_x_by_row_height_[h];
+
+    for (int i = 0; i < x_and_instance_id_sorted_by_x.size(); ++i) {
+      const InstanceId instance_id = x_and_instance_id_sorted_by_x[i].second;
+      const Instance& instance = database_.instance(instance_id);
+
+      if (instance.is_fixed()) {
+        continue;
       }
 
-      for (int j = 0; j < current_instance.num_sub_instances(); ++j) {
-        const SubInstanceId sub_instance_id =
-            current_instance.sub_instance_id(j);
-        SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
-        sub_instance.set_position(
-            Point(current_instance.position().x(),
-                  current_instance.position().y() + j * row_height));
+      const int instance_site_width =
+          static_cast<int>(instance.width() / site_width);
+      const int site_idx =
+          static_cast<int>((instance.position().x() + 0.5 * site_width -
+                            database_.die_rect().min_corner().x()) /
+                           site_width);
+      const int row_idx =
+          static_cast<int>((instance.position().y() -
+                            database_.die_rect().min_corner().y()) /
+                           row_height);
 
-        if (sub_instance.position().x() <
-            database_.die_rect().max_corner().x()) {
-          for (int k = 0; k < current_instance_site_width; ++k) {
-            const SiteId site_id = database_.site_id_by_position(
-                Point(current_instance.position().x() + k * site_width,
-                      current_instance.position().y() + j * row_height));
-            Site& site = database_.site(site_id);
-            site.set_sub_instance_id(sub_instance_id);
-          }
-        }
+      if (site_idx < 0 || site_idx + instance_site_width > num_row_sites) {
+        continue;
+      }
+
+      const int window_row_idx = row_idx / num_window_rows_;
+      const int window_column_idx = site_idx / num_window_sites_;
+
+      if ((row_idx + instance.num_sub_instances() - 1) / num_window_rows_ !=
+              window_row_idx ||
+          (site_idx + instance_site_width - 1) / num_window_sites_ !=
+              window_column_idx) {
+        continue;
       }
+
+      const WindowId window_id(window_row_idx * num_window_columns_ +
+                               window_column_idx);
+      database_.window(window_id).add_subinstance(instance.sub_instance_id(0));
     }
   }
-}
 
-void Legalizer::ResolveEdgeSpacingConstraint() {
-  SortInstancesByX();
+  // Each window only touches its own sites and instances, so the result does
+  // not depend on the number of threads.
 
-  for (int i = 0; i < x_and_instance_id_sorted_by_x_.size(); ++i) {
-    const InstanceId instance_id = x_and_instance_id_sorted_by_x_[i].second;
+  for (int i = 0; i < 4; ++i) {
+    vector<WindowId> window_ids;
+    for (int j = 0; j < database_.num_windows(); ++j) {
+      const int window_row_idx = j / num_window_columns_;
+      const int window_column_idx = j % num_window_columns_;
 
-    vector<InstanceId> right_instance_ids =
-        FindAdjacentInstances(instance_id, false,
-                              (database_.die_rect().max_corner().x() -
-                               database_.die_rect().min_corner().x()));
+      if ((window_row_idx % 2) * 2 + window_column_idx % 2 == i) {
+        window_ids.push_back(WindowId(j));
+      }
+    }
 
-    if (right_instance_ids.empty()) {
-      continue;
+#pragma omp parallel for schedule(dynamic)
+    for (int j = 0; j < window_ids.size(); ++j) {
+      LegalizeWindow(window_ids[j]);
     }
+  }
+}
 
-    const Instance& instance = database_.instance(instance_id);
-    const EdgeType instance_right_edge_type = instance.right_edge_type();
+void Legalizer::LegalizeWindow(WindowId window_id) {
+  const double site_width = Site::width();
+  const double row_height = Site::height();
+  const double die_min_x = database_.die_rect().min_corner().x();
+  const double die_min_y = database_.die_rect().min_corner().y();
+
+  const Window& window = database_.window(window_id);
+  const int begin_row_idx = static_cast<int>(
+      (window.position_down().y() - die_min_y) / row_height + 0.5);
+  const int end_row_idx = static_cast<int>(
+      (window.position_top().y() - die_min_y) / row_height + 0.5);
+  const int begin_site_idx = static_cast<int>(
+      (window.position_down().x() - die_min_x) / site_width + 0.5);
+  const int end_site_idx = static_cast<int>(
+      (window.position_top().x() - die_min_x) / site_width + 0.5);
+
+  for (int i = 0; i < window.num_subinstance(); ++i) {
+    const InstanceId instance_id =
+        database_.sub_instance(window.subinstance(i)).instance_id();
+    Instance& instance = database_.instance(instance_id);
+
+    const int instance_site_width =
+        static_cast<int>(instance.width() / site_width);
+    const int instance_row_height = instance.num_sub_instances();
+    const double global_x = instance.global_placed_position().x();
+    const double global_y = instance.global_placed_position().y();
+    const double displacement_limit =
+        min(10 * site_width,  // TODO: Tune.
+            database_.displacement_limit() -
+                abs(instance.position().y() - global_y));
+
+    // As in AlignInstancesToSites, without pushing other instances.
+
+    int best_row_idx = static_cast<int>(
+        (instance.position().y() - die_min_y) / row_height);
+    int best_site_idx = site_occupancy_map_.FindFreeSitesAfter(
+        instance.fence_region_id(), best_row_idx, instance_row_height,
+        instance_site_width,
+        static_cast<int>((instance.position().x() + 0.5 * site_width -
+                          die_min_x) /
+                         site_width),
+        min(end_site_idx - instance_site_width,
+            static_cast<int>((global_x + displacement_limit - die_min_x) /
+                             site_width)));
+
+    if (best_site_idx == UNDEFINED_ID ||
+        abs(die_min_x + best_site_idx * site_width - global_x) >=
+            displacement_limit) {
+      // As in AllocateIllegalInstances, but only if no position outside the
+      // window could be nearer.
+
+      double best_displacement = min(
+          min(min(global_x - window.position_down().x(),
+                  window.position_top().x() - global_x - instance.width()),
+              min(global_y - window.position_down().y(),
+                  window.position_top().y() - global_y - instance.height())),
+          database_.displacement_limit());
+
+      const vector<RowId>& candidate_row_ids = FindCandidateRowIds(instance);
+
+      best_site_idx = UNDEFINED_ID;
+      for (int k = lower_bound(candidate_row_ids.begin(),
+                               candidate_row_ids.end(), RowId(begin_row_idx)) -
+                   candidate_row_ids.begin();
+           k < candidate_row_ids.size() &&
+           candidate_row_ids[k] + instance_row_height <= end_row_idx;
+           ++k) {
+        const int j = candidate_row_ids[k];
+        const double displacement_y =
+            abs(die_min_y + j * row_height - global_y);
+
+        if (displacement_y > best_displacement) {
+          continue;
+        }
+
+        const int site_idx = site_occupancy_map_.FindNearestFreeSites(
+            instance.fence_region_id(), j, instance_row_height,
+            instance_site_width,
+            static_cast<int>((global_x + 0.5 * site_width - die_min_x) /
+                             site_width),
+            begin_site_idx, end_site_idx - instance_site_width);
 
-    for (int i = 0; i < right_instance_ids.size(); ++i) {
-      const InstanceId right_instance_id(right_instance_ids[i]);
-      Instance& right_instance = database_.instance(right_instance_id);
-      const double distance = right_instance.position().x() -
-                              (instance.position().x() + instance.width());
-      const EdgeType right_instance_left_edge_type =
-          right_instance.left_edge_type();
-      const double edge_spacing_limit = database_.edge_type_spacing(
-          instance_right_edge_type, right_instance_left_edge_type);
+        if (site_idx == UNDEFINED_ID) {
+          continue;
+        }
+
+        const double displacement =
+            abs(die_min_x + site_idx * site_width - global_x) + displacement_y;
+
+        if (displacement <= best_displacement) {
+          best_displacement = displacement;
+          best_row_idx = j;
+          best_site_idx = site_idx;
+        }
+      }
 
-      if (distance < edge_spacing_limit) {
-        right_instance.FlipHorizontally();
+      if (best_site_idx == UNDEFINED_ID) {
+        continue;
       }
     }
+
+    const Row& best_row = database_.row(RowId(best_row_idx));
+    if (instance.orientation() != best_row.orientation()) {
+      instance.FlipVertically();
+    }
+
+    instance.set_position(Point(die_min_x + best_site_idx * site_width,
+                                die_min_y + best_row_idx * row_height));
+    database_.UpdateInstanceSubInstancePositions(instance_id);
+    FillInstanceSites(instance_id);
+
+    is_placed_in_window_by_instance_id_[instance_id] = true;
   }
 }
 
@@ -1329,129 +2885,83 @@ void Legalizer::SortInstancesByRowHeightByX() {
   }
 }
 
-bool Legalizer::IsResultLegal() {
-  const double site_width = Site::width();
-  const double row_height = Site::height();
-
-  for (int i = 0; i < database_.num_instances(); ++i) {
-    const InstanceId instance_id(i);
-    const Instance& instance = database_.instance(instance_id);
-
-    if (instance.is_fixed()) {
-      continue;
-    }
-
-    if (instance.position().x() < database_.die_rect().min_corner().x() ||
-        instance.position().y() < database_.die_rect().min_corner().y() ||
-        instance.position().x() + instance.width() >
-            database_.die_rect().max_corner().x() ||
-        instance.position().y() + instance.height() >
-            database_.die_rect().max_corner().y()) {
-      cout << "[HARD] Out of chip:" << endl;
-      cout << "  instance: " << instance.name() << " at " << instance.position()
-           << endl;
-
-      return false;
+void Legalizer::BuildCandidateRows() {
+  const int num_rows = database_.num_rows();
+  const int max_row_height = database_.max_instance_row_height();
+
+  candidate_row_ids_by_key_.assign(
+      (database_.num_fence_regions() + 1) * max_row_height * 2,
+      vector<RowId>());
+
+  for (int i = UNDEFINED_ID; i < database_.num_fence_regions(); ++i) {
+    const FenceRegionId fence_region_id(i);
+
+    // Number of consecutive rows from each row up with intervals of the
+    // fence region.
+    vector<int> num_fence_region_rows(num_rows + 1, 0);
+    for (int j = num_rows - 1; j >= 0; --j) {
+      if (database_.row(RowId(j)).has_interval_of_fence_region(
+              fence_region_id)) {
+        num_fence_region_rows[j] = num_fence_region_rows[j + 1] + 1;
+      }
     }
 
-    const int instance_site_width =
-        static_cast<int>(instance.width() / site_width);
-
-    for (int j = 0; j < instance.num_sub_instances(); ++j) {
-      const SubInstanceId sub_instance_id(instance.sub_instance_id(j));
-      const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
-
-      for (int k = 0; k < instance_site_width; ++k) {
-        const SiteId site_id(database_.site_id_by_position(
-            Point(sub_instance.position().x() + k * site_width,
-                  sub_instance.position().y())));
-        const Site& site = database_.site(site_id);
-
-        if (!site.is_valid() ||
-            site.fence_region_id() != instance.fence_region_id() ||
-            site.sub_instance_id() != sub_instance_id) {
-          cout << "[HARD] Wrong site:" << endl;
-          cout << "  instance: " << instance.name() << " at "
-               << instance.position() << endl;
+    for (int j = 1; j <= max_row_height; ++j) {
+      for (int k = 0; k < 2; ++k) {
+        vector<RowId>& candidate_row_ids =
+            candidate_row_ids_by_key_[((i + 1) * max_row_height + j - 1) * 2 +
+                                      k];
 
-          return false;
+        for (int l = 0; l + j <= num_rows; ++l) {
+          if (num_fence_region_rows[l] >= j &&
+              IsPgRailAligned(j, k == 1, database_.row(RowId(l)))) {
+            candidate_row_ids.push_back(RowId(l));
+          }
         }
       }
     }
   }
+}
 
-  for (int i = 0; i < database_.num_instances(); ++i) {
-    const InstanceId instance_id(i);
-    const Instance& instance = database_.instance(instance_id);
-
-    if (instance.is_fixed()) {
-      continue;
-    }
-
-    const RowId row_id(static_cast<int>(
-        (instance.position().y() - database_.die_rect().min_corner().y()) /
-        row_height));
-    const Row& row = database_.row(row_id);
-
-    if (instance.orientation() != row.orientation() &&
-        FlipOrientation(instance.orientation()) != row.orientation()) {
-      cout << "[HARD] Wrong P/G rail alignment:" << endl;
-      cout << "  instance: " << instance.name() << " at " << instance.position()
-           << endl;
+const vector<RowId>& Legalizer::FindCandidateRowIds(
+    const Instance& instance) const {
+  return candidate_row_ids_by_key_.at(
+      ((instance.fence_region_id() + 1) * database_.max_instance_row_height() +
+       instance.num_sub_instances() - 1) *
+          2 +
+      (instance.is_bottom_ground() ? 1 : 0));
+}
 
-      return false;
-    }
+bool Legalizer::IsPgRailAligned(int row_height, bool is_bottom_ground,
+                                const Row& row) const {
+  // Only consider the rails on metal 1.
+  if (!row.has_rail_on_layer(LayerId(0))) {
+    return true;
   }
 
-  // Check edge spacing constraint.
-
-  SortInstancesByX();
-
-  /*for (int i = 0; i < x_and_instance_id_sorted_by_x_.size(); ++i) {
-    const InstanceId instance_id = x_and_instance_id_sorted_by_x_[i].second;
+  const Rail& rail = database_.rail(row.rail_id_on_layer(LayerId(0)));
 
-    vector<InstanceId> right_instance_ids =
-        FindAdjacentInstances(instance_id, false,
-                              (database_.die_rect().max_corner().x() -
-                               database_.die_rect().min_corner().x()));
-
-    if (right_instance_ids.empty()) {
-      continue;
-    }
+  // Wrong rail alignments of even-row-height instances can not be resolved
+  // by just flipping vertically.
+  return row_height % 2 != 0 ||
+         (is_bottom_ground && rail.type() != NetType::POWER) ||
+         (!is_bottom_ground && rail.type() != NetType::GROUND);
+}
 
-    const Instance& instance = database_.instance(instance_id);
-    const EdgeType instance_right_edge_type = instance.right_edge_type();
-
-    for (int i = 0; i < right_instance_ids.size(); ++i) {
-      const InstanceId right_instance_id(right_instance_ids[i]);
-      Instance& right_instance = database_.instance(right_instance_id);
-      const double distance = right_instance.position().x() -
-                              (instance.position().x() + instance.width());
-      const EdgeType right_instance_left_edge_type =
-          right_instance.left_edge_type();
-      const double edge_spacing_limit = database_.edge_type_spacing(
-          instance_right_edge_type, right_instance_left_edge_type);
-
-      if (distance < edge_spacing_limit) {
-        cout << "[SOFT] Violate edge spacing:" << endl;
-        cout << "  " << distance << " < " << edge_spacing_limit << endl;
-        cout << "  left instance: " << instance.name() << " at "
-             << instance.position() << endl;
-        cout << "  right instance: " << right_instance.name() << " at "
-             << right_instance.position() << endl;
-      }
-    }
-  }*/
+bool Legalizer::IsResultLegal() {
+  LegalityChecker legality_checker(database_);
+  legality_checker.Check();
+  legality_checker.Summary();
 
-  return true;
+  return legality_checker.is_legal();
 }
 
 void Legalizer::ClearInstanceSites(InstanceId instance_id) {
-  const double site_width = Site::width();
+  const int num_row_sites = site_occupancy_map_.num_row_sites();
 
   const Instance& instance = database_.instance(instance_id);
   const int instance_site_width =
-      static_cast<int>(ceil(instance.width() / site_width));
+      static_cast<int>(ceil(instance.width() / Site::width()));
 
   assert(instance.position().x() >= database_.die_rect().min_corner().x());
   assert(instance.position().x() + instance.width() <=
@@ -1460,12 +2970,11 @@ void Legalizer::ClearInstanceSites(InstanceId instance_id) {
   for (int i = 0; i < instance.num_sub_instances(); ++i) {
     const SubInstanceId sub_instance_id = instance.sub_instance_id(i);
     const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
+    const int row_idx = ComputeRowIdx(sub_instance.position().y());
+    const int site_idx = ComputeSiteIdx(sub_instance.position().x());
 
     for (int j = 0; j < instance_site_width; ++j) {
-      const SiteId site_id = database_.site_id_by_position(
-          Point(sub_instance.position().x() + j * site_width,
-                sub_instance.position().y()));
-      Site& site = database_.site(site_id);
+      Site& site = database_.site(SiteId(row_idx * num_row_sites + site_idx + j));
 
       assert(site.is_valid());
       assert(site.has_sub_instance());
@@ -1473,15 +2982,18 @@ void Legalizer::ClearInstanceSites(InstanceId instance_id) {
 
       site.remove_sub_instance_id();
     }
+
+    site_occupancy_map_.set_is_occupied(row_idx, site_idx, instance_site_width,
+                                        false);
   }
 }
 
 void Legalizer::FillInstanceSites(InstanceId instance_id) {
-  const double site_width = Site::width();
+  const int num_row_sites = site_occupancy_map_.num_row_sites();
 
   const Instance& instance = database_.instance(instance_id);
   const int instance_site_width =
-      static_cast<int>(ceil(instance.width() / site_width));
+      static_cast<int>(ceil(instance.width() / Site::width()));
 
   assert(instance.position().x() >= database_.die_rect().min_corner().x());
   assert(instance.position().x() + instance.width() <=
@@ -1490,12 +3002,11 @@ void Legalizer::FillInstanceSites(InstanceId instance_id) {
   for (int i = 0; i < instance.num_sub_instances(); ++i) {
     const SubInstanceId sub_instance_id = instance.sub_instance_id(i);
     const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
+    const int row_idx = ComputeRowIdx(sub_instance.position().y());
+    const int site_idx = ComputeSiteIdx(sub_instance.position().x());
 
     for (int j = 0; j < instance_site_width; ++j) {
-      const SiteId site_id = database_.site_id_by_position(
-          Point(sub_instance.position().x() + j * site_width,
-                sub_instance.position().y()));
-      Site& site = database_.site(site_id);
+      Site& site = database_.site(SiteId(row_idx * num_row_sites + site_idx + j));
 
       assert(site.is_valid());
       assert(!site.has_sub_instance());
@@ -1503,81 +3014,20 @@ void Legalizer::FillInstanceSites(InstanceId instance_id) {
 
       site.set_sub_instance_id(sub_instance_id);
     }
+
+    site_occupancy_map_.set_is_occupied(row_idx, site_idx, instance_site_width,
+                                        true);
   }
 }
 
-vector<InstanceId> Legalizer::FindAdjacentInstances(InstanceId instance_id,
-                                                    bool is_left,
-                                                    double adjacent_threshold) {
-  const double site_width = Site::width();
-
-  const Instance& instance = database_.instance(instance_id);
-
-  vector<InstanceId> adjacent_instance_ids;
-  if (is_left) {
-    vector<bool> is_instance_met_by_id(database_.num_instances(), false);
-    for (int i = 0; i < instance.num_sub_instances(); ++i) {
-      const SubInstanceId sub_instance_id(instance.sub_instance_id(i));
-      const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
-
-      for (double x = sub_instance.position().x() - site_width;
-           sub_instance.position().x() - x < adjacent_threshold &&
-           x >= database_.die_rect().min_corner().x();
-           x -= site_width) {
-        const SiteId site_id(database_.site_id_by_position(
-            Point(x, sub_instance.position().y())));
-        const Site& site = database_.site(site_id);
-
-        if (site.has_sub_instance()) {
-          const SubInstanceId adjacent_sub_instance_id(site.sub_instance_id());
-          const SubInstance& adjacent_sub_instance =
-              database_.sub_instance(adjacent_sub_instance_id);
-          const InstanceId adjacent_instance_id(
-              adjacent_sub_instance.instance_id());
-
-          if (!is_instance_met_by_id.at(adjacent_instance_id)) {
-            adjacent_instance_ids.push_back(adjacent_instance_id);
-            is_instance_met_by_id.at(adjacent_instance_id) = true;
-          }
-
-          break;
-        }
-      }
-    }
-  } else {
-    vector<bool> is_instance_met_by_id(database_.num_instances(), false);
-    for (int i = 0; i < instance.num_sub_instances(); ++i) {
-      const SubInstanceId sub_instance_id(instance.sub_instance_id(i));
-      const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
-
-      for (double x = sub_instance.position().x() + sub_instance.width();
-           x - (sub_instance.position().x() + sub_instance.width()) <
-               adjacent_threshold &&
-           x <= database_.die_rect().max_corner().x() - site_width;
-           x += site_width) {
-        const SiteId site_id(database_.site_id_by_position(
-            Point(x, sub_instance.position().y())));
-        const Site& site = database_.site(site_id);
-
-        if (site.has_sub_instance()) {
-          const SubInstanceId adjacent_sub_instance_id(site.sub_instance_id());
-          const SubInstance& adjacent_sub_instance =
-              database_.sub_instance(adjacent_sub_instance_id);
-          const InstanceId adjacent_instance_id(
-              adjacent_sub_instance.instance_id());
-
-          if (!is_instance_met_by_id.at(adjacent_instance_id)) {
-            adjacent_instance_ids.push_back(adjacent_instance_id);
-            is_instance_met_by_id.at(adjacent_instance_id) = true;
-          }
-
-          break;
-        }
-      }
-    }
-  }
+int Legalizer::ComputeRowIdx(double y) const {
+  return static_cast<int>((y - database_.die_rect().min_corner().y()) /
+                          Site::height());
+}
 
-  return adjacent_instance_ids;
+int Legalizer::ComputeSiteIdx(double x) const {
+  return static_cast<int>((x - database_.die_rect().min_corner().x()) /
+                          Site::width());
 }
 
 bool Legalizer::TryPlaceInstance(InstanceId root_instance_id,
@@ -1585,132 +3035,126 @@ bool Legalizer::TryPlaceInstance(InstanceId root_instance_id,
                                  double displacement_limit) {
   const double die_right_x = database_.die_rect().max_corner().x();
   const double site_width = Site::width();
-  const Instance& root_instance = database_.instance(root_instance_id);
+  const int num_row_sites = site_occupancy_map_.num_row_sites();
 
-  map<InstanceId, double> instance_original_x_by_id;
-  instance_original_x_by_id.insert(
-      make_pair(root_instance_id, root_instance_new_x));
+  // Instances are measured from their x when first pushed, except the root
+  // which is measured from its new x.
 
-  stack<pair<InstanceId, double>> s;
-  s.push(make_pair(root_instance_id, root_instance_new_x));
+  ++push_call_idx_;
+  push_stack_.clear();
+  push_journal_.clear();
+
+  const Instance& root_instance = database_.instance(root_instance_id);
+  push_call_idx_by_instance_id_[root_instance_id] = push_call_idx_;
+  push_reference_x_by_instance_id_[root_instance_id] = root_instance_new_x;
+  double incurred_displacement =
+      abs(root_instance.position().x() - root_instance_new_x);
+
+  push_stack_.push_back(make_pair(root_instance_id, root_instance_new_x));
 
   bool is_instance_placeable = true;
-  set<InstanceId> unplaceable_instance_ids;
-  while (!s.empty()) {
-    const auto& top = s.top();
-    const InstanceId current_instance_id(top.first);
-    const double current_instance_new_x = top.second;
+  while (!push_stack_.empty()) {
+    const InstanceId current_instance_id(push_stack_.back().first);
+    const double current_instance_new_x = push_stack_.back().second;
 
-    s.pop();
+    push_stack_.pop_back();
 
     Instance& current_instance = database_.instance(current_instance_id);
     const int current_instance_site_width =
         static_cast<int>(ceil(current_instance.width() / site_width));
 
-    /* cout << "instance: " << current_instance.name() << " at " */
-    /*      << current_instance.position() << " " << current_instance.width() */
-    /*      << " X " << current_instance.height() << " " << current_instance_new_x */
-    /*      << endl; */
-
-    double incurred_displacement = 0.0;
-    for (const auto& pair : instance_original_x_by_id) {
-      const InstanceId instance_id(pair.first);
-      const double instance_original_x = pair.second;
-      Instance& instance = database_.instance(instance_id);
-      incurred_displacement +=
-          (abs(instance.position().x() - instance_original_x));
-    }
+    // An instance already over the displacement limit may still be pushed,
+    // as long as the push does not take it further away.
+    const double instance_displacement_limit =
+        max(database_.displacement_limit(),
+            ComputeManhattanDistanceBetweenPoints(
+                current_instance.position(),
+                current_instance.global_placed_position()));
 
     if (current_instance_new_x < database_.die_rect().min_corner().x() ||
         current_instance_new_x + current_instance.width() >
             database_.die_rect().max_corner().x() ||
-        incurred_displacement > displacement_limit) {
-      /* cout << "  not placeable" << endl; */
+        incurred_displacement > displacement_limit ||
+        ComputeManhattanDistanceBetweenPoints(
+            Point(current_instance_new_x, current_instance.position().y()),
+            current_instance.global_placed_position()) >
+            instance_displacement_limit) {
       is_instance_placeable = false;
-      unplaceable_instance_ids.insert(current_instance_id);
-      while (!s.empty()) {
-        unplaceable_instance_ids.insert(s.top().first);
-        s.pop();
-      }
       break;
     }
 
-    set<InstanceId> overlap_instance_ids;
+    ++push_pop_idx_;
+    const int current_instance_site_idx =
+        ComputeSiteIdx(current_instance_new_x);
     for (int i = 0; i < current_instance.num_sub_instances(); ++i) {
       const SubInstanceId sub_instance_id(current_instance.sub_instance_id(i));
       const SubInstance& sub_instance = database_.sub_instance(sub_instance_id);
+      const int row_idx = ComputeRowIdx(sub_instance.position().y());
 
-      for (int j = 0; j < current_instance_site_width; ++j) {
-        const SiteId site_id = database_.site_id_by_position(
-            Point(current_instance_new_x + j * site_width,
-                  sub_instance.position().y()));
-        const Site& site = database_.site(site_id);
+      if (!site_occupancy_map_.AreSitesInFenceRegion(
+              current_instance.fence_region_id(), row_idx,
+              current_instance_site_idx, current_instance_site_width)) {
+        is_instance_placeable = false;
+        break;
+      }
 
-        if (!site.is_valid() ||
-            site.fence_region_id() != current_instance.fence_region_id()) {
-          /* cout << "  not placeable" << endl; */
-          is_instance_placeable = false;
-          unplaceable_instance_ids.insert(current_instance_id);
-          while (!s.empty()) {
-            unplaceable_instance_ids.insert(s.top().first);
-            s.pop();
-          }
-          break;
+      // Only occupied sites are read. A pushed instance frees its sites, so
+      // each overlapping instance is met once.
+
+      for (int j = site_occupancy_map_.FindOccupiedSiteAfter(
+               row_idx, current_instance_site_idx,
+               current_instance_site_idx + current_instance_site_width);
+           j != UNDEFINED_ID;
+           j = site_occupancy_map_.FindOccupiedSiteAfter(
+               row_idx, j + 1,
+               current_instance_site_idx + current_instance_site_width)) {
+        const Site& site =
+            database_.site(SiteId(row_idx * num_row_sites + j));
+
+        const SubInstanceId overlap_sub_instance_id(site.sub_instance_id());
+        const SubInstance& overlap_sub_instance =
+            database_.sub_instance(overlap_sub_instance_id);
+        const InstanceId overlap_instance_id(
+            overlap_sub_instance.instance_id());
+        const Instance& overlap_instance =
+            database_.instance(overlap_instance_id);
+
+        if (push_pop_idx_by_instance_id_[overlap_instance_id] ==
+            push_pop_idx_) {
+          continue;
+        }
+        push_pop_idx_by_instance_id_[overlap_instance_id] = push_pop_idx_;
+
+        double overlap_instance_new_x = die_right_x;
+        if (ComputeManhattanDistanceBetweenPoints(
+                overlap_instance.position(),
+                Point(current_instance_new_x - overlap_instance.width(),
+                      overlap_instance.position().y())) <
+            ComputeManhattanDistanceBetweenPoints(
+                overlap_instance.position(),
+                Point(current_instance_new_x + current_instance.width(),
+                      overlap_instance.position().y()))) {
+          overlap_instance_new_x =
+              current_instance_new_x - overlap_instance.width();
+        } else {
+          overlap_instance_new_x =
+              current_instance_new_x + current_instance.width();
         }
 
-        if (site.has_sub_instance()) {
-          const SubInstanceId overlap_sub_instance_id(site.sub_instance_id());
-          const SubInstance& overlap_sub_instance =
-              database_.sub_instance(overlap_sub_instance_id);
-          const InstanceId overlap_instance_id(
-              overlap_sub_instance.instance_id());
-          Instance& overlap_instance = database_.instance(overlap_instance_id);
-
-          if (overlap_instance_ids.count(overlap_instance_id) == 0) {
-            overlap_instance_ids.insert(overlap_instance_id);
-
-            /* cout << "  overlap instance: " << overlap_instance.name() << " at " */
-            /*      << overlap_instance.position() << " " */
-            /*      << overlap_instance.width() << " X " */
-            /*      << overlap_instance.height() << endl; */
-
-            double overlap_instance_new_x = die_right_x;
-            if (ComputeManhattanDistanceBetweenPoints(
-                    overlap_instance.position(),
-                    Point(current_instance_new_x - overlap_instance.width(),
-                          overlap_instance.position().y())) <
-                ComputeManhattanDistanceBetweenPoints(
-                    overlap_instance.position(),
-                    Point(current_instance_new_x + current_instance.width(),
-                          overlap_instance.position().y()))) {
-              overlap_instance_new_x =
-                  current_instance_new_x - overlap_instance.width();
-            } else {
-              overlap_instance_new_x =
-                  current_instance_new_x + current_instance.width();
-            }
-
-            /* const double overlap_instance_new_x = */
-            /*     current_instance_new_x - overlap_instance.width(); */
-
-            if (overlap_instance_id != root_instance_id ||
-                instance_original_x_by_id.count(overlap_instance_id) != 0) {
-              /* cout << "  clear overlap instance" << endl; */
-              ClearInstanceSites(overlap_instance_id);
-
-              if (instance_original_x_by_id.count(overlap_instance_id) == 0) {
-                instance_original_x_by_id.insert(make_pair(
-                    overlap_instance_id, overlap_instance.position().x()));
-              }
-            }
+        if (push_call_idx_by_instance_id_[overlap_instance_id] !=
+            push_call_idx_) {
+          push_call_idx_by_instance_id_[overlap_instance_id] = push_call_idx_;
+          push_reference_x_by_instance_id_[overlap_instance_id] =
+              overlap_instance.position().x();
+        }
 
-            /* overlap_instance.set_position( */
-            /*     Point(overlap_instance_new_x, overlap_instance.position().y())); */
-            /* database_.UpdateInstanceSubInstancePositions(overlap_instance_id); */
+        ClearInstanceSites(overlap_instance_id);
+        push_journal_.push_back(make_tuple(PushAction::CLEAR,
+                                           overlap_instance_id,
+                                           overlap_instance.position().x()));
 
-            s.push(make_pair(overlap_instance_id, overlap_instance_new_x));
-          }
-        }
+        push_stack_.push_back(
+            make_pair(overlap_instance_id, overlap_instance_new_x));
       }
 
       if (!is_instance_placeable) {
@@ -1722,55 +3166,45 @@ bool Legalizer::TryPlaceInstance(InstanceId root_instance_id,
       break;
     }
 
-    /* incurred_displacement -= */
-    /*     (abs(current_instance.position().x() - */
-    /*          current_instance.global_placed_position().x())); */
+    const double current_instance_x = current_instance.position().x();
+    const double reference_x =
+        push_reference_x_by_instance_id_[current_instance_id];
+    incurred_displacement += abs(current_instance_new_x - reference_x) -
+                             abs(current_instance_x - reference_x);
 
+    push_journal_.push_back(
+        make_tuple(PushAction::MOVE, current_instance_id, current_instance_x));
     current_instance.set_position(
         Point(current_instance_new_x, current_instance.position().y()));
     database_.UpdateInstanceSubInstancePositions(current_instance_id);
 
-    /* cout << "  fill current instance" << endl; */
+    push_journal_.push_back(make_tuple(PushAction::FILL, current_instance_id,
+                                       current_instance_new_x));
     FillInstanceSites(current_instance_id);
-
-    /* cout << "  incurred_displacement: " << incurred_displacement << endl; */
   }
 
   if (!is_instance_placeable) {
-    /* cout << "  clear all sites" << endl; */
-    for (const auto& pair : instance_original_x_by_id) {
-      const InstanceId instance_id(pair.first);
-
-      if (unplaceable_instance_ids.count(instance_id) == 0) {
-        /* const Instance& instance = database_.instance(instance_id); */
-        /* cout << "    instance: " << instance.name() << " at " */
-        /*      << instance.position() << " " << instance.width() << " X " */
-        /*      << instance.height() << endl; */
-        ClearInstanceSites(instance_id);
-      }
-    }
-
-    /* cout << "  recover all sites" << endl; */
-    for (const auto& pair : instance_original_x_by_id) {
-      const InstanceId instance_id(pair.first);
-      const double instance_original_x = pair.second;
-      Instance& instance = database_.instance(instance_id);
-
-      instance.set_position(
-          Point(instance_original_x, instance.position().y()));
-      database_.UpdateInstanceSubInstancePositions(instance_id);
-
-      if (instance_id != root_instance_id) {
-        /* cout << "    instance: " << instance.name() << " at " */
-        /*      << instance.position() << " " << instance.width() << " X " */
-        /*      << instance.height() << endl; */
-        FillInstanceSites(instance_id);
+    // Undo the journal backwards.
+    for (int i = push_journal_.size() - 1; i >= 0; --i) {
+      const PushAction action = get<0>(push_journal_[i]);
+      const InstanceId instance_id = get<1>(push_journal_[i]);
+
+      switch (action) {
+        case PushAction::MOVE: {
+          Instance& instance = database_.instance(instance_id);
+          instance.set_position(
+              Point(get<2>(push_journal_[i]), instance.position().y()));
+          database_.UpdateInstanceSubInstancePositions(instance_id);
+          break;
+        }
+        case PushAction::FILL:
+          ClearInstanceSites(instance_id);
+          break;
+        case PushAction::CLEAR:
+          FillInstanceSites(instance_id);
+          break;
       }
     }
-
-    /* Instance& root_instance = database_.instance(root_instance_id); */
-    /* root_instance.set_position( */
-    /*     Point(die_right_x, root_instance.position().y())); */
   }
 
   return is_instance_placeable;
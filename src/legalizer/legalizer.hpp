@@ -2,12 +2,38 @@
 #define LEGALIZER_HPP
 
 #include "../database/database.hpp"
+#include "bin.hpp"
+#include "mmsim_solver.hpp"
+#include "site_occupancy_map.hpp"
+
+#include <array>
+#include <tuple>
+
+// Undoable steps of Legalizer::TryPlaceInstance.
+enum class PushAction { MOVE, FILL, CLEAR };
 
 class Legalizer {
  public:
   Legalizer(Database& database);
 
   void Legalize();
+  // Legalize again after small ECO moves, given the instances whose global
+  // placed positions changed. Instances keep their rows and their order in
+  // them, so MMSIM only updates q and resumes from its previous solution
+  // without refactorizing. Legalize must have been called before.
+  void Relegalize(const std::vector<InstanceId>& moved_instance_ids);
+
+  // Setters
+
+  void set_is_mmsim_decomposed(bool is_mmsim_decomposed);
+  void set_is_single_row_solved_exactly(bool is_single_row_solved_exactly);
+  void set_mmsim_freeze_iterations(int mmsim_freeze_iterations);
+  void set_mmsim_linear_solver(MmsimLinearSolver mmsim_linear_solver);
+  void set_mmsim_precision(MmsimPrecision mmsim_precision);
+  void set_is_window_legalized(bool is_window_legalized);
+  void set_is_row_alignment_parallel(bool is_row_alignment_parallel);
+  void set_is_placement_spread(bool is_placement_spread);
+  void set_is_edge_spacing_resolved(bool is_edge_spacing_resolved);
 
  private:
   void PreMmsim();
@@ -16,28 +42,165 @@ class Legalizer {
   //add DDA constraint
   void PreDDA();
 
+  // Rows are coupled only through multi-row-height instances, so MMSIM can be
+  // split into independent systems, one per connected component of rows.
+  void FindMmsimComponents(
+      std::vector<std::vector<RowId>>& row_ids_by_component,
+      std::vector<std::vector<InstanceId>>& instance_ids_by_component) const;
+  RowId FindSubInstanceRowId(SubInstanceId sub_instance_id) const;
+  void BuildMmsim(const std::vector<RowId>& row_ids,
+                  const std::vector<InstanceId>& instance_ids,
+                  MmsimSolver& mmsim_solver);
+  void IterateMmsimSolvers(const std::vector<int>& solver_indices);
+  void UpdateMmsimPositions();
+  void SolveSingleRows();
+  // A row without multi-row-height instances is a set of independent
+  // intervals whose MMSIM problem is solved exactly by merging clusters.
+  void SolveSingleRow(RowId row_id);
+
+  // Tile the die into windows of a few of the tallest instances, grown with
+  // the density. Windows of one colour of a 2x2 checkerboard share no edge,
+  // corner or occupancy word, so they are legalized concurrently. Instances
+  // crossing a window border, or not placed in their window, are left to
+  // the serial passes.
+  void BuildWindows();
+  void LegalizeWindows();
+  void LegalizeWindow(WindowId window_id);
+
+  // Square bins tile the die, row by row from the bottom left, each sized to
+  // hold about a fixed number of average movable instances. The free area of
+  // a bin is that of the valid sites starting in it, and movable instances
+  // are shared among the bins near their centres.
+  void BuildBins();
+  // The four bins whose centres surround the point, and their bilinear
+  // weights. Areas are shared among, and velocities interpolated between,
+  // the bins near the centres of instances.
+  void FindNearestBins(const Point& point, std::array<int, 4>& bin_indices,
+                       std::array<double, 4>& weights) const;
+  // Bins are filled in parallel, each from its free area built once.
+  void FillBins();
+  // Diffuse movable instances out of the bins above the density target
+  // before they are aligned to rows. Bins below the target count as at the
+  // target, so only overfilled regions spread, and no instance moves further
+  // than half the maximum movement from its global placed position.
   void SpreadInstances();
   void AlignInstancesToRows();
+  // Evaluate the instances of each vertical stripe in parallel against the
+  // intervals left by the previous stripes, then commit them in x order,
+  // evaluating again those whose overlap reads were changed by an earlier
+  // commit. The result is that of the serial pass.
+  void AlignInstancesToRowsInParallel();
+  // Best row, x and intervals of the instance against the current intervals,
+  // appending each (interval, x, overlap) read if overlaps is given.
+  void FindInstanceRow(
+      InstanceId instance_id, RowId& best_row_id, double& best_x,
+      std::vector<IntervalId>& best_interval_ids,
+      std::vector<std::tuple<IntervalId, double, double>>* overlaps) const;
+  void AssignInstanceRow(InstanceId instance_id, RowId best_row_id,
+                         double best_x,
+                         const std::vector<IntervalId>& best_interval_ids);
   void AlignInstancesToSites();
   void AllocateIllegalInstances();
+  // Sweep the rows in x order in parallel, shifting single-row-height
+  // instances apart or flipping them to meet the edge spacing to their
+  // neighbours, then resolve the pairs left with multi-row-height instances
+  // serially.
   void ResolveEdgeSpacingConstraint();
+  // Whether the instance owns the sites under its position.
+  bool IsInstancePlaced(InstanceId instance_id) const;
+  // Sites between adjacent instances in excess of their edge spacing,
+  // negative if some are missing.
+  int ComputeEdgeSpacingSurplus(InstanceId left_instance_id,
+                                InstanceId right_instance_id) const;
+  // Instances, with their numbers of sites, to push left or right so that
+  // the instance moves by num_sites over sites of its fence region, keeping
+  // the edge spacing along the way. Return false if a fixed or, unless
+  // movable, multi-row-height instance, an invalid site or the die edge is
+  // met, or too many instances are pushed.
+  bool FindEdgeSpacingPushes(
+      InstanceId instance_id, bool is_left, int num_sites,
+      bool is_multi_row_height_movable,
+      std::vector<std::pair<InstanceId, int>>& instance_id_and_num_sites_pushes)
+      const;
+  bool IsEdgeSpacingMet(InstanceId instance_id) const;
+  // Push the pair apart at the least displacement, or else flip one of
+  // them. Return false if neither works.
+  bool ResolveEdgeSpacing(InstanceId left_instance_id,
+                          InstanceId right_instance_id,
+                          bool is_multi_row_height_movable);
 
+  // Legal bottom rows depend only on the fence region, the row height and
+  // whether the bottom is ground, so they are tabled once per such key.
+  void BuildCandidateRows();
+  // Sorted bottom rows meeting the P/G rail and fence region constraints.
+  const std::vector<RowId>& FindCandidateRowIds(const Instance& instance) const;
+  // Whether the metal 1 rail of the row suits the bottom of an instance,
+  // possibly after flipping it vertically.
+  bool IsPgRailAligned(int row_height, bool is_bottom_ground,
+                       const Row& row) const;
   void SortInstancesByX();
   void SortInstancesByRowHeightByX();
   bool IsResultLegal();
   void ClearInstanceSites(InstanceId instance_id);
   void FillInstanceSites(InstanceId instance_id);
-  std::vector<InstanceId> FindAdjacentInstances(InstanceId instance_id,
-                                                bool is_left,
-                                                double adjacent_threshold);
+  // Row and site indices of a position, as Database::site_id_by_position.
+  int ComputeRowIdx(double y) const;
+  int ComputeSiteIdx(double x) const;
+  // Place the root instance at the new x, pushing the instances it overlaps
+  // aside recursively. Undo everything and return false if some instance
+  // leaves the die or its fence region or moves further than the maximum
+  // movement, or the total displacement exceeds the limit.
   bool TryPlaceInstance(InstanceId root_instance_id, double root_instance_new_x,
                         double displacement_limit);
 
   Database& database_;
+  bool is_mmsim_decomposed_;
+  bool is_single_row_solved_exactly_;
+  int mmsim_freeze_iterations_;
+  MmsimLinearSolver mmsim_linear_solver_;
+  MmsimPrecision mmsim_precision_;
+  bool is_window_legalized_;
+  bool is_row_alignment_parallel_;
+  bool is_placement_spread_;
+  bool is_edge_spacing_resolved_;
+  std::vector<int> mmsim_variable_idx_by_sub_instance_id_;
+  std::vector<MmsimSolver> mmsim_solvers_;
+  std::vector<std::vector<InstanceId>> mmsim_instance_ids_by_solver_;
+  std::vector<int> mmsim_solver_idx_by_instance_id_;
+  std::vector<RowId> mmsim_single_row_ids_;
+  std::vector<double> mmsim_target_x_by_instance_id_;
+  // Indexed by ((fence region + 1) * max row height + row height - 1) * 2 +
+  // is bottom ground.
+  std::vector<std::vector<RowId>> candidate_row_ids_by_key_;
   std::vector<std::pair<double, InstanceId>> x_and_instance_id_sorted_by_x_;
   std::vector<std::vector<std::pair<double, InstanceId>>>
       x_and_instance_id_sorted_by_x_by_row_height_;
   std::vector<std::vector<InstanceId>> illegal_instance_ids_by_row_height_;
+  // Placed and fixed instances covering each row, and the index of each
+  // sub-instance in its row, for ResolveEdgeSpacingConstraint.
+  std::vector<std::vector<InstanceId>> instance_ids_sorted_by_x_by_row_;
+  std::vector<int> sorted_idx_by_sub_instance_id_;
+  SiteOccupancyMap site_occupancy_map_;
+  int num_bin_rows_;
+  int num_bin_columns_;
+  std::vector<Bin> bins_;
+  std::vector<double> free_area_by_bin_;
+  int num_window_rows_;
+  int num_window_sites_;
+  int num_window_columns_;
+  // Set by the window owning the instance, so a char rather than a bit.
+  std::vector<char> is_placed_in_window_by_instance_id_;
+  // Scratch of TryPlaceInstance, reused across calls. An instance's entries
+  // are valid while its index matches the current call or pop.
+  int push_call_idx_;
+  int push_pop_idx_;
+  std::vector<int> push_call_idx_by_instance_id_;
+  std::vector<int> push_pop_idx_by_instance_id_;
+  std::vector<double> push_reference_x_by_instance_id_;
+  std::vector<std::pair<InstanceId, double>> push_stack_;
+  // (action, instance, x) in the order applied, x being the old x of a MOVE
+  // and the x of the sites of a FILL or CLEAR.
+  std::vector<std::tuple<PushAction, InstanceId, double>> push_journal_;
 };
 
 #endif
@@ -0,0 +1,639 @@
+#include "mmsim_solver.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+using Index = Eigen::Index;
+
+const double MAX_INNER_TOLERANCE = 1e-4;
+const double MIN_INNER_TOLERANCE = 1e-12;
+const int MAX_INNER_ITERATIONS = 1000;
+// Iterations allowed, in multiples of MAX_INNER_ITERATIONS, when a stalled
+// inner solve is extended.
+const int NUM_INNER_RETRIES = 4;
+const int GMRES_RESTART = 30;
+
+MmsimSolver::MmsimSolver()
+    : linear_solver_(MmsimLinearSolver::BLOCK_TRIANGULAR),
+      precision_(MmsimPrecision::DOUBLE),
+      block_triangular_solver_(),
+      lu_solver_(),
+      M_plus_I_(),
+      bicgstab_solver_(),
+      block_jacobi_preconditioner_(),
+      gmres_solver_(),
+      row_scales_(),
+      previous_s_(),
+      inner_tolerance_(0.0),
+      row_offsets_(),
+      col_indices_(),
+      N_values_(),
+      I_minus_A_values_(),
+      gamma_multiply_q_(),
+      rhs_(),
+      abs_s_(),
+      s_(),
+      z_(),
+      gamma_(1.0),
+      epsilon_(0.0),
+      num_checked_variables_(0),
+      num_iterations_(0),
+      num_failed_inner_solves_(0),
+      is_converged_(false),
+      is_single_precision_(false),
+      single_block_triangular_solver_(),
+      single_N_values_(),
+      single_I_minus_A_values_(),
+      single_gamma_multiply_q_(),
+      single_rhs_(),
+      single_abs_s_(),
+      single_s_(),
+      freeze_iterations_(0),
+      is_active_set_shrunk_(false),
+      num_upper_variables_(0),
+      num_stable_iterations_(),
+      is_frozen_(),
+      active_block_indices_(),
+      active_lower_row_indices_(),
+      active_row_indices_(),
+      active_row_offsets_(),
+      active_col_indices_(),
+      active_N_values_(),
+      active_I_minus_A_values_(),
+      active_constant_rhs_() {
+}
+
+// Getters
+
+const Vector& MmsimSolver::z() const {
+  return z_;
+}
+
+int MmsimSolver::num_iterations() const {
+  return num_iterations_;
+}
+
+int MmsimSolver::num_failed_inner_solves() const {
+  return num_failed_inner_solves_;
+}
+
+bool MmsimSolver::is_converged() const {
+  return is_converged_;
+}
+
+// Setters
+
+void MmsimSolver::set_freeze_iterations(int freeze_iterations) {
+  assert(freeze_iterations >= 0);
+
+  freeze_iterations_ = freeze_iterations;
+}
+
+void MmsimSolver::set_linear_solver(MmsimLinearSolver linear_solver) {
+  linear_solver_ = linear_solver;
+}
+
+void MmsimSolver::set_precision(MmsimPrecision precision) {
+  precision_ = precision;
+}
+
+void MmsimSolver::Initialize(const SparseMatrix& F, const SparseMatrix& B,
+                             const SparseMatrix& D, double beta, double theta,
+                             const Vector& q, const Vector& initial_z,
+                             int num_checked_variables, double gamma,
+                             double epsilon) {
+  assert(F.rows() == F.cols() && B.cols() == F.rows());
+  assert(D.rows() == D.cols() && D.rows() == B.rows());
+  assert(q.rows() == F.rows() + D.rows() && initial_z.rows() == q.rows());
+  assert(num_checked_variables <= q.rows());
+
+  using RowMajorSparseMatrix = Eigen::SparseMatrix<double, Eigen::RowMajor>;
+
+  const SparseMatrix B_T = B.transpose();
+  const Index num_rows = F.rows() + B.rows();
+
+  // N = [(1 / beta - 1) * F, B^T; 0, D / theta]
+
+  vector<Triplet> non_zero_elements;
+  non_zero_elements.reserve(F.nonZeros() + B.nonZeros() + D.nonZeros());
+  AppendMatrixTriplets(F, 0, 0, 1 / beta - 1, non_zero_elements);
+  AppendMatrixTriplets(B_T, 0, F.cols(), 1, non_zero_elements);
+  AppendMatrixTriplets(D, F.rows(), F.cols(), 1 / theta, non_zero_elements);
+
+  RowMajorSparseMatrix N(num_rows, num_rows);
+  N.setFromTriplets(non_zero_elements.begin(), non_zero_elements.end());
+
+  // I - A = [I - F, B^T; -B, I]
+
+  non_zero_elements.clear();
+  non_zero_elements.reserve(num_rows + F.nonZeros() + 2 * B.nonZeros());
+  for (Index i = 0; i < num_rows; ++i) {
+    non_zero_elements.push_back(Triplet(i, i, 1));
+  }
+  AppendMatrixTriplets(F, 0, 0, -1, non_zero_elements);
+  AppendMatrixTriplets(B_T, 0, F.cols(), 1, non_zero_elements);
+  AppendMatrixTriplets(B, F.rows(), 0, -1, non_zero_elements);
+
+  RowMajorSparseMatrix I_minus_A(num_rows, num_rows);
+  I_minus_A.setFromTriplets(non_zero_elements.begin(),
+                            non_zero_elements.end());
+
+  // Merge the two sorted rows of N and I - A.
+
+  row_offsets_.assign(1, 0);
+  col_indices_.clear();
+  N_values_.clear();
+  I_minus_A_values_.clear();
+  row_offsets_.reserve(num_rows + 1);
+  col_indices_.reserve(N.nonZeros() + I_minus_A.nonZeros());
+  N_values_.reserve(N.nonZeros() + I_minus_A.nonZeros());
+  I_minus_A_values_.reserve(N.nonZeros() + I_minus_A.nonZeros());
+
+  for (Index i = 0; i < num_rows; ++i) {
+    RowMajorSparseMatrix::InnerIterator N_it(N, i);
+    RowMajorSparseMatrix::InnerIterator I_minus_A_it(I_minus_A, i);
+
+    while (N_it || I_minus_A_it) {
+      Index col_idx = 0;
+      if (!I_minus_A_it || (N_it && N_it.col() < I_minus_A_it.col())) {
+        col_idx = N_it.col();
+      } else {
+        col_idx = I_minus_A_it.col();
+      }
+
+      double N_value = 0.0;
+      if (N_it && N_it.col() == col_idx) {
+        N_value = N_it.value();
+        ++N_it;
+      }
+
+      double I_minus_A_value = 0.0;
+      if (I_minus_A_it && I_minus_A_it.col() == col_idx) {
+        I_minus_A_value = I_minus_A_it.value();
+        ++I_minus_A_it;
+      }
+
+      col_indices_.push_back(col_idx);
+      N_values_.push_back(N_value);
+      I_minus_A_values_.push_back(I_minus_A_value);
+    }
+
+    row_offsets_.push_back(col_indices_.size());
+  }
+
+  gamma_multiply_q_ = gamma * q;
+  rhs_ = Vector::Zero(q.rows());
+  s_ = Vector::Zero(q.rows());
+  z_ = initial_z;
+  gamma_ = gamma;
+  epsilon_ = epsilon;
+  num_checked_variables_ = num_checked_variables;
+  num_iterations_ = 0;
+  num_failed_inner_solves_ = 0;
+  is_converged_ = false;
+
+  if (linear_solver_ == MmsimLinearSolver::BLOCK_TRIANGULAR) {
+    block_triangular_solver_.Compute(
+        (1 / beta) * F + MakeIdentityMatrix(F.rows()), B,
+        (1 / theta) * D + MakeIdentityMatrix(D.rows()));
+  } else {
+    // M + I = [F / beta + I, 0; B, D / theta + I]
+
+    non_zero_elements.clear();
+    non_zero_elements.reserve(num_rows + F.nonZeros() + B.nonZeros() +
+                              D.nonZeros());
+    for (Index i = 0; i < num_rows; ++i) {
+      non_zero_elements.push_back(Triplet(i, i, 1));
+    }
+    AppendMatrixTriplets(F, 0, 0, 1 / beta, non_zero_elements);
+    AppendMatrixTriplets(B, F.rows(), 0, 1, non_zero_elements);
+    AppendMatrixTriplets(D, F.rows(), F.cols(), 1 / theta, non_zero_elements);
+
+    M_plus_I_.resize(num_rows, num_rows);
+    M_plus_I_.setFromTriplets(non_zero_elements.begin(),
+                              non_zero_elements.end());
+
+    // Equilibrate rows by the diagonal. Otherwise the residual of iterative
+    // solvers is dominated by the heavily weighted interval end rows.
+
+    row_scales_ = M_plus_I_.diagonal().cwiseInverse();
+    M_plus_I_ = row_scales_.asDiagonal() * M_plus_I_;
+
+    previous_s_ = Vector::Zero(num_rows);
+    inner_tolerance_ = MAX_INNER_TOLERANCE;
+  }
+
+  switch (linear_solver_) {
+    case MmsimLinearSolver::BLOCK_TRIANGULAR:
+      break;
+    case MmsimLinearSolver::LU:
+      lu_solver_.compute(SparseMatrix(M_plus_I_));
+      assert(lu_solver_.info() == Eigen::Success);
+      break;
+    case MmsimLinearSolver::BICGSTAB:
+      bicgstab_solver_.preconditioner().set_num_upper_rows(F.rows());
+      bicgstab_solver_.compute(M_plus_I_);
+      break;
+    case MmsimLinearSolver::GMRES:
+      block_jacobi_preconditioner_.set_num_upper_rows(F.rows());
+      block_jacobi_preconditioner_.compute(M_plus_I_);
+      gmres_solver_.Initialize(num_rows, GMRES_RESTART);
+      break;
+  }
+
+  // Factors are rounded from the double ones, so both precisions iterate on
+  // the same splitting.
+
+  is_single_precision_ =
+      precision_ == MmsimPrecision::MIXED &&
+      linear_solver_ == MmsimLinearSolver::BLOCK_TRIANGULAR;
+
+  if (is_single_precision_) {
+    single_block_triangular_solver_.Compute(block_triangular_solver_);
+    single_N_values_.assign(N_values_.begin(), N_values_.end());
+    single_I_minus_A_values_.assign(I_minus_A_values_.begin(),
+                                    I_minus_A_values_.end());
+    single_gamma_multiply_q_ = gamma_multiply_q_.cast<float>();
+    single_rhs_ = Eigen::VectorXf::Zero(num_rows);
+    single_s_ = Eigen::VectorXf::Zero(num_rows);
+  }
+
+  num_upper_variables_ = F.rows();
+  ResetActiveSet();
+}
+
+void MmsimSolver::set_q(int idx, double q) {
+  gamma_multiply_q_(idx) = gamma_ * q;
+
+  if (is_single_precision_) {
+    single_gamma_multiply_q_(idx) = gamma_multiply_q_(idx);
+  }
+}
+
+void MmsimSolver::Restart() {
+  num_iterations_ = 0;
+  num_failed_inner_solves_ = 0;
+  is_converged_ = false;
+  inner_tolerance_ = MAX_INNER_TOLERANCE;
+
+  ResetActiveSet();
+}
+
+void MmsimSolver::Iterate() {
+  if (is_single_precision_) {
+    IterateSingle();
+  } else if (is_active_set_shrunk_) {
+    IterateActive();
+  } else {
+    IterateAll();
+  }
+
+  ++num_iterations_;
+
+  // Shrink every freeze_iterations_ iterations so that the rebuild cost is
+  // amortized.
+  if (freeze_iterations_ > 0 &&
+      linear_solver_ == MmsimLinearSolver::BLOCK_TRIANGULAR &&
+      !is_single_precision_ && !is_converged_ &&
+      num_iterations_ % freeze_iterations_ == 0) {
+    ShrinkActiveSet();
+  }
+}
+
+// Private members
+
+void MmsimSolver::ResetActiveSet() {
+  is_active_set_shrunk_ = false;
+
+  if (freeze_iterations_ == 0 ||
+      linear_solver_ != MmsimLinearSolver::BLOCK_TRIANGULAR) {
+    return;
+  }
+
+  const int num_rows = s_.rows();
+
+  num_stable_iterations_.assign(num_rows, 0);
+  is_frozen_.assign(num_rows, false);
+
+  active_block_indices_.clear();
+  for (int i = 0; i < block_triangular_solver_.num_blocks(); ++i) {
+    active_block_indices_.push_back(i);
+  }
+  active_lower_row_indices_.clear();
+  for (int i = num_upper_variables_; i < num_rows; ++i) {
+    active_lower_row_indices_.push_back(i - num_upper_variables_);
+  }
+  active_row_indices_.clear();
+  for (int i = 0; i < num_rows; ++i) {
+    active_row_indices_.push_back(i);
+  }
+}
+
+template <typename Scalar>
+void MmsimSolver::ComputeRhs(
+    const vector<Scalar>& N_values, const vector<Scalar>& I_minus_A_values,
+    const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& gamma_q,
+    const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& s,
+    Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& abs_s,
+    Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& rhs) const {
+  const int num_rows = s.rows();
+
+  abs_s = s.array().abs();
+  rhs = -gamma_q;
+
+  const Scalar* s_data = s.data();
+  const Scalar* abs_s_data = abs_s.data();
+  const Scalar* N_data = N_values.data();
+  const Scalar* I_minus_A_data = I_minus_A_values.data();
+  const int* col_index_data = col_indices_.data();
+
+  for (int i = 0; i < num_rows; ++i) {
+    Scalar value = 0;
+
+#pragma omp simd reduction(+ : value)
+    for (int k = row_offsets_[i]; k < row_offsets_[i + 1]; ++k) {
+      value += N_data[k] * s_data[col_index_data[k]] +
+               I_minus_A_data[k] * abs_s_data[col_index_data[k]];
+    }
+
+    rhs(i) += value;
+  }
+}
+
+template <typename Scalar>
+void MmsimSolver::UpdateZ(const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& s) {
+  const int num_rows = s.rows();
+
+  // Once a checked entry is found to still move, the rest are updated without
+  // checking.
+
+  const double inverse_gamma = 1 / gamma_;
+
+  is_converged_ = true;
+
+  int i = 0;
+  for (; i < num_checked_variables_ && is_converged_; ++i) {
+    const double z_i = inverse_gamma * (abs(s(i)) + s(i));
+
+    is_converged_ = abs(z_i - z_(i)) < epsilon_;
+    z_(i) = z_i;
+  }
+  for (; i < num_rows; ++i) {
+    z_(i) = inverse_gamma * (abs(s(i)) + s(i));
+  }
+}
+
+void MmsimSolver::IterateSingle() {
+  ComputeRhs(single_N_values_, single_I_minus_A_values_,
+             single_gamma_multiply_q_, single_s_, single_abs_s_,
+             single_rhs_);
+  single_block_triangular_solver_.Solve(single_rhs_, single_s_);
+  UpdateZ(single_s_);
+
+  if (!is_converged_) {
+    return;
+  }
+
+  // Refine in double from the single precision solution.
+
+  s_ = single_s_.cast<double>();
+  is_single_precision_ = false;
+  is_converged_ = false;
+
+  single_block_triangular_solver_ = BlockTriangularSolver<float>();
+  vector<float>().swap(single_N_values_);
+  vector<float>().swap(single_I_minus_A_values_);
+  single_gamma_multiply_q_.resize(0);
+  single_rhs_.resize(0);
+  single_abs_s_.resize(0);
+  single_s_.resize(0);
+}
+
+void MmsimSolver::IterateAll() {
+  ComputeRhs(N_values_, I_minus_A_values_, gamma_multiply_q_, s_, abs_s_,
+             rhs_);
+  SolveLinearSystem();
+
+  if (freeze_iterations_ > 0) {
+    is_converged_ = true;
+    for (int i = 0; i < s_.rows(); ++i) {
+      UpdateTrackedZ(i);
+    }
+
+    return;
+  }
+
+  UpdateZ(s_);
+}
+
+void MmsimSolver::SolveLinearSystem() {
+  if (linear_solver_ == MmsimLinearSolver::BLOCK_TRIANGULAR) {
+    block_triangular_solver_.Solve(rhs_, s_);
+
+    return;
+  }
+
+  rhs_ = rhs_.cwiseProduct(row_scales_);
+
+  if (linear_solver_ == MmsimLinearSolver::LU) {
+    s_ = lu_solver_.solve(rhs_);
+
+    return;
+  }
+
+  previous_s_ = s_;
+
+  // A solve that runs out of iterations continues from where it stopped with
+  // a larger budget. If that fails too, the better of its iterate and the
+  // previous s is kept and the failure is counted.
+
+  bool is_solved = SolveIteratively(MAX_INNER_ITERATIONS);
+  if (!is_solved) {
+    is_solved = SolveIteratively(NUM_INNER_RETRIES * MAX_INNER_ITERATIONS);
+  }
+
+  if (!is_solved) {
+    ++num_failed_inner_solves_;
+
+    if ((rhs_ - M_plus_I_ * previous_s_).norm() <
+        (rhs_ - M_plus_I_ * s_).norm()) {
+      s_ = previous_s_;
+    }
+  }
+
+  // Solve the next system a magnitude more accurately than the outer
+  // iteration is currently moving.
+
+  const double s_norm = s_.norm();
+  if (s_norm > 0.0) {
+    inner_tolerance_ =
+        max(MIN_INNER_TOLERANCE,
+            min(MAX_INNER_TOLERANCE, 0.1 * (s_ - previous_s_).norm() / s_norm));
+  }
+}
+
+bool MmsimSolver::SolveIteratively(int max_num_iterations) {
+  if (linear_solver_ == MmsimLinearSolver::BICGSTAB) {
+    bicgstab_solver_.setTolerance(inner_tolerance_);
+    bicgstab_solver_.setMaxIterations(max_num_iterations);
+    s_ = bicgstab_solver_.solveWithGuess(rhs_, s_);
+
+    return bicgstab_solver_.info() == Eigen::Success;
+  }
+
+  return gmres_solver_.Solve(M_plus_I_, block_jacobi_preconditioner_, rhs_, s_,
+                             inner_tolerance_, max_num_iterations);
+}
+
+void MmsimSolver::IterateActive() {
+  const int num_active_rows = active_row_indices_.size();
+  const double* s = s_.data();
+
+  for (int j = 0; j < num_active_rows; ++j) {
+    double value = active_constant_rhs_[j];
+    for (int k = active_row_offsets_[j]; k < active_row_offsets_[j + 1];
+         ++k) {
+      const double s_k = s[active_col_indices_[k]];
+
+      value +=
+          active_N_values_[k] * s_k + active_I_minus_A_values_[k] * abs(s_k);
+    }
+
+    rhs_(active_row_indices_[j]) = value;
+  }
+
+  block_triangular_solver_.SolveActive(rhs_, active_block_indices_,
+                                       active_lower_row_indices_, s_);
+
+  is_converged_ = true;
+  for (int i : active_row_indices_) {
+    UpdateTrackedZ(i);
+  }
+}
+
+void MmsimSolver::UpdateTrackedZ(int variable_idx) {
+  const double z_i = (1 / gamma_) * (abs(s_(variable_idx)) + s_(variable_idx));
+  const bool is_stable = abs(z_i - z_(variable_idx)) < epsilon_;
+
+  if (variable_idx < num_checked_variables_ && !is_stable) {
+    is_converged_ = false;
+  }
+
+  num_stable_iterations_[variable_idx] =
+      is_stable ? num_stable_iterations_[variable_idx] + 1 : 0;
+  z_(variable_idx) = z_i;
+}
+
+void MmsimSolver::ShrinkActiveSet() {
+  const int num_previous_active_rows = active_row_indices_.size();
+
+  // Rebuilding only pays off if a good part of the active set can go.
+
+  int num_stable_rows = 0;
+  for (int i : active_row_indices_) {
+    if (num_stable_iterations_[i] >= freeze_iterations_) {
+      ++num_stable_rows;
+    }
+  }
+
+  if (4 * num_stable_rows < num_previous_active_rows) {
+    return;
+  }
+
+  int num_active_blocks = 0;
+  for (int block_idx : active_block_indices_) {
+    const int block_size = block_triangular_solver_.block_size(block_idx);
+
+    bool is_stable = true;
+    for (int j = 0; j < block_size && is_stable; ++j) {
+      const int variable_idx =
+          block_triangular_solver_.block_variable_idx(block_idx, j);
+
+      is_stable = num_stable_iterations_[variable_idx] >= freeze_iterations_;
+    }
+
+    if (is_stable) {
+      for (int j = 0; j < block_size; ++j) {
+        is_frozen_[block_triangular_solver_.block_variable_idx(block_idx, j)] =
+            true;
+      }
+    } else {
+      active_block_indices_[num_active_blocks++] = block_idx;
+    }
+  }
+  active_block_indices_.resize(num_active_blocks);
+
+  int num_active_lower_rows = 0;
+  for (int lower_row_idx : active_lower_row_indices_) {
+    const int row_idx = num_upper_variables_ + lower_row_idx;
+
+    bool is_stable = num_stable_iterations_[row_idx] >= freeze_iterations_;
+    for (int k = row_offsets_[row_idx];
+         k < row_offsets_[row_idx + 1] && is_stable; ++k) {
+      if (col_indices_[k] < num_upper_variables_) {
+        is_stable = is_frozen_[col_indices_[k]];
+      }
+    }
+
+    if (is_stable) {
+      is_frozen_[row_idx] = true;
+    } else {
+      active_lower_row_indices_[num_active_lower_rows++] = lower_row_idx;
+    }
+  }
+  active_lower_row_indices_.resize(num_active_lower_rows);
+
+  int num_active_rows = 0;
+  for (int i : active_row_indices_) {
+    if (!is_frozen_[i]) {
+      ++num_active_rows;
+    }
+  }
+
+  if (num_active_rows < num_previous_active_rows) {
+    BuildActiveRows();
+
+    is_active_set_shrunk_ = true;
+  }
+}
+
+void MmsimSolver::BuildActiveRows() {
+  const int num_rows = s_.rows();
+  const double* s = s_.data();
+
+  active_row_indices_.clear();
+  for (int i = 0; i < num_rows; ++i) {
+    if (!is_frozen_[i]) {
+      active_row_indices_.push_back(i);
+    }
+  }
+
+  active_row_offsets_.assign(1, 0);
+  active_col_indices_.clear();
+  active_N_values_.clear();
+  active_I_minus_A_values_.clear();
+  active_constant_rhs_.clear();
+
+  for (int i : active_row_indices_) {
+    double constant_rhs = -gamma_multiply_q_(i);
+    for (int k = row_offsets_[i]; k < row_offsets_[i + 1]; ++k) {
+      const int col_idx = col_indices_[k];
+
+      if (is_frozen_[col_idx]) {
+        constant_rhs +=
+            N_values_[k] * s[col_idx] + I_minus_A_values_[k] * abs(s[col_idx]);
+      } else {
+        active_col_indices_.push_back(col_idx);
+        active_N_values_.push_back(N_values_[k]);
+        active_I_minus_A_values_.push_back(I_minus_A_values_[k]);
+      }
+    }
+
+    active_constant_rhs_.push_back(constant_rhs);
+    active_row_offsets_.push_back(active_col_indices_.size());
+  }
+}
@@ -0,0 +1,184 @@
+#ifndef MMSIM_SOLVER_HPP
+#define MMSIM_SOLVER_HPP
+
+#include "block_jacobi_preconditioner.hpp"
+#include "block_triangular_solver.hpp"
+#include "gmres.hpp"
+#include "sparse_matrix.hpp"
+#include "vector.hpp"
+
+#include <Eigen/IterativeLinearSolvers>
+#include <Eigen/SparseLU>
+
+#include <vector>
+
+// Modulus-based matrix splitting iteration method (MMSIM) for the linear
+// complementarity problem
+//
+//   w = Az + q >= 0, z >= 0, z^T w = 0
+//
+// where
+//
+//   A = [F, -B^T]
+//       [B,    0]
+//
+// is split into A = M - N with
+//
+//   M = [F / beta,         0]    N = [(1 / beta - 1) * F, B^T      ]
+//       [B,        D / theta]        [0,                  D / theta]
+//
+// and D tridiagonal. Each iteration solves
+//
+//   (M + I)s' = Ns + (I - A)|s| - gamma * q
+//
+// and sets z = (|s'| + s') / gamma. M + I is lower block triangular, so it is
+// factorized by BlockTriangularSolver. N and I - A are stored fused, with
+// both values of a nonzero side by side, so the right-hand side is computed in
+// one pass and an iteration allocates nothing.
+//
+// M + I can instead be solved by a general sparse LU or by preconditioned
+// BiCGSTAB or GMRES.
+
+// Solver of the linear system (M + I)s' = ... in each iteration.
+enum class MmsimLinearSolver { BLOCK_TRIANGULAR, LU, BICGSTAB, GMRES };
+
+// Precision of the iteration. MIXED iterates in float until converged and then
+// refines the solution in double. The double data is kept for the refinement,
+// so MIXED halves the memory traffic of the float iterations but adds to the
+// peak memory.
+enum class MmsimPrecision { DOUBLE, MIXED };
+
+class MmsimSolver {
+ public:
+  MmsimSolver();
+
+  // Getters
+
+  const Vector& z() const;
+  int num_iterations() const;
+  // Inner solves of BICGSTAB or GMRES that missed their tolerance even when
+  // extended. s then stays at the better of the last iterate and the
+  // previous s.
+  int num_failed_inner_solves() const;
+  // True if no checked entry of z moved more than epsilon in the last
+  // iteration.
+  bool is_converged() const;
+
+  // Setters
+
+  // Freeze variables whose z has been stable for the given number of
+  // iterations, 0 to disable. Frozen variables keep their value and only the
+  // rest of the system is iterated. Only BLOCK_TRIANGULAR supports it. Must
+  // be set before Initialize.
+  void set_freeze_iterations(int freeze_iterations);
+  // Must be set before Initialize.
+  void set_linear_solver(MmsimLinearSolver linear_solver);
+  // Only BLOCK_TRIANGULAR supports MIXED. Must be set before Initialize.
+  void set_precision(MmsimPrecision precision);
+
+  // Factorize M + I and restart from s = 0 and z = initial_z. Only the first
+  // num_checked_variables entries of z are checked for convergence.
+  void Initialize(const SparseMatrix& F, const SparseMatrix& B,
+                  const SparseMatrix& D, double beta, double theta,
+                  const Vector& q, const Vector& initial_z,
+                  int num_checked_variables, double gamma, double epsilon);
+
+  // Replace entry idx of q. M + I stays factorized, only the right-hand side
+  // of later iterations changes.
+  void set_q(int idx, double q);
+  // Resume iterating from the current s, e.g. after q changed. Frozen
+  // variables are thawed.
+  void Restart();
+
+  void Iterate();
+
+ private:
+  void ResetActiveSet();
+  // rhs = N * s + (I - A) * |s| - gamma * q over the fused values. |s| and
+  // the dense part are vectorised array expressions, abs_s is scratch.
+  template <typename Scalar>
+  void ComputeRhs(const std::vector<Scalar>& N_values,
+                  const std::vector<Scalar>& I_minus_A_values,
+                  const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& gamma_q,
+                  const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& s,
+                  Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& abs_s,
+                  Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& rhs) const;
+  // z = (|s| + s) / gamma, checking convergence.
+  template <typename Scalar>
+  void UpdateZ(const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>& s);
+  void IterateSingle();
+  void IterateAll();
+  // Solve (M + I)s = rhs. Iterative solvers start from the previous s and
+  // tighten their tolerance as the outer iteration settles.
+  void SolveLinearSystem();
+  // Continue the BiCGSTAB or GMRES solve from s, return false if it misses
+  // the tolerance.
+  bool SolveIteratively(int max_num_iterations);
+  void IterateActive();
+  void UpdateTrackedZ(int variable_idx);
+  // Freeze diagonal blocks of F whose variables are all stable, then
+  // constraint rows that are stable and only involve frozen variables.
+  void ShrinkActiveSet();
+  // Rebuild the rows of the active variables with the contribution of frozen
+  // variables folded into a constant.
+  void BuildActiveRows();
+
+  MmsimLinearSolver linear_solver_;
+  MmsimPrecision precision_;
+  BlockTriangularSolver<double> block_triangular_solver_;
+  Eigen::SparseLU<SparseMatrix> lu_solver_;
+  Eigen::SparseMatrix<double, Eigen::RowMajor> M_plus_I_;
+  Eigen::BiCGSTAB<Eigen::SparseMatrix<double, Eigen::RowMajor>,
+                  BlockJacobiPreconditioner>
+      bicgstab_solver_;
+  BlockJacobiPreconditioner block_jacobi_preconditioner_;
+  GmresSolver gmres_solver_;
+  Vector row_scales_;
+  Vector previous_s_;
+  double inner_tolerance_;
+  // Union of the nonzero patterns of N and I - A in compressed row form.
+  std::vector<int> row_offsets_;
+  std::vector<int> col_indices_;
+  std::vector<double> N_values_;
+  std::vector<double> I_minus_A_values_;
+  Vector gamma_multiply_q_;
+  Vector rhs_;
+  Vector abs_s_;
+  Vector s_;
+  Vector z_;
+  double gamma_;
+  double epsilon_;
+  int num_checked_variables_;
+  int num_iterations_;
+  int num_failed_inner_solves_;
+  bool is_converged_;
+
+  // Float copies of the factors, the fused values, q and s while iterating in
+  // single precision. Released when the refinement in double starts.
+  bool is_single_precision_;
+  BlockTriangularSolver<float> single_block_triangular_solver_;
+  std::vector<float> single_N_values_;
+  std::vector<float> single_I_minus_A_values_;
+  Eigen::VectorXf single_gamma_multiply_q_;
+  Eigen::VectorXf single_rhs_;
+  Eigen::VectorXf single_abs_s_;
+  Eigen::VectorXf single_s_;
+
+  // Active set. Frozen variables keep their s and z. Until the first shrink
+  // all rows are active and IterateAll is used.
+  int freeze_iterations_;
+  bool is_active_set_shrunk_;
+  int num_upper_variables_;
+  std::vector<int> num_stable_iterations_;
+  std::vector<bool> is_frozen_;
+  std::vector<int> active_block_indices_;
+  std::vector<int> active_lower_row_indices_;
+  std::vector<int> active_row_indices_;
+  std::vector<int> active_row_offsets_;
+  std::vector<int> active_col_indices_;
+  std::vector<double> active_N_values_;
+  std::vector<double> active_I_minus_A_values_;
+  std::vector<double> active_constant_rhs_;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include "sat_result_reader.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+using namespace std;
+
+static bool IsBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* SkipBlanks(const char* begin, const char* end) {
+  while (begin != end && IsBlank(*begin)) {
+    ++begin;
+  }
+
+  return begin;
+}
+
+// Whether the line from begin, trailing blanks aside, is the word.
+static bool IsWord(const char* begin, const char* end, const char* word) {
+  const int word_length = strlen(word);
+
+  while (end != begin && IsBlank(*(end - 1))) {
+    --end;
+  }
+
+  return end - begin == word_length && memcmp(begin, word, word_length) == 0;
+}
+
+SatResultReader::SatResultReader(Database& database)
+    : database_(database), line_idx_(0), error_() {
+}
+
+bool SatResultReader::Read(const string& file_name) {
+  error_.clear();
+  line_idx_ = 0;
+
+  const int file_descriptor = open(file_name.c_str(), O_RDONLY);
+
+  if (file_descriptor < 0) {
+    error_ = "cannot open " + file_name;
+
+    return false;
+  }
+
+  struct stat file_status;
+  const char* data = nullptr;
+  size_t data_size = 0;
+
+  if (fstat(file_descriptor, &file_status) == 0) {
+    data_size = file_status.st_size;
+  }
+
+  if (data_size > 0) {
+    void* mapping =
+        mmap(nullptr, data_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+
+    if (mapping == MAP_FAILED) {
+      close(file_descriptor);
+      error_ = "cannot map " + file_name;
+
+      return false;
+    }
+
+    madvise(mapping, data_size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(mapping);
+  }
+
+  close(file_descriptor);
+
+  bool is_satisfiable = false;
+  bool has_values = false;
+  const char* data_end = data + data_size;
+
+  for (const char* line = data; line != data_end && error_.empty();) {
+    const char* line_end =
+        static_cast<const char*>(memchr(line, '\n', data_end - line));
+
+    if (line_end == nullptr) {
+      line_end = data_end;
+    }
+
+    ++line_idx_;
+
+    const char* text = SkipBlanks(line, line_end);
+
+    if (text != line_end) {
+      switch (*text) {
+        case 'c':
+        case 'o':
+          break;
+        case 's':
+          if (is_satisfiable) {
+            SetError("second status line");
+          } else {
+            is_satisfiable = ReadStatus(text + 1, line_end);
+          }
+          break;
+        case 'v':
+          if (!is_satisfiable) {
+            SetError("values before the status line");
+          } else {
+            has_values = ReadValues(text + 1, line_end);
+          }
+          break;
+        default:
+          SetError("unknown line type '" + string(1, *text) + "'");
+      }
+    }
+
+    line = (line_end == data_end) ? data_end : line_end + 1;
+  }
+
+  if (data != nullptr) {
+    munmap(const_cast<char*>(data), data_size);
+  }
+
+  if (error_.empty() && !is_satisfiable) {
+    error_ = "no status line";
+  } else if (error_.empty() && !has_values) {
+    error_ = "no value line";
+  }
+
+  if (!error_.empty()) {
+    error_ = file_name + ": " + error_;
+  }
+
+  return error_.empty();
+}
+
+const string& SatResultReader::error() const {
+  return error_;
+}
+
+// Private members
+
+bool SatResultReader::ReadStatus(const char* begin, const char* end) {
+  const char* status = SkipBlanks(begin, end);
+
+  if (IsWord(status, end, "SATISFIABLE") ||
+      IsWord(status, end, "OPTIMUM FOUND")) {
+    return true;
+  }
+
+  if (IsWord(status, end, "UNSATISFIABLE")) {
+    SetError("problem is unsatisfiable");
+  } else {
+    SetError("no model, status '" + string(status, end) + "'");
+  }
+
+  return false;
+}
+
+bool SatResultReader::ReadValues(const char* begin, const char* end) {
+  const char* text = SkipBlanks(begin, end);
+
+  while (text != end) {
+    const bool is_negative = (*text == '-');
+
+    if (is_negative) {
+      ++text;
+    }
+
+    if (text == end || *text < '0' || *text > '9') {
+      SetError("malformed literal");
+
+      return false;
+    }
+
+    long long variable = 0;
+
+    while (text != end && *text >= '0' && *text <= '9') {
+      variable = 10 * variable + (*text - '0');
+      ++text;
+
+      if (variable >= database_.num_variables()) {
+        SetError("unknown variable");
+
+        return false;
+      }
+    }
+
+    if (text != end && !IsBlank(*text)) {
+      SetError("malformed literal");
+
+      return false;
+    }
+
+    // Variable 0 is a placeholder, and literal 0 ends the model.
+    if (!is_negative && variable != 0) {
+      database_.variable((VariableId)variable).selected = true;
+    }
+
+    text = SkipBlanks(text, end);
+  }
+
+  return true;
+}
+
+void SatResultReader::SetError(const string& reason) {
+  error_ = "line " + to_string(line_idx_) + ": " + reason;
+}
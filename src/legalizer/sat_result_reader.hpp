@@ -0,0 +1,38 @@
+#ifndef SAT_RESULT_READER_HPP
+#define SAT_RESULT_READER_HPP
+
+#include "../database/database.hpp"
+
+#include <string>
+
+// Reader of SAT and MaxSAT solver results in the competition format, i.e. an
+// "s" status line followed by "v" lines of DIMACS literals, with "c" comment
+// and "o" cost lines ignored. The file is mapped into memory and scanned once,
+// and every positive literal marks its variable as selected right away.
+
+class SatResultReader {
+ public:
+  explicit SatResultReader(Database& database);
+
+  // Return false, with the reason in error(), if the file cannot be read, is
+  // malformed or has no model. Values come after the status line, so nothing
+  // is selected when the result is UNSAT or unknown.
+  bool Read(const std::string& file_name);
+
+  // Getters
+
+  const std::string& error() const;
+
+ private:
+  // Parse the status line starting at begin, return false if it is not SAT.
+  bool ReadStatus(const char* begin, const char* end);
+  // Parse the literals of the value line starting at begin.
+  bool ReadValues(const char* begin, const char* end);
+  void SetError(const std::string& reason);
+
+  Database& database_;
+  int line_idx_;
+  std::string error_;
+};
+
+#endif
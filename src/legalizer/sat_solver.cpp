@@ -0,0 +1,683 @@
+#include "sat_solver.hpp"
+
+#include "../util/const.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+
+using namespace std;
+
+// Internal literals are 2 * (v - 1) for DIMACS variable v and 2 * (v - 1) + 1
+// for its negation, so that a literal and its negation differ in bit 0.
+
+const double VARIABLE_ACTIVITY_DECAY = 0.95;
+const double CLAUSE_ACTIVITY_DECAY = 0.999;
+const double MAX_ACTIVITY = 1e100;
+const int RESTART_UNIT_CONFLICTS = 100;  // TODO: Tune.
+
+static int ToLiteral(int dimacs_literal) {
+  return 2 * (abs(dimacs_literal) - 1) + (dimacs_literal < 0 ? 1 : 0);
+}
+
+static int ToVariable(int literal) {
+  return literal >> 1;
+}
+
+static bool IsNegative(int literal) {
+  return literal & 1;
+}
+
+// x-th term (from 0) of the Luby sequence 1, 1, 2, 1, 1, 2, 4, 1, ...
+static int ComputeLuby(int x) {
+  int size = 1;
+  int sequence_idx = 0;
+
+  while (size < x + 1) {
+    ++sequence_idx;
+    size = 2 * size + 1;
+  }
+  while (size - 1 != x) {
+    size = (size - 1) / 2;
+    --sequence_idx;
+    x %= size;
+  }
+
+  return 1 << sequence_idx;
+}
+
+SatSolver::SatSolver()
+    : num_variables_(0),
+      num_learnt_clauses_(0),
+      max_num_learnt_clauses_(0),
+      num_conflicts_(0),
+      num_decisions_(0),
+      is_unsatisfiable_(false),
+      clauses_(),
+      watched_clause_indices_by_literal_(),
+      value_by_variable_(),
+      level_by_variable_(),
+      reason_clause_idx_by_variable_(),
+      saved_phase_by_variable_(),
+      is_seen_by_variable_(),
+      trail_(),
+      trail_begin_idx_by_level_(),
+      propagation_idx_(0),
+      activity_by_variable_(),
+      variable_activity_increment_(1.0),
+      clause_activity_increment_(1.0),
+      heap_(),
+      heap_idx_by_variable_(),
+      model_() {
+}
+
+void SatSolver::AddClause(const vector<int>& literals) {
+  AddClause(literals.data(), literals.size());
+}
+
+void SatSolver::AddClause(const int* literals, int num_literals) {
+  assert(decision_level() == 0);
+
+  if (is_unsatisfiable_) {
+    return;
+  }
+
+  vector<int> clause_literals(num_literals);
+
+  for (int i = 0; i < num_literals; ++i) {
+    assert(literals[i] != 0);
+
+    AddVariables(abs(literals[i]));
+    clause_literals[i] = ToLiteral(literals[i]);
+  }
+
+  // Merge duplicates, drop tautologies and clauses already satisfied, and
+  // remove literals already false.
+
+  sort(clause_literals.begin(), clause_literals.end());
+  clause_literals.erase(unique(clause_literals.begin(), clause_literals.end()),
+                        clause_literals.end());
+
+  int num_kept_literals = 0;
+  for (int i = 0; i < clause_literals.size(); ++i) {
+    const int literal = clause_literals[i];
+
+    if ((i > 0 && clause_literals[i - 1] == (literal ^ 1)) ||
+        ComputeLiteralValue(literal) == 1) {
+      return;
+    }
+    if (ComputeLiteralValue(literal) == 0) {
+      clause_literals[num_kept_literals++] = literal;
+    }
+  }
+  clause_literals.resize(num_kept_literals);
+
+  if (clause_literals.empty()) {
+    is_unsatisfiable_ = true;
+
+    return;
+  }
+
+  if (clause_literals.size() == 1) {
+    Enqueue(clause_literals[0], UNDEFINED_ID);
+
+    if (Propagate() != UNDEFINED_ID) {
+      is_unsatisfiable_ = true;
+    }
+
+    return;
+  }
+
+  Clause clause;
+  clause.literals.swap(clause_literals);
+  clause.is_learnt = false;
+  clause.is_deleted = false;
+  clause.activity = 0.0;
+
+  watched_clause_indices_by_literal_[clause.literals[0]].push_back(
+      clauses_.size());
+  watched_clause_indices_by_literal_[clause.literals[1]].push_back(
+      clauses_.size());
+  clauses_.push_back(clause);
+}
+
+SatResult SatSolver::Solve() {
+  model_.clear();
+
+  if (is_unsatisfiable_) {
+    return SatResult::UNSATISFIABLE;
+  }
+
+  if (Propagate() != UNDEFINED_ID) {
+    is_unsatisfiable_ = true;
+
+    return SatResult::UNSATISFIABLE;
+  }
+
+  max_num_learnt_clauses_ = max(num_clauses() / 3, 1000);  // TODO: Tune.
+
+  SatResult result = SatResult::UNKNOWN;
+
+  for (int i = 0; result == SatResult::UNKNOWN; ++i) {
+    result = Search(ComputeLuby(i) * RESTART_UNIT_CONFLICTS);
+  }
+
+  if (result == SatResult::SATISFIABLE) {
+    model_.resize(num_variables_);
+    for (int i = 0; i < num_variables_; ++i) {
+      model_[i] = value_by_variable_[i] == 1;
+    }
+  } else if (result == SatResult::UNSATISFIABLE) {
+    is_unsatisfiable_ = true;
+  }
+
+  CancelUntil(0);
+
+  return result;
+}
+
+// Getters
+
+int SatSolver::num_variables() const {
+  return num_variables_;
+}
+
+int SatSolver::num_clauses() const {
+  return clauses_.size() - num_learnt_clauses_;
+}
+
+int SatSolver::num_conflicts() const {
+  return num_conflicts_;
+}
+
+int SatSolver::num_decisions() const {
+  return num_decisions_;
+}
+
+bool SatSolver::value(int variable) const {
+  assert(variable >= 1 && variable <= model_.size());
+
+  return model_[variable - 1];
+}
+
+// Private members
+
+void SatSolver::AddVariables(int num_variables) {
+  if (num_variables <= num_variables_) {
+    return;
+  }
+
+  watched_clause_indices_by_literal_.resize(2 * num_variables);
+  value_by_variable_.resize(num_variables, 0);
+  level_by_variable_.resize(num_variables, 0);
+  reason_clause_idx_by_variable_.resize(num_variables, UNDEFINED_ID);
+  saved_phase_by_variable_.resize(num_variables, false);
+  is_seen_by_variable_.resize(num_variables, false);
+  activity_by_variable_.resize(num_variables, 0.0);
+  heap_idx_by_variable_.resize(num_variables, UNDEFINED_ID);
+
+  for (int i = num_variables_; i < num_variables; ++i) {
+    InsertVariableIntoHeap(i);
+  }
+
+  num_variables_ = num_variables;
+}
+
+signed char SatSolver::ComputeLiteralValue(int literal) const {
+  const signed char value = value_by_variable_[ToVariable(literal)];
+
+  return IsNegative(literal) ? -value : value;
+}
+
+int SatSolver::decision_level() const {
+  return trail_begin_idx_by_level_.size();
+}
+
+void SatSolver::Enqueue(int literal, int reason_clause_idx) {
+  const int variable = ToVariable(literal);
+
+  assert(value_by_variable_[variable] == 0);
+
+  value_by_variable_[variable] = IsNegative(literal) ? -1 : 1;
+  level_by_variable_[variable] = decision_level();
+  reason_clause_idx_by_variable_[variable] = reason_clause_idx;
+  trail_.push_back(literal);
+}
+
+int SatSolver::Propagate() {
+  while (propagation_idx_ < trail_.size()) {
+    const int false_literal = trail_[propagation_idx_++] ^ 1;
+    vector<int>& clause_indices =
+        watched_clause_indices_by_literal_[false_literal];
+
+    int num_kept_clauses = 0;
+    for (int i = 0; i < clause_indices.size(); ++i) {
+      const int clause_idx = clause_indices[i];
+      Clause& clause = clauses_[clause_idx];
+
+      // Watches of deleted clauses are dropped lazily.
+      if (clause.is_deleted) {
+        continue;
+      }
+
+      vector<int>& literals = clause.literals;
+
+      if (literals[0] == false_literal) {
+        swap(literals[0], literals[1]);
+      }
+
+      if (ComputeLiteralValue(literals[0]) == 1) {
+        clause_indices[num_kept_clauses++] = clause_idx;
+
+        continue;
+      }
+
+      bool is_watch_moved = false;
+      for (int j = 2; j < literals.size(); ++j) {
+        if (ComputeLiteralValue(literals[j]) != -1) {
+          swap(literals[1], literals[j]);
+          watched_clause_indices_by_literal_[literals[1]].push_back(
+              clause_idx);
+          is_watch_moved = true;
+
+          break;
+        }
+      }
+
+      if (is_watch_moved) {
+        continue;
+      }
+
+      clause_indices[num_kept_clauses++] = clause_idx;
+
+      if (ComputeLiteralValue(literals[0]) == -1) {
+        for (int j = i + 1; j < clause_indices.size(); ++j) {
+          clause_indices[num_kept_clauses++] = clause_indices[j];
+        }
+        clause_indices.resize(num_kept_clauses);
+        propagation_idx_ = trail_.size();
+
+        return clause_idx;
+      }
+
+      Enqueue(literals[0], clause_idx);
+    }
+
+    clause_indices.resize(num_kept_clauses);
+  }
+
+  return UNDEFINED_ID;
+}
+
+void SatSolver::Analyze(int conflict_clause_idx, vector<int>& learnt_literals,
+                        int& backjump_level) {
+  learnt_literals.assign(1, UNDEFINED_ID);
+
+  // Resolve the conflict clause with the reasons of the literals of the
+  // current level, latest first, until one of them is left.
+
+  int num_current_level_literals = 0;
+  int literal = UNDEFINED_ID;
+  int trail_idx = trail_.size() - 1;
+  int clause_idx = conflict_clause_idx;
+
+  do {
+    assert(clause_idx != UNDEFINED_ID);
+
+    if (clauses_[clause_idx].is_learnt) {
+      BumpClause(clause_idx);
+    }
+
+    const vector<int>& literals = clauses_[clause_idx].literals;
+
+    for (int i = (literal == UNDEFINED_ID) ? 0 : 1; i < literals.size(); ++i) {
+      const int variable = ToVariable(literals[i]);
+
+      if (is_seen_by_variable_[variable] || level_by_variable_[variable] == 0) {
+        continue;
+      }
+
+      BumpVariable(variable);
+      is_seen_by_variable_[variable] = true;
+
+      if (level_by_variable_[variable] == decision_level()) {
+        ++num_current_level_literals;
+      } else {
+        learnt_literals.push_back(literals[i]);
+      }
+    }
+
+    while (!is_seen_by_variable_[ToVariable(trail_[trail_idx])]) {
+      --trail_idx;
+    }
+
+    literal = trail_[trail_idx--];
+    clause_idx = reason_clause_idx_by_variable_[ToVariable(literal)];
+    is_seen_by_variable_[ToVariable(literal)] = false;
+    --num_current_level_literals;
+  } while (num_current_level_literals > 0);
+
+  learnt_literals[0] = literal ^ 1;
+
+  // Drop literals implied by the rest. The seen marks of all of them are
+  // needed until the end.
+
+  const vector<int> seen_literals(learnt_literals.begin() + 1,
+                                  learnt_literals.end());
+
+  int num_literals = 1;
+  for (int i = 1; i < learnt_literals.size(); ++i) {
+    if (!IsLiteralRedundant(learnt_literals[i])) {
+      learnt_literals[num_literals++] = learnt_literals[i];
+    }
+  }
+  learnt_literals.resize(num_literals);
+
+  for (int seen_literal : seen_literals) {
+    is_seen_by_variable_[ToVariable(seen_literal)] = false;
+  }
+
+  // Watch a literal of the highest level besides the asserting one, so the
+  // clause is unit right after backjumping.
+
+  backjump_level = 0;
+  if (learnt_literals.size() > 1) {
+    int max_level_idx = 1;
+    for (int i = 2; i < learnt_literals.size(); ++i) {
+      if (level_by_variable_[ToVariable(learnt_literals[i])] >
+          level_by_variable_[ToVariable(learnt_literals[max_level_idx])]) {
+        max_level_idx = i;
+      }
+    }
+
+    swap(learnt_literals[1], learnt_literals[max_level_idx]);
+    backjump_level = level_by_variable_[ToVariable(learnt_literals[1])];
+  }
+}
+
+bool SatSolver::IsLiteralRedundant(int literal) const {
+  const int reason_clause_idx =
+      reason_clause_idx_by_variable_[ToVariable(literal)];
+
+  if (reason_clause_idx == UNDEFINED_ID) {
+    return false;
+  }
+
+  const vector<int>& literals = clauses_[reason_clause_idx].literals;
+
+  for (int i = 1; i < literals.size(); ++i) {
+    const int variable = ToVariable(literals[i]);
+
+    if (!is_seen_by_variable_[variable] && level_by_variable_[variable] > 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void SatSolver::CancelUntil(int level) {
+  if (decision_level() <= level) {
+    return;
+  }
+
+  for (int i = trail_.size() - 1; i >= trail_begin_idx_by_level_[level]; --i) {
+    const int variable = ToVariable(trail_[i]);
+
+    saved_phase_by_variable_[variable] = value_by_variable_[variable] == 1;
+    value_by_variable_[variable] = 0;
+    reason_clause_idx_by_variable_[variable] = UNDEFINED_ID;
+
+    if (!IsVariableInHeap(variable)) {
+      InsertVariableIntoHeap(variable);
+    }
+  }
+
+  trail_.resize(trail_begin_idx_by_level_[level]);
+  trail_begin_idx_by_level_.resize(level);
+  propagation_idx_ = trail_.size();
+}
+
+int SatSolver::PickBranchLiteral() {
+  while (!heap_.empty()) {
+    const int variable = PopVariableFromHeap();
+
+    if (value_by_variable_[variable] == 0) {
+      return 2 * variable + (saved_phase_by_variable_[variable] ? 0 : 1);
+    }
+  }
+
+  return UNDEFINED_ID;
+}
+
+int SatSolver::AddLearntClause(const vector<int>& literals) {
+  assert(literals.size() >= 2);
+
+  Clause clause;
+  clause.literals = literals;
+  clause.is_learnt = true;
+  clause.is_deleted = false;
+  clause.activity = 0.0;
+
+  const int clause_idx = clauses_.size();
+
+  watched_clause_indices_by_literal_[literals[0]].push_back(clause_idx);
+  watched_clause_indices_by_literal_[literals[1]].push_back(clause_idx);
+  clauses_.push_back(clause);
+  ++num_learnt_clauses_;
+
+  BumpClause(clause_idx);
+
+  return clause_idx;
+}
+
+void SatSolver::ReduceLearntClauses() {
+  vector<int> learnt_clause_indices;
+  for (int i = 0; i < clauses_.size(); ++i) {
+    if (clauses_[i].is_learnt && !clauses_[i].is_deleted) {
+      learnt_clause_indices.push_back(i);
+    }
+  }
+
+  sort(learnt_clause_indices.begin(), learnt_clause_indices.end(),
+       [&](int clause_idx_a, int clause_idx_b) {
+         return clauses_[clause_idx_a].activity <
+                clauses_[clause_idx_b].activity;
+       });
+
+  // Binary clauses and reasons of current assignments are kept.
+
+  for (int i = 0; i < learnt_clause_indices.size() / 2; ++i) {
+    Clause& clause = clauses_[learnt_clause_indices[i]];
+    const int variable = ToVariable(clause.literals[0]);
+
+    if (clause.literals.size() == 2 ||
+        (value_by_variable_[variable] != 0 &&
+         reason_clause_idx_by_variable_[variable] ==
+             learnt_clause_indices[i])) {
+      continue;
+    }
+
+    clause.is_deleted = true;
+    vector<int>().swap(clause.literals);
+    --num_learnt_clauses_;
+  }
+}
+
+SatResult SatSolver::Search(int max_num_search_conflicts) {
+  vector<int> learnt_literals;
+  int num_search_conflicts = 0;
+
+  while (true) {
+    const int conflict_clause_idx = Propagate();
+
+    if (conflict_clause_idx != UNDEFINED_ID) {
+      ++num_conflicts_;
+      ++num_search_conflicts;
+
+      if (decision_level() == 0) {
+        return SatResult::UNSATISFIABLE;
+      }
+
+      int backjump_level = 0;
+      Analyze(conflict_clause_idx, learnt_literals, backjump_level);
+      CancelUntil(backjump_level);
+
+      if (learnt_literals.size() == 1) {
+        Enqueue(learnt_literals[0], UNDEFINED_ID);
+      } else {
+        Enqueue(learnt_literals[0], AddLearntClause(learnt_literals));
+      }
+
+      DecayActivities();
+
+      continue;
+    }
+
+    if (num_search_conflicts >= max_num_search_conflicts) {
+      CancelUntil(0);
+
+      return SatResult::UNKNOWN;
+    }
+
+    if (num_learnt_clauses_ - static_cast<int>(trail_.size()) >=
+        max_num_learnt_clauses_) {
+      ReduceLearntClauses();
+      max_num_learnt_clauses_ += max_num_learnt_clauses_ / 10;
+    }
+
+    const int literal = PickBranchLiteral();
+
+    if (literal == UNDEFINED_ID) {
+      return SatResult::SATISFIABLE;
+    }
+
+    ++num_decisions_;
+    trail_begin_idx_by_level_.push_back(trail_.size());
+    Enqueue(literal, UNDEFINED_ID);
+  }
+}
+
+void SatSolver::BumpVariable(int variable) {
+  activity_by_variable_[variable] += variable_activity_increment_;
+
+  if (activity_by_variable_[variable] > MAX_ACTIVITY) {
+    for (int i = 0; i < num_variables_; ++i) {
+      activity_by_variable_[i] /= MAX_ACTIVITY;
+    }
+    variable_activity_increment_ /= MAX_ACTIVITY;
+  }
+
+  if (IsVariableInHeap(variable)) {
+    PercolateUp(heap_idx_by_variable_[variable]);
+  }
+}
+
+void SatSolver::BumpClause(int clause_idx) {
+  clauses_[clause_idx].activity += clause_activity_increment_;
+
+  if (clauses_[clause_idx].activity > MAX_ACTIVITY) {
+    for (int i = 0; i < clauses_.size(); ++i) {
+      if (clauses_[i].is_learnt) {
+        clauses_[i].activity /= MAX_ACTIVITY;
+      }
+    }
+    clause_activity_increment_ /= MAX_ACTIVITY;
+  }
+}
+
+void SatSolver::DecayActivities() {
+  variable_activity_increment_ /= VARIABLE_ACTIVITY_DECAY;
+  clause_activity_increment_ /= CLAUSE_ACTIVITY_DECAY;
+}
+
+bool SatSolver::IsVariableInHeap(int variable) const {
+  return heap_idx_by_variable_[variable] != UNDEFINED_ID;
+}
+
+void SatSolver::InsertVariableIntoHeap(int variable) {
+  heap_idx_by_variable_[variable] = heap_.size();
+  heap_.push_back(variable);
+  PercolateUp(heap_.size() - 1);
+}
+
+int SatSolver::PopVariableFromHeap() {
+  const int variable = heap_[0];
+
+  heap_[0] = heap_.back();
+  heap_idx_by_variable_[heap_[0]] = 0;
+  heap_.pop_back();
+  heap_idx_by_variable_[variable] = UNDEFINED_ID;
+
+  if (!heap_.empty()) {
+    PercolateDown(0);
+  }
+
+  return variable;
+}
+
+void SatSolver::PercolateUp(int heap_idx) {
+  const int variable = heap_[heap_idx];
+
+  while (heap_idx > 0) {
+    const int parent_heap_idx = (heap_idx - 1) / 2;
+
+    if (activity_by_variable_[heap_[parent_heap_idx]] >=
+        activity_by_variable_[variable]) {
+      break;
+    }
+
+    heap_[heap_idx] = heap_[parent_heap_idx];
+    heap_idx_by_variable_[heap_[heap_idx]] = heap_idx;
+    heap_idx = parent_heap_idx;
+  }
+
+  heap_[heap_idx] = variable;
+  heap_idx_by_variable_[variable] = heap_idx;
+}
+
+void SatSolver::PercolateDown(int heap_idx) {
+  const int variable = heap_[heap_idx];
+
+  while (2 * heap_idx + 1 < heap_.size()) {
+    int child_heap_idx = 2 * heap_idx + 1;
+
+    if (child_heap_idx + 1 < heap_.size() &&
+        activity_by_variable_[heap_[child_heap_idx + 1]] >
+            activity_by_variable_[heap_[child_heap_idx]]) {
+      ++child_heap_idx;
+    }
+
+    if (activity_by_variable_[heap_[child_heap_idx]] <=
+        activity_by_variable_[variable]) {
+      break;
+    }
+
+    heap_[heap_idx] = heap_[child_heap_idx];
+    heap_idx_by_variable_[heap_[heap_idx]] = heap_idx;
+    heap_idx = child_heap_idx;
+  }
+
+  heap_[heap_idx] = variable;
+  heap_idx_by_variable_[variable] = heap_idx;
+}
+
+ostream& operator<<(ostream& os, const SatResult& result) {
+  switch (result) {
+    case SatResult::SATISFIABLE: {
+      os << "SATISFIABLE";
+      break;
+    }
+    case SatResult::UNSATISFIABLE: {
+      os << "UNSATISFIABLE";
+      break;
+    }
+    case SatResult::UNKNOWN: {
+      os << "UNKNOWN";
+      break;
+    }
+    default: { break; }
+  }
+
+  return os;
+}
@@ -0,0 +1,111 @@
+#ifndef SAT_SOLVER_HPP
+#define SAT_SOLVER_HPP
+
+#include <iostream>
+#include <vector>
+
+// Conflict-driven clause learning (CDCL) SAT solver. Clauses are given as
+// DIMACS literals, i.e. variable v >= 1 as v and its negation as -v, and kept
+// in memory, so no CNF or result file is needed.
+//
+// Unit propagation uses two watched literals per clause. A conflict is
+// analysed back to its first unique implication point, and the learnt clause
+// is minimized against the reasons of its literals before backjumping.
+// Decisions follow VSIDS with phase saving, restarts follow the Luby sequence,
+// and the less active half of the learnt clauses is dropped when they grow
+// too many.
+
+// Solve never returns UNKNOWN, only a search that reaches its restart limit
+// does.
+enum class SatResult { SATISFIABLE, UNSATISFIABLE, UNKNOWN };
+
+class SatSolver {
+ public:
+  SatSolver();
+
+  // Add a clause between solves. Variables are created as they appear.
+  // Duplicate literals are merged and tautologies dropped.
+  void AddClause(const std::vector<int>& literals);
+  void AddClause(const int* literals, int num_literals);
+  // Restarts until the problem is decided, with no conflict limit.
+  SatResult Solve();
+
+  // Getters
+
+  int num_variables() const;
+  int num_clauses() const;
+  int num_conflicts() const;
+  int num_decisions() const;
+  // Value of the variable in the model of the last satisfiable solve.
+  bool value(int variable) const;
+
+ private:
+  struct Clause {
+    // Internal literals. The first two are watched, and the first one is
+    // the implied literal of a reason clause.
+    std::vector<int> literals;
+    bool is_learnt;
+    bool is_deleted;
+    double activity;
+  };
+
+  void AddVariables(int num_variables);
+  // Value of an internal literal: 1 true, -1 false, 0 unassigned.
+  signed char ComputeLiteralValue(int literal) const;
+  int decision_level() const;
+  void Enqueue(int literal, int reason_clause_idx);
+  // Index of a conflicting clause, UNDEFINED_ID if there is none.
+  int Propagate();
+  // Learnt clause of the conflict, its asserting literal first and a literal
+  // of the backjump level second.
+  void Analyze(int conflict_clause_idx, std::vector<int>& learnt_literals,
+               int& backjump_level);
+  // Whether the literal is implied by the other literals of the learnt
+  // clause, looking one reason deep.
+  bool IsLiteralRedundant(int literal) const;
+  void CancelUntil(int level);
+  // Unassigned literal of the most active variable in its saved phase,
+  // UNDEFINED_ID if all are assigned.
+  int PickBranchLiteral();
+  int AddLearntClause(const std::vector<int>& literals);
+  void ReduceLearntClauses();
+  SatResult Search(int max_num_search_conflicts);
+
+  void BumpVariable(int variable);
+  void BumpClause(int clause_idx);
+  void DecayActivities();
+
+  // Max-heap of variables by activity.
+  bool IsVariableInHeap(int variable) const;
+  void InsertVariableIntoHeap(int variable);
+  int PopVariableFromHeap();
+  void PercolateUp(int heap_idx);
+  void PercolateDown(int heap_idx);
+
+  int num_variables_;
+  int num_learnt_clauses_;
+  int max_num_learnt_clauses_;
+  int num_conflicts_;
+  int num_decisions_;
+  bool is_unsatisfiable_;
+  std::vector<Clause> clauses_;
+  std::vector<std::vector<int>> watched_clause_indices_by_literal_;
+  std::vector<signed char> value_by_variable_;
+  std::vector<int> level_by_variable_;
+  std::vector<int> reason_clause_idx_by_variable_;
+  std::vector<char> saved_phase_by_variable_;
+  std::vector<char> is_seen_by_variable_;
+  std::vector<int> trail_;
+  std::vector<int> trail_begin_idx_by_level_;
+  int propagation_idx_;
+  std::vector<double> activity_by_variable_;
+  double variable_activity_increment_;
+  double clause_activity_increment_;
+  std::vector<int> heap_;
+  std::vector<int> heap_idx_by_variable_;
+  std::vector<char> model_;
+};
+
+std::ostream& operator<<(std::ostream& os, const SatResult& result);
+
+#endif
@@ -0,0 +1,302 @@
+#include "site_occupancy_map.hpp"
+
+#include "../util/const.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+const int NUM_WORD_BITS = 64;
+const uint64_t FULL_WORD = ~uint64_t(0);
+
+SiteOccupancyMap::SiteOccupancyMap()
+    : num_rows_(0),
+      num_row_sites_(0),
+      num_row_words_(0),
+      fence_region_words_(),
+      occupied_words_() {
+}
+
+void SiteOccupancyMap::Initialize(const Database& database) {
+  num_rows_ = database.num_rows();
+  num_row_sites_ = database.num_sites() / num_rows_;
+  num_row_words_ = (num_row_sites_ + NUM_WORD_BITS - 1) / NUM_WORD_BITS;
+
+  fence_region_words_.assign(
+      (database.num_fence_regions() + 1) * num_rows_ * num_row_words_, 0);
+  occupied_words_.assign(num_rows_ * num_row_words_, 0);
+
+  // Sites are created row by row from the bottom left.
+
+  for (int i = 0; i < num_rows_; ++i) {
+    for (int j = 0; j < num_row_sites_; ++j) {
+      const Site& site = database.site(SiteId(i * num_row_sites_ + j));
+      const uint64_t bit = uint64_t(1) << (j % NUM_WORD_BITS);
+      const int word_idx = i * num_row_words_ + j / NUM_WORD_BITS;
+
+      if (site.is_valid()) {
+        fence_region_words_[(site.fence_region_id() + 1) * num_rows_ *
+                                num_row_words_ +
+                            word_idx] |= bit;
+      }
+      if (site.has_sub_instance()) {
+        occupied_words_[word_idx] |= bit;
+      }
+    }
+  }
+}
+
+// Getters
+
+int SiteOccupancyMap::num_word_sites() {
+  return NUM_WORD_BITS;
+}
+
+int SiteOccupancyMap::num_row_sites() const {
+  return num_row_sites_;
+}
+
+int SiteOccupancyMap::FindFreeSitesAfter(FenceRegionId fence_region_id,
+                                         int row_idx, int num_rows,
+                                         int num_sites, int begin_site_idx,
+                                         int end_site_idx) const {
+  assert(row_idx >= 0 && row_idx + num_rows <= num_rows_ && num_sites > 0);
+
+  begin_site_idx = max(begin_site_idx, 0);
+  end_site_idx = min(end_site_idx, num_row_sites_ - num_sites);
+
+  // Scan rightwards, skipping zeros and counting ones a word at a time. Bits
+  // past the row end are zero, so no run crosses it.
+
+  int site_idx = begin_site_idx;
+  int run_begin_site_idx = begin_site_idx;
+  int run_length = 0;
+
+  while (run_length > 0 || site_idx <= end_site_idx) {
+    const int bit_idx = site_idx % NUM_WORD_BITS;
+    uint64_t word = ComputeFreeWord(fence_region_id, row_idx, num_rows,
+                                    site_idx / NUM_WORD_BITS) >>
+                    bit_idx;
+    int num_bits = NUM_WORD_BITS - bit_idx;
+
+    if (run_length == 0) {
+      if (word == 0) {
+        site_idx += num_bits;
+
+        continue;
+      }
+
+      const int num_zeros = __builtin_ctzll(word);
+
+      site_idx += num_zeros;
+      word >>= num_zeros;
+      num_bits -= num_zeros;
+
+      if (site_idx > end_site_idx) {
+        break;
+      }
+
+      run_begin_site_idx = site_idx;
+    }
+
+    const int num_ones = (word == FULL_WORD) ? NUM_WORD_BITS
+                                             : __builtin_ctzll(~word);
+
+    run_length += num_ones;
+    site_idx += num_ones;
+
+    if (run_length >= num_sites) {
+      return run_begin_site_idx;
+    }
+    if (num_ones < num_bits) {
+      run_length = 0;
+    }
+  }
+
+  return UNDEFINED_ID;
+}
+
+int SiteOccupancyMap::FindFreeSitesBefore(FenceRegionId fence_region_id,
+                                          int row_idx, int num_rows,
+                                          int num_sites, int begin_site_idx,
+                                          int end_site_idx) const {
+  assert(row_idx >= 0 && row_idx + num_rows <= num_rows_ && num_sites > 0);
+
+  begin_site_idx = max(begin_site_idx, 0);
+  end_site_idx = min(end_site_idx, num_row_sites_ - num_sites);
+
+  // Scan leftwards from the last site a run starting at end_site_idx covers.
+  // The first long enough run gives the largest start.
+
+  int site_idx = end_site_idx + num_sites - 1;
+  int run_end_site_idx = site_idx;
+  int run_length = 0;
+
+  while (run_length > 0 || site_idx - num_sites + 1 >= begin_site_idx) {
+    const int bit_idx = site_idx % NUM_WORD_BITS;
+    uint64_t word = ComputeFreeWord(fence_region_id, row_idx, num_rows,
+                                    site_idx / NUM_WORD_BITS)
+                    << (NUM_WORD_BITS - 1 - bit_idx);
+    int num_bits = bit_idx + 1;
+
+    if (run_length == 0) {
+      if (word == 0) {
+        site_idx -= num_bits;
+
+        continue;
+      }
+
+      const int num_zeros = __builtin_clzll(word);
+
+      site_idx -= num_zeros;
+      word <<= num_zeros;
+      num_bits -= num_zeros;
+
+      if (site_idx - num_sites + 1 < begin_site_idx) {
+        break;
+      }
+
+      run_end_site_idx = site_idx;
+    }
+
+    const int num_ones = (word == FULL_WORD) ? NUM_WORD_BITS
+                                             : __builtin_clzll(~word);
+
+    run_length += num_ones;
+    site_idx -= num_ones;
+
+    if (run_length >= num_sites) {
+      return run_end_site_idx - num_sites + 1;
+    }
+    if (num_ones < num_bits) {
+      run_length = 0;
+    }
+  }
+
+  return UNDEFINED_ID;
+}
+
+int SiteOccupancyMap::FindNearestFreeSites(FenceRegionId fence_region_id,
+                                           int row_idx, int num_rows,
+                                           int num_sites, int site_idx,
+                                           int begin_site_idx,
+                                           int end_site_idx) const {
+  const int right_site_idx = FindFreeSitesAfter(
+      fence_region_id, row_idx, num_rows, num_sites,
+      max(site_idx, begin_site_idx), end_site_idx);
+  const int left_site_idx = FindFreeSitesBefore(
+      fence_region_id, row_idx, num_rows, num_sites, begin_site_idx,
+      min(site_idx - 1, end_site_idx));
+
+  if (left_site_idx != UNDEFINED_ID &&
+      (right_site_idx == UNDEFINED_ID ||
+       site_idx - left_site_idx <= right_site_idx - site_idx)) {
+    return left_site_idx;
+  }
+
+  return right_site_idx;
+}
+
+bool SiteOccupancyMap::AreSitesInFenceRegion(FenceRegionId fence_region_id,
+                                             int row_idx, int begin_site_idx,
+                                             int num_sites) const {
+  assert(row_idx >= 0 && row_idx < num_rows_);
+
+  if (begin_site_idx < 0 || begin_site_idx + num_sites > num_row_sites_) {
+    return false;
+  }
+
+  const uint64_t* row_words =
+      &fence_region_words_[((fence_region_id + 1) * num_rows_ + row_idx) *
+                           num_row_words_];
+
+  for (int site_idx = begin_site_idx; site_idx < begin_site_idx + num_sites;) {
+    const int bit_idx = site_idx % NUM_WORD_BITS;
+    const int num_bits =
+        min(NUM_WORD_BITS - bit_idx, begin_site_idx + num_sites - site_idx);
+    const uint64_t mask =
+        (num_bits == NUM_WORD_BITS ? FULL_WORD
+                                   : ((uint64_t(1) << num_bits) - 1))
+        << bit_idx;
+
+    if ((row_words[site_idx / NUM_WORD_BITS] & mask) != mask) {
+      return false;
+    }
+
+    site_idx += num_bits;
+  }
+
+  return true;
+}
+
+int SiteOccupancyMap::FindOccupiedSiteAfter(int row_idx, int begin_site_idx,
+                                            int end_site_idx) const {
+  assert(row_idx >= 0 && row_idx < num_rows_);
+
+  begin_site_idx = max(begin_site_idx, 0);
+  end_site_idx = min(end_site_idx, num_row_sites_);
+
+  const uint64_t* row_words = &occupied_words_[row_idx * num_row_words_];
+
+  for (int site_idx = begin_site_idx; site_idx < end_site_idx;) {
+    const int bit_idx = site_idx % NUM_WORD_BITS;
+    const uint64_t word = row_words[site_idx / NUM_WORD_BITS] >> bit_idx;
+
+    if (word != 0) {
+      const int occupied_site_idx = site_idx + __builtin_ctzll(word);
+
+      return (occupied_site_idx < end_site_idx) ? occupied_site_idx
+                                                : UNDEFINED_ID;
+    }
+
+    site_idx += NUM_WORD_BITS - bit_idx;
+  }
+
+  return UNDEFINED_ID;
+}
+
+// Setters
+
+void SiteOccupancyMap::set_is_occupied(int row_idx, int begin_site_idx,
+                                       int num_sites, bool is_occupied) {
+  assert(row_idx >= 0 && row_idx < num_rows_);
+  assert(begin_site_idx >= 0 && begin_site_idx + num_sites <= num_row_sites_);
+
+  uint64_t* row_words = &occupied_words_[row_idx * num_row_words_];
+
+  for (int site_idx = begin_site_idx; site_idx < begin_site_idx + num_sites;) {
+    const int bit_idx = site_idx % NUM_WORD_BITS;
+    const int num_bits =
+        min(NUM_WORD_BITS - bit_idx, begin_site_idx + num_sites - site_idx);
+    const uint64_t mask =
+        (num_bits == NUM_WORD_BITS ? FULL_WORD
+                                   : ((uint64_t(1) << num_bits) - 1))
+        << bit_idx;
+
+    if (is_occupied) {
+      row_words[site_idx / NUM_WORD_BITS] |= mask;
+    } else {
+      row_words[site_idx / NUM_WORD_BITS] &= ~mask;
+    }
+
+    site_idx += num_bits;
+  }
+}
+
+// Private members
+
+uint64_t SiteOccupancyMap::ComputeFreeWord(FenceRegionId fence_region_id,
+                                           int row_idx, int num_rows,
+                                           int word_idx) const {
+  const uint64_t* fence_region_words =
+      &fence_region_words_[(fence_region_id + 1) * num_rows_ * num_row_words_];
+
+  uint64_t word = FULL_WORD;
+  for (int i = row_idx; i < row_idx + num_rows; ++i) {
+    word &= fence_region_words[i * num_row_words_ + word_idx] &
+            ~occupied_words_[i * num_row_words_ + word_idx];
+  }
+
+  return word;
+}
@@ -0,0 +1,76 @@
+#ifndef SITE_OCCUPANCY_MAP_HPP
+#define SITE_OCCUPANCY_MAP_HPP
+
+#include "../database/database.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Bit-packed mirror of the site states. Per row, one bit per site tells
+// whether the site is occupied, and per fence region (including the default
+// one) whether it is valid and belongs to the region. Free runs spanning
+// several rows are searched 64 sites at a time.
+//
+// Sites are addressed by row index and site index in the row.
+
+class SiteOccupancyMap {
+ public:
+  SiteOccupancyMap();
+
+  // Rebuild from the validity, fence regions and occupation of the sites.
+  void Initialize(const Database& database);
+
+  // Getters
+
+  // Sites per occupancy word. Writes to sites in different words of a row
+  // do not race.
+  static int num_word_sites();
+  int num_row_sites() const;
+
+  // Smallest site index in [begin_site_idx, end_site_idx] at which
+  // num_sites sites of rows row_idx to row_idx + num_rows - 1 are all free
+  // and in the fence region, UNDEFINED_ID if there is none.
+  int FindFreeSitesAfter(FenceRegionId fence_region_id, int row_idx,
+                         int num_rows, int num_sites, int begin_site_idx,
+                         int end_site_idx) const;
+  // Largest such site index in [begin_site_idx, end_site_idx].
+  int FindFreeSitesBefore(FenceRegionId fence_region_id, int row_idx,
+                          int num_rows, int num_sites, int begin_site_idx,
+                          int end_site_idx) const;
+  // Such site index in [begin_site_idx, end_site_idx] nearest to site_idx,
+  // the smaller one on a tie.
+  int FindNearestFreeSites(FenceRegionId fence_region_id, int row_idx,
+                           int num_rows, int num_sites, int site_idx,
+                           int begin_site_idx, int end_site_idx) const;
+
+  // Whether sites [begin_site_idx, begin_site_idx + num_sites) of the row are
+  // all valid and in the fence region, occupied or not.
+  bool AreSitesInFenceRegion(FenceRegionId fence_region_id, int row_idx,
+                             int begin_site_idx, int num_sites) const;
+  // Smallest occupied site index of the row in [begin_site_idx,
+  // end_site_idx), UNDEFINED_ID if there is none.
+  int FindOccupiedSiteAfter(int row_idx, int begin_site_idx,
+                            int end_site_idx) const;
+
+  // Setters
+
+  void set_is_occupied(int row_idx, int begin_site_idx, int num_sites,
+                       bool is_occupied);
+
+ private:
+  // Bit i is set if site word_idx * 64 + i is free and in the fence region
+  // in all the rows.
+  uint64_t ComputeFreeWord(FenceRegionId fence_region_id, int row_idx,
+                           int num_rows, int word_idx) const;
+
+  int num_rows_;
+  int num_row_sites_;
+  int num_row_words_;
+  // Words of fence region f (UNDEFINED_ID for the default region) in row r
+  // start at ((f + 1) * num_rows_ + r) * num_row_words_.
+  std::vector<uint64_t> fence_region_words_;
+  // Words of row r start at r * num_row_words_.
+  std::vector<uint64_t> occupied_words_;
+};
+
+#endif
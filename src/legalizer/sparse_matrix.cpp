@@ -8,7 +8,6 @@
 using namespace std;
 
 using Index = Eigen::Index;
-using Triplet = Eigen::Triplet<double>;
 
 bool IsMatrixSymmetric(const SparseMatrix& matrix) {
   assert(matrix.rows() == matrix.cols());
@@ -87,6 +86,18 @@ SparseMatrix ConcatenateMatricesHorizontally(const SparseMatrix& left_matrix,
   return concatenated_matrix;
 }
 
+void AppendMatrixTriplets(const SparseMatrix& matrix, Index row_offset,
+                          Index col_offset, double multiplier,
+                          vector<Triplet>& non_zero_elements) {
+  for (Index i = 0; i < matrix.outerSize(); ++i) {
+    for (SparseMatrix::InnerIterator it(matrix, i); it; ++it) {
+      non_zero_elements.push_back(Triplet(row_offset + it.row(),
+                                          col_offset + it.col(),
+                                          multiplier * it.value()));
+    }
+  }
+}
+
 // Solve AX = B.
 SparseMatrix SolveLinearSystem(const SparseMatrix& A, const SparseMatrix& B) {
   SparseMatrix X;
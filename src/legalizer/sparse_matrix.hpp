@@ -5,7 +5,10 @@
 
 #include <Eigen/Sparse>
 
+#include <vector>
+
 using SparseMatrix = Eigen::SparseMatrix<double>;
+using Triplet = Eigen::Triplet<double>;
 
 bool IsMatrixSymmetric(const SparseMatrix& matrix);
 SparseMatrix MakeIdentityMatrix(Eigen::Index num_rows);
@@ -13,6 +16,11 @@ SparseMatrix ConcatenateMatricesVertically(const SparseMatrix& upper_matrix,
                                            const SparseMatrix& lower_matrix);
 SparseMatrix ConcatenateMatricesHorizontally(const SparseMatrix& left_matrix,
                                              const SparseMatrix& right_matrix);
+// Append the nonzeros of multiplier * matrix placed at (row_offset,
+// col_offset), for assembling a block matrix with a single setFromTriplets.
+void AppendMatrixTriplets(const SparseMatrix& matrix, Eigen::Index row_offset,
+                          Eigen::Index col_offset, double multiplier,
+                          std::vector<Triplet>& non_zero_elements);
 SparseMatrix SolveLinearSystem(const SparseMatrix& A, const SparseMatrix& B);
 SparseMatrix InverseMatrix(const SparseMatrix& matrix);
 SparseMatrix InverseDiagonalMatrix(const SparseMatrix& diagonal_matrix);
@@ -1,6 +1,8 @@
 #include "legalizer/legalizer.hpp"
 #include "legalizer/detailed.hpp"
+#include "legalizer/legality_checker.hpp"
 #include "parser/parser.hpp"
+#include "util/const.hpp"
 
 #ifdef OMP
 #include <omp.h>
@@ -28,6 +30,22 @@ int main(int argc, char* argv[]) {
     ("placement_constraints", po::value<string>()->value_name("FILE")->required(), "Placement constraints")
     ("output_def", po::value<string>()->value_name("FILE")->required(), "Legalization result")
     ("cpu", po::value<int>()->value_name("NUM")->default_value(1), "# of CPUs")
+    ("decompose_mmsim", "Solve independent MMSIM components in parallel")
+    ("solve_single_rows_exactly", "Solve rows without multi-row-height instances exactly instead of by MMSIM")
+    ("mmsim_solver", po::value<string>()->value_name("NAME")->default_value("block"), "MMSIM linear solver: block, lu, bicgstab or gmres")
+    ("mmsim_precision", po::value<string>()->value_name("NAME")->default_value("double"), "MMSIM precision: double, or mixed to iterate in float and refine in double (block solver only, saves memory bandwidth, not memory)")
+    ("mmsim_freeze_iterations", po::value<int>()->value_name("NUM")->default_value(0), "Freeze MMSIM cells stable for NUM iterations (0: off)")
+    ("spread_instances", "Diffuse cells out of bins above the density target before assigning rows")
+    ("align_rows_in_parallel", "Assign cells to rows speculatively in parallel, with the serial result")
+    ("legalize_windows", "Place cells inside windows of the die in parallel before the serial passes")
+    ("eco_moves", po::value<string>()->value_name("FILE"), "Move global placed cells by the \"name dx dy\" lines of FILE and legalize again from the previous solution")
+    ("resolve_edge_spacing", "Push cells apart in parallel per row to meet edge type spacing after legalization")
+    ("sat_input", po::value<string>()->value_name("FILE"), "Write the SAT problem of detailed placement as DIMACS CNF")
+    ("sat_output", po::value<string>()->value_name("FILE"), "Read the SAT model of detailed placement from a solver result instead of solving")
+    ("partition_sat", "Solve rows not coupled by multi-row-height instances as separate SAT problems in parallel")
+    ("dynamic_programming", "Remove forbidden DDA pairs by exact per-row dynamic programming instead of SAT")
+    ("swap_adjacent_instances", "Let the dynamic programming also swap adjacent single-row-height instances")
+    ("legality_report", po::value<string>()->value_name("FILE"), "Write all legality violations of the result as JSON")
     ("pgp", po::value<string>()->value_name("FILE"), "Plot global placement")
     ("plg", po::value<string>()->value_name("FILE"), "Plot legalization result")
     ;
@@ -69,6 +87,31 @@ int main(int argc, char* argv[]) {
       arguments["placement_constraints"].as<string>();
   const string legalized_def_name = arguments["output_def"].as<string>();
   const int num_cpus = arguments["cpu"].as<int>();
+  const string mmsim_solver_name = arguments["mmsim_solver"].as<string>();
+  const string mmsim_precision_name = arguments["mmsim_precision"].as<string>();
+  const int mmsim_freeze_iterations =
+      arguments["mmsim_freeze_iterations"].as<int>();
+
+  MmsimLinearSolver mmsim_linear_solver = MmsimLinearSolver::BLOCK_TRIANGULAR;
+  if (mmsim_solver_name == "lu") {
+    mmsim_linear_solver = MmsimLinearSolver::LU;
+  } else if (mmsim_solver_name == "bicgstab") {
+    mmsim_linear_solver = MmsimLinearSolver::BICGSTAB;
+  } else if (mmsim_solver_name == "gmres") {
+    mmsim_linear_solver = MmsimLinearSolver::GMRES;
+  } else if (mmsim_solver_name != "block") {
+    throw po::validation_error(po::validation_error::invalid_option_value,
+                               "mmsim_solver", mmsim_solver_name);
+  }
+
+  MmsimPrecision mmsim_precision = MmsimPrecision::DOUBLE;
+  if (mmsim_precision_name == "mixed" &&
+      mmsim_linear_solver == MmsimLinearSolver::BLOCK_TRIANGULAR) {
+    mmsim_precision = MmsimPrecision::MIXED;
+  } else if (mmsim_precision_name != "double") {
+    throw po::validation_error(po::validation_error::invalid_option_value,
+                               "mmsim_precision", mmsim_precision_name);
+  }
 
 #ifdef OMP
   omp_set_num_threads(num_cpus);
@@ -85,12 +128,65 @@ int main(int argc, char* argv[]) {
   
   //only check whethether legal	
   Legalizer legalizer(database);
+  legalizer.set_is_mmsim_decomposed(arguments.count("decompose_mmsim") == 1);
+  legalizer.set_is_single_row_solved_exactly(
+      arguments.count("solve_single_rows_exactly") == 1);
+  legalizer.set_mmsim_freeze_iterations(mmsim_freeze_iterations);
+  legalizer.set_mmsim_linear_solver(mmsim_linear_solver);
+  legalizer.set_mmsim_precision(mmsim_precision);
+  legalizer.set_is_placement_spread(arguments.count("spread_instances") == 1);
+  legalizer.set_is_row_alignment_parallel(
+      arguments.count("align_rows_in_parallel") == 1);
+  legalizer.set_is_window_legalized(arguments.count("legalize_windows") == 1);
+  legalizer.set_is_edge_spacing_resolved(
+      arguments.count("resolve_edge_spacing") == 1);
   legalizer.Legalize();
+
+  if (arguments.count("eco_moves") == 1) {
+    const string eco_moves_name = arguments["eco_moves"].as<string>();
+    ifstream eco_moves(eco_moves_name);
+    if (!eco_moves) {
+      cout << "Fail to open file: " << eco_moves_name << endl;
+      return 1;
+    }
+
+    vector<InstanceId> moved_instance_ids;
+    string instance_name;
+    double dx, dy;
+    while (eco_moves >> instance_name >> dx >> dy) {
+      const InstanceId instance_id =
+          database.instance_id_by_name(instance_name);
+      if (instance_id == UNDEFINED_ID ||
+          database.instance(instance_id).is_fixed()) {
+        cout << "Skip ECO move of " << instance_name << endl;
+        continue;
+      }
+
+      Instance& instance = database.instance(instance_id);
+      const Point& position = instance.global_placed_position();
+      instance.set_global_placed_position(
+          Point(position.x() + dx, position.y() + dy));
+      moved_instance_ids.push_back(instance_id);
+    }
+
+    cout << "Legalize again after " << moved_instance_ids.size()
+         << " ECO moves..." << endl;
+    legalizer.Relegalize(moved_instance_ids);
+  }
   
   
   //Detailed Placement
   Detailed detailed(database);
   detailed.PreDetailedPlacement();
+  if (arguments.count("sat_input") == 1) {
+    detailed.set_sat_input_file_name(arguments["sat_input"].as<string>());
+  }
+  if (arguments.count("sat_output") == 1) {
+    detailed.set_sat_output_file_name(arguments["sat_output"].as<string>());
+  }
+  detailed.set_is_sat_partitioned(arguments.count("partition_sat") == 1);
+  detailed.set_is_adjacent_swap_allowed(
+      arguments.count("swap_adjacent_instances") == 1);
   
   //Before Detailed Placement
   if (arguments.count("pgp") == 1) {
@@ -101,29 +197,27 @@ int main(int argc, char* argv[]) {
   
   clock_t start,finish;
   double Runtime=0.0;
-  start=clock();
-  detailed.PreSATMethod();
-  finish=clock();
-  Runtime=(double)(finish-start)/CLOCKS_PER_SEC;
-  cout<<"===> Pre SAT Method Time: "<<Runtime<<"..."<<endl;
-  cout<<"============================================================"<<endl;
-  //system("cd");
-  //system("cd final/open-wbo/open-wbo/");
-  //system("./open-wbo ~/final/lsv/pre/input > ~/final/lsv/post/output");
-  start=clock();
-  detailed.PostSATMethod();
-  finish=clock();
-  Runtime=(double)(finish-start)/CLOCKS_PER_SEC;
-  cout<<"===> Post SAT Method Time: "<<Runtime<<"..."<<endl;
-  cout<<"============================================================"<<endl;
-  /*clock_t start,finish;
-  double Runtime=0.0;
-  start=clock();
-  detailed.DPMethod();
-  finish=clock();
-  Runtime=(double)(finish-start)/CLOCKS_PER_SEC;
-  cout<<"===> Dynamic Programming Time: "<<Runtime<<"..."<<endl;
-  cout<<"============================================================"<<endl;*/
+  if (arguments.count("dynamic_programming") == 1) {
+    start=clock();
+    detailed.DPMethod();
+    finish=clock();
+    Runtime=(double)(finish-start)/CLOCKS_PER_SEC;
+    cout<<"===> Dynamic Programming Time: "<<Runtime<<"..."<<endl;
+    cout<<"============================================================"<<endl;
+  } else {
+    start=clock();
+    detailed.PreSATMethod();
+    finish=clock();
+    Runtime=(double)(finish-start)/CLOCKS_PER_SEC;
+    cout<<"===> Pre SAT Method Time: "<<Runtime<<"..."<<endl;
+    cout<<"============================================================"<<endl;
+    start=clock();
+    detailed.PostSATMethod();
+    finish=clock();
+    Runtime=(double)(finish-start)/CLOCKS_PER_SEC;
+    cout<<"===> Post SAT Method Time: "<<Runtime<<"..."<<endl;
+    cout<<"============================================================"<<endl;
+  }
   //const string plot_name1 = arguments["pgp"].as<string>();
 
   const double total_displacement = database.ComputeTotalDisplacement();
@@ -136,6 +230,14 @@ int main(int argc, char* argv[]) {
                   "After Detailed Placement" + to_string(total_displacement));
   }
 
+  if (arguments.count("legality_report") == 1) {
+    const string report_name = arguments["legality_report"].as<string>();
+    LegalityChecker legality_checker(database);
+    legality_checker.Check();
+    ofstream report(report_name);
+    legality_checker.Report(report);
+  }
+
  
   //parser.OutputDef(global_placed_def_name, legalized_def_name);
 